@@ -0,0 +1,324 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+#include "a2s_responder.h"
+
+#define A2S_INFO 'T'
+#define A2S_PLAYER 'U'
+#define A2S_RULES 'V'
+#define A2S_GETCHALLENGE 'W'
+#define S2C_CHALLENGE 'A'
+#define S2A_INFO 'I'
+#define S2A_PLAYER 'D'
+#define S2A_RULES 'E'
+
+//"Source Engine Query" and its terminator, the challenge goes after it
+#define A2S_INFO_PAYLOAD_SIZE 20
+
+static void put_u8(std::string &p, uint8 v) { p.push_back((char)v); }
+static void put_u16(std::string &p, uint16 v) { put_u8(p, v & 0xFF); put_u8(p, v >> 8); }
+static void put_u32(std::string &p, uint32 v) { put_u16(p, v & 0xFFFF); put_u16(p, v >> 16); }
+static void put_u64(std::string &p, uint64 v) { put_u32(p, v & 0xFFFFFFFF); put_u32(p, v >> 32); }
+static void put_string(std::string &p, const std::string &s) { p.append(s.c_str()); p.push_back('\0'); }
+static void put_float(std::string &p, float f)
+{
+    uint32 v;
+    memcpy(&v, &f, sizeof(v));
+    put_u32(p, v);
+}
+
+static uint32 get_u32(const unsigned char *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32)data[3] << 24);
+}
+
+static uint64 rotl64(uint64 v, int bits) { return (v << bits) | (v >> (64 - bits)); }
+
+#define SIPROUND do { \
+    v0 += v1; v1 = rotl64(v1, 13); v1 ^= v0; v0 = rotl64(v0, 32); \
+    v2 += v3; v3 = rotl64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = rotl64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = rotl64(v1, 17); v1 ^= v2; v2 = rotl64(v2, 32); \
+} while (0)
+
+//SipHash-2-4 of a single 8 byte block
+static uint64 siphash(const uint64 key[2], uint64 m)
+{
+    uint64 v0 = 0x736f6d6570736575ULL ^ key[0];
+    uint64 v1 = 0x646f72616e646f6dULL ^ key[1];
+    uint64 v2 = 0x6c7967656e657261ULL ^ key[0];
+    uint64 v3 = 0x7465646279746573ULL ^ key[1];
+
+    v3 ^= m;
+    SIPROUND; SIPROUND;
+    v0 ^= m;
+
+    uint64 b = (uint64)8 << 56;
+    v3 ^= b;
+    SIPROUND; SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xFF;
+    SIPROUND; SIPROUND; SIPROUND; SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+A2S_Responder::A2S_Responder(const Gameserver *server, const std::map<uint64, A2S_Player> *players)
+{
+    this->server = server;
+    this->players = players;
+    outgoing.resize(A2S_OUTGOING_RING_SIZE);
+    rates.resize(A2S_RATE_TABLE_SIZE);
+    for (auto &r : rates) r.used = false;
+    std::random_device rd;
+    for (auto &k : rate_key) k = ((uint64)rd() << 32) | rd();
+    rotate_challenge_key();
+    rotate_challenge_key();
+}
+
+void A2S_Responder::build_info()
+{
+    uint32 num_players = std::max((uint32)players->size(), server->num_players());
+    info_packet.clear();
+    put_u32(info_packet, 0xFFFFFFFF);
+    put_u8(info_packet, S2A_INFO);
+    put_u8(info_packet, 0x11); //protocol
+    put_string(info_packet, server->server_name());
+    put_string(info_packet, server->map_name());
+    put_string(info_packet, server->mod_dir());
+    put_string(info_packet, server->game_description());
+    put_u16(info_packet, server->appid() & 0xFFFF);
+    put_u8(info_packet, std::min(num_players, (uint32)255));
+    put_u8(info_packet, std::min(server->max_player_count(), (uint32)255));
+    put_u8(info_packet, std::min(server->bot_player_count(), (uint32)255));
+    put_u8(info_packet, server->dedicated_server() ? 'd' : 'l');
+#if defined(STEAM_WIN32)
+    put_u8(info_packet, 'w');
+#else
+    put_u8(info_packet, 'l');
+#endif
+    put_u8(info_packet, server->password_protected());
+    put_u8(info_packet, server->secure());
+    put_string(info_packet, std::to_string(server->version()));
+
+    uint8 edf = 0x80 | 0x10 | 0x01;
+    if (server->spectator_port()) edf |= 0x40;
+    if (server->tags().size()) edf |= 0x20;
+    put_u8(info_packet, edf);
+    put_u16(info_packet, server->port());
+    put_u64(info_packet, server->id());
+    if (edf & 0x40) {
+        put_u16(info_packet, server->spectator_port());
+        put_string(info_packet, server->spectator_server_name());
+    }
+
+    if (edf & 0x20) put_string(info_packet, server->tags());
+    put_u64(info_packet, server->appid());
+    info_dirty = false;
+}
+
+void A2S_Responder::build_players()
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    players_packet.clear();
+    put_u32(players_packet, 0xFFFFFFFF);
+    put_u8(players_packet, S2A_PLAYER);
+    put_u8(players_packet, std::min(players->size(), (size_t)255));
+
+    uint8 index = 0;
+    for (auto &p : *players) {
+        if (index == 255 || players_packet.size() + p.second.name.size() + 10 > A2S_MAX_PACKET_SIZE) break;
+        put_u8(players_packet, index++);
+        put_string(players_packet, p.second.name);
+        put_u32(players_packet, p.second.score);
+        put_float(players_packet, std::chrono::duration_cast<std::chrono::duration<float>>(now - p.second.joined).count());
+    }
+
+    players_packet[5] = index;
+    players_built = now;
+    players_dirty = false;
+}
+
+void A2S_Responder::build_rules()
+{
+    unsigned next = !rules_current;
+    std::vector<std::string> &rules_packets = this->rules_packets[next];
+    std::string rules;
+    put_u32(rules, 0xFFFFFFFF);
+    put_u8(rules, S2A_RULES);
+    put_u16(rules, std::min(server->values().size(), (size_t)0xFFFF));
+    for (auto &v : server->values()) {
+        put_string(rules, v.first);
+        put_string(rules, v.second);
+    }
+
+    rules_packets.clear();
+    if (rules.size() <= A2S_MAX_PACKET_SIZE) {
+        rules_packets.push_back(rules);
+    } else {
+        uint8 total = (rules.size() + A2S_SPLIT_PAYLOAD_SIZE - 1) / A2S_SPLIT_PAYLOAD_SIZE;
+        ++split_id;
+        for (uint8 i = 0; i < total; ++i) {
+            std::string split;
+            put_u32(split, 0xFFFFFFFE);
+            put_u32(split, split_id & 0x7FFFFFFF);
+            put_u8(split, total);
+            put_u8(split, i);
+            put_u16(split, A2S_SPLIT_PAYLOAD_SIZE);
+            split.append(rules, i * A2S_SPLIT_PAYLOAD_SIZE, A2S_SPLIT_PAYLOAD_SIZE);
+            rules_packets.push_back(split);
+        }
+    }
+
+    rules_current = next;
+    rules_dirty = false;
+}
+
+void A2S_Responder::rotate_challenge_key()
+{
+    std::random_device rd;
+    memcpy(challenge_keys[1], challenge_keys[0], sizeof(challenge_keys[0]));
+    for (auto &k : challenge_keys[0]) k = ((uint64)rd() << 32) | rd();
+    challenge_rotated = std::chrono::high_resolution_clock::now();
+}
+
+//keyed hash of the source address, it can't be forged without the key
+uint32 A2S_Responder::challenge_for(uint32 ip, uint16 port, unsigned key)
+{
+    uint32 challenge = siphash(challenge_keys[key], ((uint64)ip << 16) | port);
+    if (challenge == 0xFFFFFFFF || challenge == 0) challenge = 1;
+    return challenge;
+}
+
+bool A2S_Responder::check_challenge(uint32 challenge, uint32 ip, uint16 port)
+{
+    return challenge == challenge_for(ip, port, 0) || challenge == challenge_for(ip, port, 1);
+}
+
+//token bucket per source in a fixed table, a new source evicts whatever was in its slot so it's never refused because the table is full
+bool A2S_Responder::allow(uint32 ip)
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    struct Rate &r = rates[siphash(rate_key, ip) & (A2S_RATE_TABLE_SIZE - 1)];
+    if (!r.used || r.ip != ip) {
+        r.used = true;
+        r.ip = ip;
+        r.tokens = A2S_RATE_BURST - 1.0;
+        r.last = now;
+        return true;
+    }
+
+    double elapsed = std::chrono::duration_cast<std::chrono::duration<double>>(now - r.last).count();
+    r.tokens = std::min(A2S_RATE_BURST, r.tokens + elapsed * A2S_RATE_LIMIT);
+    r.last = now;
+    if (r.tokens < 1.0) return false;
+    r.tokens -= 1.0;
+    return true;
+}
+
+bool A2S_Responder::queue(uint32 ip, uint16 port, const std::string *data, int rules_set)
+{
+    if (outgoing_count == outgoing.size()) {
+        PRINT_DEBUG("A2S outgoing ring full, dropping reply\n");
+        return false;
+    }
+
+    struct Outgoing_Packet &p = outgoing[(outgoing_head + outgoing_count) % outgoing.size()];
+    p.ip = ip;
+    p.port = port;
+    p.data = data;
+    p.rules_set = rules_set;
+    if (rules_set >= 0) ++rules_in_flight[rules_set];
+    ++outgoing_count;
+    return true;
+}
+
+void A2S_Responder::queue_challenge(uint32 ip, uint16 port)
+{
+    if (outgoing_count == outgoing.size()) return;
+
+    struct Outgoing_Packet &p = outgoing[(outgoing_head + outgoing_count) % outgoing.size()];
+    uint32 challenge = challenge_for(ip, port);
+    memset(p.challenge, 0xFF, 4);
+    p.challenge[4] = S2C_CHALLENGE;
+    for (int i = 0; i < 4; ++i) p.challenge[5 + i] = (challenge >> (i * 8)) & 0xFF;
+    p.ip = ip;
+    p.port = port;
+    p.data = NULL;
+    p.rules_set = -1;
+    ++outgoing_count;
+}
+
+bool A2S_Responder::handle_packet(const void *data, int size, uint32 ip, uint16 port)
+{
+    const unsigned char *query = (const unsigned char *)data;
+    if (!query || size < 5 || get_u32(query) != 0xFFFFFFFF) return false;
+
+    unsigned char type = query[4];
+    if (type != A2S_INFO && type != A2S_PLAYER && type != A2S_RULES && type != A2S_GETCHALLENGE) return false;
+    if (!allow(ip)) {
+        PRINT_DEBUG("A2S query from %X rate limited\n", ip);
+        return true;
+    }
+
+    if (check_timedout(challenge_rotated, A2S_CHALLENGE_ROTATE)) rotate_challenge_key();
+    if (type == A2S_GETCHALLENGE) {
+        queue_challenge(ip, port);
+        return true;
+    }
+
+    //every reply is bigger than the query, so none is sent to an address that hasn't proven it's real
+    int challenge_offset = 5 + (type == A2S_INFO ? A2S_INFO_PAYLOAD_SIZE : 0);
+    if (size < challenge_offset + 4 || !check_challenge(get_u32(query + challenge_offset), ip, port)) {
+        queue_challenge(ip, port);
+        return true;
+    }
+
+    if (type == A2S_INFO) {
+        if (info_dirty) build_info();
+        queue(ip, port, &info_packet);
+    } else if (type == A2S_PLAYER) {
+        if (players_dirty || check_timedout(players_built, A2S_PLAYER_REFRESH)) build_players();
+        queue(ip, port, &players_packet);
+    } else {
+        if (rules_dirty && !rules_in_flight[!rules_current]) build_rules();
+        for (auto &p : rules_packets[rules_current]) {
+            queue(ip, port, &p, rules_current);
+        }
+    }
+
+    return true;
+}
+
+int A2S_Responder::next_packet(void *out, int max_out, uint32 *ip, uint16 *port)
+{
+    if (!outgoing_count) return 0;
+
+    struct Outgoing_Packet &p = outgoing[outgoing_head];
+    const char *data = p.data ? p.data->data() : (const char *)p.challenge;
+    int size = p.data ? p.data->size() : sizeof(p.challenge);
+    if (size > max_out) size = max_out;
+    if (out) memcpy(out, data, size);
+    if (ip) *ip = p.ip;
+    if (port) *port = p.port;
+
+    if (p.rules_set >= 0) --rules_in_flight[p.rules_set];
+    outgoing_head = (outgoing_head + 1) % outgoing.size();
+    --outgoing_count;
+    return size;
+}
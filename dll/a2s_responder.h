@@ -0,0 +1,109 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+#ifndef A2S_RESPONDER_INCLUDE
+#define A2S_RESPONDER_INCLUDE
+
+#include "base.h"
+
+//max size of a single reply, longer rules lists are split like source servers do
+#define A2S_MAX_PACKET_SIZE 1400
+#define A2S_SPLIT_PAYLOAD_SIZE 1248
+//replies waiting for GetNextOutgoingPacket, extra replies are dropped when it's full
+#define A2S_OUTGOING_RING_SIZE 512
+//queries allowed per source ip per second and the burst on top of that
+#define A2S_RATE_LIMIT 30.0
+#define A2S_RATE_BURST 60.0
+//slots in the rate table (power of 2), a source that collides with another one takes its slot
+#define A2S_RATE_TABLE_SIZE 4096
+//player durations are refreshed at most this often (seconds)
+#define A2S_PLAYER_REFRESH 1.0
+//the challenge key is replaced this often (seconds), challenges from the previous key are still accepted
+#define A2S_CHALLENGE_ROTATE 30.0
+
+struct A2S_Player {
+    std::string name;
+    uint32 score;
+    std::chrono::high_resolution_clock::time_point joined;
+};
+
+//Answers A2S_INFO, A2S_PLAYER and A2S_RULES queries for the shared socket mode
+//(HandleIncomingPacket/GetNextOutgoingPacket). The replies are built once and
+//only rebuilt after the server data or player list changes.
+class A2S_Responder {
+    struct Outgoing_Packet {
+        uint32 ip;
+        uint16 port;
+        //points to one of the prebuilt replies, or to challenge if it's NULL
+        const std::string *data;
+        //which rules_packets set data is from, -1 if it isn't a rules packet
+        int rules_set;
+        unsigned char challenge[9];
+    };
+
+    struct Rate {
+        uint32 ip;
+        bool used;
+        double tokens;
+        std::chrono::high_resolution_clock::time_point last;
+    };
+
+    const Gameserver *server;
+    const std::map<uint64, A2S_Player> *players;
+
+    bool info_dirty = true, players_dirty = true, rules_dirty = true;
+    std::chrono::high_resolution_clock::time_point players_built;
+    std::string info_packet, players_packet;
+    //the rules are double buffered, a changed set is built in the one that isn't current
+    //as soon as the ring has no packets left from it, queries keep getting the current one meanwhile
+    std::vector<std::string> rules_packets[2];
+    unsigned rules_in_flight[2] = {};
+    unsigned rules_current = 0;
+    uint32 split_id = 0;
+
+    std::vector<struct Outgoing_Packet> outgoing;
+    size_t outgoing_head = 0, outgoing_count = 0;
+
+    std::vector<struct Rate> rates;
+    //key of the hash that picks the rate slot, so which sources share a slot can't be chosen
+    uint64 rate_key[2];
+    //siphash keys, [0] is the current one
+    uint64 challenge_keys[2][2];
+    std::chrono::high_resolution_clock::time_point challenge_rotated;
+
+    void build_info();
+    void build_players();
+    void build_rules();
+    void rotate_challenge_key();
+    uint32 challenge_for(uint32 ip, uint16 port, unsigned key = 0);
+    bool check_challenge(uint32 challenge, uint32 ip, uint16 port);
+    bool allow(uint32 ip);
+    bool queue(uint32 ip, uint16 port, const std::string *data, int rules_set = -1);
+    void queue_challenge(uint32 ip, uint16 port);
+
+public:
+    A2S_Responder(const Gameserver *server, const std::map<uint64, A2S_Player> *players);
+    void server_changed() { info_dirty = rules_dirty = true; }
+    void players_changed() { info_dirty = players_dirty = true; }
+    //returns true if the packet was a query we understood
+    bool handle_packet(const void *data, int size, uint32 ip, uint16 port);
+    //oldest queued reply first, returns 0 when there's nothing to send
+    int next_packet(void *out, int max_out, uint32 *ip, uint16 *port);
+};
+
+#endif
@@ -111,10 +111,14 @@ inline void reset_LastError()
     #include <sys/stat.h>
     #include <sys/ioctl.h>
     #include <sys/socket.h>
+    #include <sys/un.h>
     #include <sys/mount.h>
     #include <sys/stat.h>
     #include <sys/statvfs.h>
     #include <sys/time.h>
+    #include <sys/inotify.h>
+    #include <sys/mman.h>
+    #include <sys/file.h>
 
     #include <netinet/in.h>
     #include <netinet/tcp.h>
@@ -152,16 +156,21 @@ inline void reset_LastError()
 #include <fstream>
 #include <sstream>
 #include <iterator>
+#include <memory>
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <queue>
+#include <deque>
 #include <list>
 
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
+#include <random>
 
 #include <string.h>
 #include <stdio.h>
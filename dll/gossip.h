@@ -0,0 +1,61 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef GOSSIP_INCLUDE
+#define GOSSIP_INCLUDE
+
+//how often LAN peers broadcast announces and answer each other's, kept free of the rest of the emu
+//so gossip_simulation.cpp runs the exact same decisions the networking code does
+
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+
+#define BROADCAST_INTERVAL 5.0
+//the broadcast interval gets stretched by one BROADCAST_INTERVAL for every this many connected peers, the tcp heartbeats keep those alive
+#define BROADCAST_PEERS_SCALE 16
+#define USER_TIMEOUT 20.0
+//applied after the random spread so even an unlucky interval leaves room for a lost broadcast before USER_TIMEOUT
+#define BROADCAST_INTERVAL_MAX (USER_TIMEOUT * 0.5)
+//how many of the peers that hear an announce answer it with their peer list on average
+#define GOSSIP_FANOUT 3
+
+inline double gossip_broadcast_interval(unsigned connected, std::mt19937 &random)
+{
+    double interval = BROADCAST_INTERVAL * (1 + connected / BROADCAST_PEERS_SCALE);
+    interval *= std::uniform_real_distribution<double>(0.5, 1.5)(random);
+    return std::min(interval, BROADCAST_INTERVAL_MAX);
+}
+
+//true for about GOSSIP_FANOUT out of count peers that each call this
+inline bool gossip_selected(uint32_t count, std::mt19937 &random)
+{
+    if (count <= GOSSIP_FANOUT) return true;
+    return std::uniform_int_distribution<uint32_t>(0, count - 1)(random) < GOSSIP_FANOUT;
+}
+
+//summing mixed ids makes the digest the same no matter in which order the peers were found
+inline uint64_t gossip_mix(uint64_t id, uint32_t appid)
+{
+    uint64_t x = id ^ ((uint64_t)appid << 32);
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+#endif
@@ -0,0 +1,48 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "lobby_chat_ring.h"
+
+#define CHAT_ID_MASK 0x7FFFFFFF
+
+Lobby_Chat_Ring::Lobby_Chat_Ring(uint32 capacity)
+{
+    this->capacity = std::max(capacity, (uint32)1);
+}
+
+int Lobby_Chat_Ring::add(CSteamID user_id, EChatEntryType type, const std::string &message)
+{
+    size_t slot = count % capacity;
+    if (slot >= entries.size()) entries.resize(slot + 1);
+
+    struct Entry &entry = entries[slot];
+    entry.message.assign(message);
+    entry.type = type;
+    entry.user_id = user_id;
+    return (int)(count++ & CHAT_ID_MASK);
+}
+
+const struct Lobby_Chat_Ring::Entry *Lobby_Chat_Ring::get(int chat_id)
+{
+    if (chat_id < 0 || !count) return NULL;
+
+    //how many messages ago it was, the ids wrap around after 2^31 messages
+    uint64 age = ((count - 1) - (uint64)chat_id) & CHAT_ID_MASK;
+    if (age >= capacity || age >= count) return NULL;
+
+    return &(entries[(count - 1 - age) % capacity]);
+}
@@ -0,0 +1,50 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+#ifndef LOBBY_CHAT_RING_INCLUDE
+#define LOBBY_CHAT_RING_INCLUDE
+
+#include "base.h"
+
+//Keeps the last capacity chat messages of one lobby. Chat ids keep counting up
+//and map straight to a slot, an id stays valid until capacity newer messages
+//came in. The slots are reused so their message buffers only get allocated
+//while the ring fills up or when a longer message comes in.
+class Lobby_Chat_Ring {
+public:
+    struct Entry {
+        std::string message;
+        EChatEntryType type;
+        CSteamID user_id;
+    };
+
+private:
+    std::vector<struct Entry> entries;
+    uint32 capacity;
+    //messages added so far, the chat id is the low 31 bits so it stays a positive int
+    uint64 count = 0;
+
+public:
+    Lobby_Chat_Ring(uint32 capacity);
+    //returns the chat id for the LobbyChatMsg_t callback
+    int add(CSteamID user_id, EChatEntryType type, const std::string &message);
+    //NULL if the id is unknown or the message was pushed out already
+    const struct Entry *get(int chat_id);
+};
+
+#endif
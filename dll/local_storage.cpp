@@ -66,6 +66,11 @@ Local_Storage::Local_Storage(std::string save_directory)
 
 }
 
+std::string Local_Storage::sanitized_file_name(std::string file)
+{
+    return file;
+}
+
 void Local_Storage::setAppId(uint32 appid)
 {
 
@@ -86,11 +91,31 @@ int Local_Storage::store_data_settings(std::string file, char *data, unsigned in
     return -1;
 }
 
+Mapped_File::~Mapped_File()
+{
+
+}
+
 int Local_Storage::get_file_data(std::string full_path, char *data, unsigned int max_length, unsigned int offset)
 {
     return -1;
 }
 
+std::shared_ptr<struct Mapped_File> Local_Storage::map_file(std::string full_path)
+{
+    return nullptr;
+}
+
+void Local_Storage::unmap_file(std::string full_path)
+{
+
+}
+
+void Local_Storage::flush_journal()
+{
+
+}
+
 int Local_Storage::get_data(std::string folder, std::string file, char *data, unsigned int max_length, unsigned int offset)
 {
     return -1;
@@ -468,6 +493,11 @@ static std::string sanitize_file_name(std::string name)
     return name;
 }
 
+std::string Local_Storage::sanitized_file_name(std::string file)
+{
+    return sanitize_file_name(file);
+}
+
 static std::string desanitize_file_name(std::string name)
 {
     //I'm not sure all of these are necessary but just to be sure
@@ -483,46 +513,710 @@ static std::string desanitize_file_name(std::string name)
     return name;
 }
 
-Local_Storage::Local_Storage(std::string save_directory)
+static bool get_file_stat(std::string const &full_path, uint64_t *size, uint64_t *timestamp)
 {
-    this->save_directory = save_directory;
+#if defined(STEAM_WIN32)
+    struct _stat buffer = {};
+    if (_wstat(utf8_decode(full_path).c_str(), &buffer) != 0) return false;
+    if (buffer.st_mode & _S_IFDIR) return false;
+#else
+    struct stat buffer = {};
+    if (stat(full_path.c_str(), &buffer) != 0) return false;
+    if (!S_ISREG(buffer.st_mode)) return false;
+#endif
+    *size = buffer.st_size;
+    *timestamp = buffer.st_mtime;
+    return true;
+}
 
-    if (this->save_directory.back() != *PATH_SEPARATOR) {
-        this->save_directory.append(PATH_SEPARATOR);
+static std::string index_api_name(std::string const &name)
+{
+    std::string api_name = desanitize_file_name(name);
+#if defined(STEAM_WIN32)
+    api_name = replace_with(api_name, PATH_SEPARATOR, "/");
+#endif
+    return api_name;
+}
+
+static void index_remove_entry(struct Folder_Index &index, std::string const &name)
+{
+    auto pos = index.positions.find(name);
+    if (pos == index.positions.end()) return;
+
+    //keep the order of the other files so indexes the game already has stay valid
+    size_t i = pos->second;
+    index.positions.erase(pos);
+    index.files.erase(index.files.begin() + i);
+    for (; i < index.files.size(); ++i) {
+        index.positions[index.files[i].name] = i;
     }
 }
 
-void Local_Storage::setAppId(uint32 appid)
+static void index_refresh_entry(struct Folder_Index &index, std::string const &folder_path, std::string const &name)
 {
-    this->appid = std::to_string(appid) + PATH_SEPARATOR;
+    uint64_t size, timestamp;
+    if (!get_file_stat(folder_path + name, &size, &timestamp)) {
+        index_remove_entry(index, name);
+        return;
+    }
+
+    auto pos = index.positions.find(name);
+    if (pos == index.positions.end()) {
+        struct File_Index_Entry entry;
+        entry.name = name;
+        entry.api_name = index_api_name(name);
+        pos = index.positions.insert(std::make_pair(name, index.files.size())).first;
+        index.files.push_back(entry);
+    }
+
+    index.files[pos->second].size = size;
+    index.files[pos->second].timestamp = timestamp;
 }
 
-int Local_Storage::store_file_data(std::string folder, std::string file, char *data, unsigned int length)
+#if defined(__LINUX__)
+static void index_watch_directory(struct Folder_Index &index, std::string const &folder_path, std::string const &prefix)
 {
-    if (folder.back() != *PATH_SEPARATOR) {
-        folder.append(PATH_SEPARATOR);
+    int wd = inotify_add_watch(index.inotify_fd, (folder_path + prefix).c_str(), IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+    if (wd < 0) return;
+    index.watches[wd] = prefix;
+
+    DIR *dir = opendir((folder_path + prefix).c_str());
+    if (!dir) return;
+
+    struct dirent *dp;
+    while ((dp = readdir(dir)) != NULL) {
+        if (dp->d_type == DT_DIR && strcmp(dp->d_name, ".") != 0 && strcmp(dp->d_name, "..") != 0) {
+            index_watch_directory(index, folder_path, prefix + dp->d_name + PATH_SEPARATOR);
+        }
     }
 
-    file = sanitize_file_name(file);
-    std::string::size_type pos = file.rfind(PATH_SEPARATOR);
+    closedir(dir);
+}
+
+//applies changes made to the folder behind our back, returns false if the index has to be rebuilt
+static bool index_read_events(struct Folder_Index &index, std::string const &folder_path)
+{
+    if (index.inotify_fd < 0) return true;
+
+    bool valid = true;
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t len;
+    while ((len = read(index.inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *ptr = buffer; ptr < buffer + len; ) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & (IN_Q_OVERFLOW | IN_ISDIR | IN_DELETE_SELF | IN_IGNORED)) {
+                valid = false;
+                continue;
+            }
+
+            auto watch = index.watches.find(event->wd);
+            if (!valid || !event->len || watch == index.watches.end()) continue;
+            index_refresh_entry(index, folder_path, watch->second + event->name);
+        }
+    }
+
+    return valid;
+}
+#endif
+
+#define INDEX_EVENTS_INTERVAL 0.05
+#define MAX_SANITIZED_NAMES 4096
+
+void Local_Storage::invalidate_folder_index(std::string folder)
+{
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    auto f = folder_indexes.find(folder);
+    if (f == folder_indexes.end()) return;
+
+#if defined(__LINUX__)
+    if (f->second.inotify_fd >= 0) close(f->second.inotify_fd);
+#endif
+    f->second = Folder_Index();
+}
+
+struct Folder_Index &Local_Storage::get_folder_index(std::string folder)
+{
+    std::string folder_path = save_directory + appid + folder;
+    struct Folder_Index &index = folder_indexes[folder];
+    if (index.loaded) {
+#if defined(__LINUX__)
+        //metadata queries get polled every frame by some games, only look at the events once in a while
+        if (!check_timedout(index.events_checked, INDEX_EVENTS_INTERVAL)) return index;
+        index.events_checked = std::chrono::high_resolution_clock::now();
+        if (index_read_events(index, folder_path)) return index;
+        PRINT_DEBUG("Local_Storage::folder %s changed on disk, rebuilding index\n", folder.c_str());
+        invalidate_folder_index(folder);
+#else
+        return index;
+#endif
+    }
+
+#if defined(__LINUX__)
+    //watch before walking so nothing created during the walk is missed
+    index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (index.inotify_fd >= 0) index_watch_directory(index, folder_path, "");
+#endif
+
+    std::vector<struct File_Data> files = get_filenames_recursive(folder_path);
+    for (auto &f : files) {
+        index_refresh_entry(index, folder_path, f.name);
+    }
+
+    PRINT_DEBUG("Local_Storage::indexed %zu files in %s\n", index.files.size(), folder_path.c_str());
+    index.loaded = true;
+#if defined(__LINUX__)
+    index.events_checked = std::chrono::high_resolution_clock::now();
+#endif
+    return index;
+}
+
+struct File_Index_Entry *Local_Storage::find_index_entry(std::string folder, std::string const& file)
+{
+    //the sanitized names are cached too, building them is a bunch of allocations
+    auto name = sanitized_names.find(file);
+    if (name == sanitized_names.end()) {
+        if (sanitized_names.size() >= MAX_SANITIZED_NAMES) sanitized_names.clear();
+        name = sanitized_names.insert(std::make_pair(file, sanitize_file_name(file))).first;
+    }
+
+    struct Folder_Index &index = get_folder_index(folder);
+    auto pos = index.positions.find(name->second);
+    if (pos == index.positions.end()) return NULL;
+    return &index.files[pos->second];
+}
+
+void Local_Storage::update_folder_index(std::string folder, std::string file)
+{
+    //the indexes are recursive, the ones of parent folders list the file too
+    std::string full_path = save_directory + appid + folder + file;
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    for (auto &f : folder_indexes) {
+        if (!f.second.loaded) continue;
+
+        std::string folder_path = save_directory + appid + f.first;
+        if (folder_path.back() != *PATH_SEPARATOR || full_path.size() <= folder_path.size()) continue;
+        if (full_path.compare(0, folder_path.size(), folder_path) != 0) continue;
+        index_refresh_entry(f.second, folder_path, full_path.substr(folder_path.size()));
+    }
+}
 
-    std::string file_folder;
-    if (pos == 0 || pos == std::string::npos) {
-        file_folder = "";
+//Every write to a file in the save directory is first appended to a journal.
+//Writers that arrive while a commit is in progress get batched into the next
+//one, so a single fsync covers all of them (group commit). Once the journal is
+//durable the files are rewritten in place without any fsync. They only get
+//synced in batches when the journal is checkpointed. If the process dies in
+//the middle of a write, replaying the journal on the next start finishes it.
+//Each running instance holds an exclusive lock on its own journal slot, slots
+//left behind by instances that died are replayed by the next one to start.
+#define JOURNAL_FILE_NAME "journal.dat"
+#define JOURNAL_SLOTS 8
+#define JOURNAL_RECORD_MAGIC 0x314A5347
+#define JOURNAL_CHECKPOINT_BYTES (16 * 1024 * 1024)
+#define JOURNAL_CHECKPOINT_FILES 64
+#define JOURNAL_CHECKPOINT_SECONDS 5
+
+enum Journal_Record_Types {
+    JOURNAL_RECORD_WRITE,
+    JOURNAL_RECORD_DELETE
+};
+
+#if defined(STEAM_WIN32)
+typedef HANDLE Journal_File;
+#define JOURNAL_NO_FILE INVALID_HANDLE_VALUE
+#else
+typedef int Journal_File;
+#define JOURNAL_NO_FILE -1
+#endif
+
+struct Journal_Batch {
+    std::string data;
+    bool done = false;
+    bool committed = false;
+};
+
+static std::mutex journal_mutex;
+static std::condition_variable journal_cv;
+static std::string journal_directory;
+static Journal_File journal_handle = JOURNAL_NO_FILE;
+static std::shared_ptr<struct Journal_Batch> journal_pending;
+//set while one thread owns the journal file, either to append a batch or to checkpoint
+static bool journal_committing;
+static unsigned journal_in_flight;
+static uint64_t journal_size;
+static std::set<std::string> journal_dirty;
+static std::chrono::high_resolution_clock::time_point journal_first_dirty;
+//files are written here first and then renamed over the real one
+static std::string write_temp_directory;
+static std::atomic<uint32_t> write_temp_counter;
+static uint32_t write_temp_pid;
+
+static uint64_t journal_checksum(const char *data, size_t length, uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static void journal_put_u32(std::string &out, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) out.push_back((char)((value >> (i * 8)) & 0xFF));
+}
+
+static void journal_put_u64(std::string &out, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) out.push_back((char)((value >> (i * 8)) & 0xFF));
+}
+
+static uint64_t journal_get(const char *data, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) value |= (uint64_t)(unsigned char)data[i] << (i * 8);
+    return value;
+}
+
+#define JOURNAL_HEADER_SIZE (4 + 4 + 4 + 4 + 8)
+
+//header: magic, type, path length, data length, checksum of everything that follows the header fields
+static void journal_encode(std::string &out, uint32_t type, std::string const& path, const char *data, uint32_t length)
+{
+    uint64_t checksum = journal_checksum(path.data(), path.size(), journal_checksum((char *)&type, sizeof(type)));
+    checksum = journal_checksum(data, length, checksum);
+
+    journal_put_u32(out, JOURNAL_RECORD_MAGIC);
+    journal_put_u32(out, type);
+    journal_put_u32(out, path.size());
+    journal_put_u32(out, length);
+    journal_put_u64(out, checksum);
+    out.append(path);
+    out.append(data, length);
+}
+
+static bool sync_path(std::string const& full_path)
+{
+#if defined(STEAM_WIN32)
+    HANDLE file = CreateFileW(utf8_decode(full_path).c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    bool synced = FlushFileBuffers(file);
+    CloseHandle(file);
+    return synced;
+#else
+    int fd = open(full_path.c_str(), O_RDONLY);
+    if (fd == -1) return false;
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+#endif
+}
+
+static std::string parent_path(std::string const& full_path)
+{
+    std::string::size_type pos = full_path.rfind(PATH_SEPARATOR);
+    if (pos == std::string::npos) return "";
+    return full_path.substr(0, pos);
+}
+
+static std::string journal_slot_name(unsigned slot)
+{
+    if (!slot) return JOURNAL_FILE_NAME;
+    return "journal." + std::to_string(slot) + ".dat";
+}
+
+//returns JOURNAL_NO_FILE if the journal is locked by another running instance
+static Journal_File journal_lock(std::string const& journal_path, bool create)
+{
+#if defined(STEAM_WIN32)
+    //no sharing at all, a second instance gets a sharing violation
+    HANDLE file = CreateFileW(utf8_decode(journal_path).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, create ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    reset_LastError();
+    return file;
+#else
+    int fd = open(journal_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0), 0644);
+    if (fd == -1) return JOURNAL_NO_FILE;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return JOURNAL_NO_FILE;
+    }
+
+    return fd;
+#endif
+}
+
+static void journal_close(Journal_File file)
+{
+#if defined(STEAM_WIN32)
+    CloseHandle(file);
+#else
+    close(file);
+#endif
+}
+
+static std::string journal_read(Journal_File file)
+{
+    std::string contents;
+    char buffer[64 * 1024];
+#if defined(STEAM_WIN32)
+    LARGE_INTEGER zero = {};
+    if (!SetFilePointerEx(file, zero, NULL, FILE_BEGIN)) return contents;
+    DWORD read = 0;
+    while (ReadFile(file, buffer, sizeof(buffer), &read, NULL) && read) {
+        contents.append(buffer, read);
+    }
+#else
+    off_t offset = 0;
+    while (true) {
+        ssize_t got = pread(file, buffer, sizeof(buffer), offset);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        contents.append(buffer, got);
+        offset += got;
+    }
+#endif
+    return contents;
+}
+
+//cuts the journal back to size bytes, appends continue from there
+static bool journal_resize(Journal_File file, uint64_t size)
+{
+#if defined(STEAM_WIN32)
+    LARGE_INTEGER position = {};
+    position.QuadPart = size;
+    if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) || !SetEndOfFile(file)) return false;
+    return FlushFileBuffers(file);
+#else
+    if (ftruncate(file, size) != 0) return false;
+    return fdatasync(file) == 0;
+#endif
+}
+
+static bool journal_append(std::string const& data)
+{
+#if defined(STEAM_WIN32)
+    DWORD written = 0;
+    if (!WriteFile(journal_handle, data.data(), data.size(), &written, NULL) || written != data.size()) return false;
+    return FlushFileBuffers(journal_handle);
+#else
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t written = write(journal_handle, data.data() + offset, data.size() - offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        offset += written;
+    }
+
+    return fdatasync(journal_handle) == 0;
+#endif
+}
+
+static void journal_sync_files(std::set<std::string> const& files)
+{
+    std::set<std::string> directories;
+    for (auto &path : files) {
+        sync_path(path);
+        directories.insert(parent_path(path));
+    }
+
+#if !defined(STEAM_WIN32)
+    //new files also need their directory entries to be durable
+    for (auto &directory : directories) {
+        sync_path(directory);
+    }
+#endif
+}
+
+//the files touched since the last checkpoint are synced, after that their journal records aren't needed anymore
+//must be called with the lock held and nothing committing, the fsyncs run without the lock
+static void journal_checkpoint(std::unique_lock<std::mutex> &lock)
+{
+    PRINT_DEBUG("journal checkpoint %zu files %llu bytes\n", journal_dirty.size(), (unsigned long long)journal_size);
+    std::set<std::string> dirty;
+    dirty.swap(journal_dirty);
+    //keeps new records out of the journal until it has been truncated
+    journal_committing = true;
+    lock.unlock();
+
+    journal_sync_files(dirty);
+    bool truncated = journal_resize(journal_handle, 0);
+
+    lock.lock();
+    if (truncated) {
+        journal_size = 0;
     } else {
-        file_folder = file.substr(0,pos);
+        //the records stay, so do the files they cover
+        journal_dirty.insert(dirty.begin(), dirty.end());
+    }
+
+    journal_committing = false;
+    journal_cv.notify_all();
+}
+
+static bool replace_file(std::string const& from, std::string const& to)
+{
+#if defined(STEAM_WIN32)
+    return MoveFileExW(utf8_decode(from).c_str(), utf8_decode(to).c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+//the old contents stay readable until the new ones replace them, a reader that has the file mapped never sees it shrink
+static int write_file_data(std::string const& full_path, const char *data, unsigned int length)
+{
+    Local_Storage::unmap_file(full_path);
+    create_directory(parent_path(full_path));
+    std::string path = full_path;
+    if (!write_temp_directory.empty()) {
+        path = write_temp_directory + std::to_string(write_temp_pid) + "_" + std::to_string(++write_temp_counter) + ".tmp";
     }
 
-    create_directory(folder + file_folder);
     std::ofstream myfile;
-    myfile.open(utf8_decode(folder + file), std::ios::binary | std::ios::out);
+    myfile.open(utf8_decode(path), std::ios::binary | std::ios::out);
     if (!myfile.is_open()) return -1;
     myfile.write(data, length);
     int position = myfile.tellp();
     myfile.close();
+
+    if (path != full_path && !replace_file(path, full_path)) {
+        PRINT_DEBUG("Local_Storage: couldn't replace %s\n", full_path.c_str());
+#if defined(STEAM_WIN32)
+        _wremove(utf8_decode(path).c_str());
+#else
+        remove(path.c_str());
+#endif
+        reset_LastError();
+        return -1;
+    }
+
     return position;
 }
 
+static bool delete_file_data(std::string const& full_path)
+{
+    Local_Storage::unmap_file(full_path);
+#if defined(STEAM_WIN32)
+    return _wremove(utf8_decode(full_path).c_str()) == 0;
+#else
+    return remove(full_path.c_str()) == 0;
+#endif
+}
+
+static void journal_replay(std::string const& directory, Journal_File file)
+{
+    std::string contents = journal_read(file);
+
+    size_t offset = 0;
+    unsigned replayed = 0;
+    while (contents.size() - offset >= JOURNAL_HEADER_SIZE) {
+        const char *header = contents.data() + offset;
+        uint32_t type = journal_get(header + 4, 4);
+        uint64_t path_length = journal_get(header + 8, 4);
+        uint64_t data_length = journal_get(header + 12, 4);
+        uint64_t checksum = journal_get(header + 16, 8);
+        if (journal_get(header, 4) != JOURNAL_RECORD_MAGIC) break;
+        if (contents.size() - offset - JOURNAL_HEADER_SIZE < path_length + data_length) break;
+
+        std::string path(header + JOURNAL_HEADER_SIZE, path_length);
+        const char *data = header + JOURNAL_HEADER_SIZE + path_length;
+        uint64_t computed = journal_checksum(path.data(), path.size(), journal_checksum((char *)&type, sizeof(type)));
+        //a torn record at the end is a write that never got acknowledged
+        if (journal_checksum(data, data_length, computed) != checksum) break;
+
+        std::string full_path = directory + path;
+        if (type == JOURNAL_RECORD_WRITE) {
+            write_file_data(full_path, data, data_length);
+        } else if (type == JOURNAL_RECORD_DELETE) {
+            delete_file_data(full_path);
+        }
+
+        journal_dirty.insert(full_path);
+        offset += JOURNAL_HEADER_SIZE + path_length + data_length;
+        ++replayed;
+    }
+
+    //drop everything from the first bad record on, records appended after it would never be replayed
+    if (offset != contents.size()) {
+        PRINT_DEBUG("journal dropping %zu bytes after the last good record\n", contents.size() - offset);
+        journal_resize(file, offset);
+    }
+
+    PRINT_DEBUG("journal replayed %u records\n", replayed);
+}
+
+static void journal_open(std::string directory)
+{
+    std::lock_guard<std::mutex> lock(journal_mutex);
+    if (!journal_directory.empty()) return;
+
+    create_directory(directory);
+    //in the save directory so the renames stay on the same filesystem, outside the app folders so games never list them
+    write_temp_directory = directory + "temp" + PATH_SEPARATOR;
+    create_directory(write_temp_directory);
+#if defined(STEAM_WIN32)
+    write_temp_pid = GetCurrentProcessId();
+#else
+    write_temp_pid = getpid();
+#endif
+    std::vector<Journal_File> orphans;
+    for (unsigned slot = 0; slot < JOURNAL_SLOTS; ++slot) {
+        //only the first free slot gets created, the ones after it are only checked for leftovers
+        Journal_File file = journal_lock(directory + journal_slot_name(slot), journal_handle == JOURNAL_NO_FILE);
+        //owned by another running instance or not there
+        if (file == JOURNAL_NO_FILE) continue;
+
+        journal_replay(directory, file);
+        if (journal_handle == JOURNAL_NO_FILE) {
+            journal_handle = file;
+        } else {
+            orphans.push_back(file);
+        }
+    }
+
+    //nobody else can touch the journal yet, so the startup checkpoint is done with the lock held
+    journal_sync_files(journal_dirty);
+    journal_dirty.clear();
+    for (auto &file : orphans) {
+        journal_resize(file, 0);
+        journal_close(file);
+    }
+
+    if (journal_handle == JOURNAL_NO_FILE) {
+        PRINT_DEBUG("journal all %u slots are in use, writes won't be journaled\n", JOURNAL_SLOTS);
+        return;
+    }
+
+    if (!journal_resize(journal_handle, 0)) {
+        journal_close(journal_handle);
+        journal_handle = JOURNAL_NO_FILE;
+        return;
+    }
+
+    journal_size = 0;
+    journal_directory = directory;
+}
+
+//returns false if the write isn't covered by the journal, otherwise journal_applied must be called once the file has been written
+static bool journal_commit(std::string const& full_path, uint32_t type, const char *data, unsigned int length)
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (journal_directory.empty() || full_path.compare(0, journal_directory.size(), journal_directory) != 0) return false;
+
+    if (!journal_pending) journal_pending = std::make_shared<struct Journal_Batch>();
+    std::shared_ptr<struct Journal_Batch> batch = journal_pending;
+    journal_encode(batch->data, type, full_path.substr(journal_directory.size()), data, length);
+    ++journal_in_flight;
+
+    while (!batch->done) {
+        if (journal_committing) {
+            journal_cv.wait(lock);
+            continue;
+        }
+
+        //nothing is committing so the batch this writer joined is still the pending one
+        journal_committing = true;
+        journal_pending.reset();
+        uint64_t size = journal_size;
+        lock.unlock();
+        bool committed = journal_append(batch->data);
+        //a partial append would hide every record after it from the replay
+        if (!committed) journal_resize(journal_handle, size);
+        lock.lock();
+
+        if (committed) {
+            journal_size += batch->data.size();
+        } else {
+            PRINT_DEBUG("journal commit failed\n");
+        }
+
+        batch->committed = committed;
+        batch->done = true;
+        journal_committing = false;
+        journal_cv.notify_all();
+    }
+
+    if (!batch->committed) {
+        --journal_in_flight;
+        journal_cv.notify_all();
+        return false;
+    }
+
+    return true;
+}
+
+static void journal_applied(std::string const& full_path)
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    if (journal_dirty.empty()) journal_first_dirty = std::chrono::high_resolution_clock::now();
+    journal_dirty.insert(full_path);
+    --journal_in_flight;
+
+    if (journal_in_flight || journal_committing) return;
+    journal_cv.notify_all();
+    if (journal_size >= JOURNAL_CHECKPOINT_BYTES || journal_dirty.size() >= JOURNAL_CHECKPOINT_FILES || check_timedout(journal_first_dirty, JOURNAL_CHECKPOINT_SECONDS)) {
+        journal_checkpoint(lock);
+    }
+}
+
+static int journaled_write(std::string const& full_path, const char *data, unsigned int length)
+{
+    bool journaled = journal_commit(full_path, JOURNAL_RECORD_WRITE, data, length);
+    int position = write_file_data(full_path, data, length);
+    if (journaled) journal_applied(full_path);
+    return position;
+}
+
+static bool journaled_delete(std::string const& full_path)
+{
+    bool journaled = journal_commit(full_path, JOURNAL_RECORD_DELETE, NULL, 0);
+    bool deleted = delete_file_data(full_path);
+    if (journaled) journal_applied(full_path);
+    return deleted;
+}
+
+void Local_Storage::flush_journal()
+{
+    std::unique_lock<std::mutex> lock(journal_mutex);
+    while (journal_in_flight || journal_committing) journal_cv.wait(lock);
+    if (!journal_directory.empty() && (!journal_dirty.empty() || journal_size)) journal_checkpoint(lock);
+}
+
+Local_Storage::Local_Storage(std::string save_directory)
+{
+    this->save_directory = save_directory;
+
+    if (this->save_directory.back() != *PATH_SEPARATOR) {
+        this->save_directory.append(PATH_SEPARATOR);
+    }
+
+    journal_open(this->save_directory);
+}
+
+void Local_Storage::setAppId(uint32 appid)
+{
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    for (auto &f : folder_indexes) {
+        invalidate_folder_index(f.first);
+    }
+
+    this->appid = std::to_string(appid) + PATH_SEPARATOR;
+}
+
+int Local_Storage::store_file_data(std::string folder, std::string file, char *data, unsigned int length)
+{
+    if (folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    file = sanitize_file_name(file);
+    return journaled_write(folder + file, data, length);
+}
+
 std::string Local_Storage::get_path(std::string folder)
 {
     std::string path = save_directory + appid + folder;
@@ -553,7 +1247,9 @@ int Local_Storage::store_data(std::string folder, std::string file, char *data,
         folder.append(PATH_SEPARATOR);
     }
 
-    return store_file_data(save_directory + appid + folder, file, data, length);
+    int stored = store_file_data(save_directory + appid + folder, file, data, length);
+    update_folder_index(folder, sanitize_file_name(file));
+    return stored;
 }
 
 int Local_Storage::store_data_settings(std::string file, char *data, unsigned int length)
@@ -561,8 +1257,192 @@ int Local_Storage::store_data_settings(std::string file, char *data, unsigned in
     return store_file_data(get_global_settings_path(), file, data, length);
 }
 
+//only files at least this big are mapped, smaller ones are copied with a plain read
+#define MAPPED_READ_MIN_SIZE (256 * 1024)
+//the most recently read mappings are kept so reading the same big file again doesn't map it again
+#define MAX_MAPPED_FILES 16
+#define MAX_MAPPED_BYTES (256 * 1024 * 1024)
+
+static std::mutex mapped_files_mutex;
+static std::list<std::shared_ptr<struct Mapped_File>> mapped_files;
+
+struct File_Identity {
+    uint64_t size;
+    uint64_t timestamp;
+    uint64_t inode;
+};
+
+#if defined(STEAM_WIN32)
+
+Mapped_File::~Mapped_File()
+{
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    reset_LastError();
+}
+
+static File_Identity file_identity(BY_HANDLE_FILE_INFORMATION const &info)
+{
+    File_Identity identity;
+    identity.size = ((uint64_t)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    identity.timestamp = ((uint64_t)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    identity.inode = ((uint64_t)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    identity.inode ^= (uint64_t)info.dwVolumeSerialNumber << 32;
+    return identity;
+}
+
+static bool file_identity(std::string const &full_path, File_Identity &identity)
+{
+    //no access rights needed to query the file information
+    HANDLE file = CreateFileW(utf8_decode(full_path).c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        reset_LastError();
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    bool ok = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    reset_LastError();
+    if (!ok) return false;
+    identity = file_identity(info);
+    return true;
+}
+
+static std::shared_ptr<struct Mapped_File> create_mapping(std::string const &full_path)
+{
+    std::shared_ptr<struct Mapped_File> mapped = std::make_shared<struct Mapped_File>();
+    mapped->path = full_path;
+    mapped->file = CreateFileW(utf8_decode(full_path).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) return nullptr;
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (!GetFileInformationByHandle(mapped->file, &info)) return nullptr;
+    File_Identity identity = file_identity(info);
+    if (identity.size < MAPPED_READ_MIN_SIZE) return nullptr;
+
+    mapped->mapping = CreateFileMappingW(mapped->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapped->mapping) return nullptr;
+
+    mapped->data = (char *)MapViewOfFile(mapped->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!mapped->data) return nullptr;
+    mapped->size = identity.size;
+    mapped->timestamp = identity.timestamp;
+    mapped->inode = identity.inode;
+    return mapped;
+}
+
+#else
+
+Mapped_File::~Mapped_File()
+{
+    if (data) munmap(data, size);
+    if (fd >= 0) close(fd);
+}
+
+static File_Identity file_identity(struct stat const &buffer)
+{
+    File_Identity identity;
+    identity.size = buffer.st_size;
+#if defined(__APPLE__)
+    identity.timestamp = (uint64_t)buffer.st_mtimespec.tv_sec * 1000000000ULL + buffer.st_mtimespec.tv_nsec;
+#else
+    identity.timestamp = (uint64_t)buffer.st_mtim.tv_sec * 1000000000ULL + buffer.st_mtim.tv_nsec;
+#endif
+    identity.inode = (uint64_t)buffer.st_ino ^ ((uint64_t)buffer.st_dev << 32);
+    return identity;
+}
+
+//stat on the path, the descriptor of a mapping still points to the old file once it was replaced
+static bool file_identity(std::string const &full_path, File_Identity &identity)
+{
+    struct stat buffer = {};
+    if (stat(full_path.c_str(), &buffer) != 0 || !S_ISREG(buffer.st_mode)) return false;
+    identity = file_identity(buffer);
+    return true;
+}
+
+static std::shared_ptr<struct Mapped_File> create_mapping(std::string const &full_path)
+{
+    std::shared_ptr<struct Mapped_File> mapped = std::make_shared<struct Mapped_File>();
+    mapped->path = full_path;
+    mapped->fd = open(full_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (mapped->fd < 0) return nullptr;
+
+    struct stat buffer = {};
+    if (fstat(mapped->fd, &buffer) != 0 || !S_ISREG(buffer.st_mode) || buffer.st_size < MAPPED_READ_MIN_SIZE) return nullptr;
+
+    void *data = mmap(NULL, buffer.st_size, PROT_READ, MAP_SHARED, mapped->fd, 0);
+    if (data == MAP_FAILED) return nullptr;
+    File_Identity identity = file_identity(buffer);
+    mapped->data = (char *)data;
+    mapped->size = identity.size;
+    mapped->timestamp = identity.timestamp;
+    mapped->inode = identity.inode;
+    return mapped;
+}
+
+#endif
+
+std::shared_ptr<struct Mapped_File> Local_Storage::map_file(std::string full_path)
+{
+    File_Identity identity;
+    bool exists = file_identity(full_path, identity);
+
+    std::lock_guard<std::mutex> lock(mapped_files_mutex);
+    for (auto m = mapped_files.begin(); m != mapped_files.end(); ++m) {
+        if ((*m)->path != full_path) continue;
+        if (exists && (*m)->size == identity.size && (*m)->timestamp == identity.timestamp && (*m)->inode == identity.inode) {
+            mapped_files.splice(mapped_files.begin(), mapped_files, m);
+            return mapped_files.front();
+        }
+
+        //changed since it was mapped, readers that still hold the old mapping keep the old contents
+        mapped_files.erase(m);
+        break;
+    }
+
+    if (!exists || identity.size < MAPPED_READ_MIN_SIZE) return nullptr;
+    std::shared_ptr<struct Mapped_File> mapped = create_mapping(full_path);
+    if (!mapped) return nullptr;
+
+    mapped_files.push_front(mapped);
+    size_t total = 0;
+    unsigned count = 0;
+    for (auto m = mapped_files.begin(); m != mapped_files.end();) {
+        total += (*m)->size;
+        ++count;
+        if (m != mapped_files.begin() && (count > MAX_MAPPED_FILES || total > MAX_MAPPED_BYTES)) {
+            total -= (*m)->size;
+            --count;
+            m = mapped_files.erase(m);
+        } else {
+            ++m;
+        }
+    }
+
+    return mapped;
+}
+
+//has to be called before a file is written or deleted, windows refuses to replace a file that is still mapped
+void Local_Storage::unmap_file(std::string full_path)
+{
+    std::lock_guard<std::mutex> lock(mapped_files_mutex);
+    mapped_files.remove_if([&full_path](std::shared_ptr<struct Mapped_File> const &mapped) { return mapped->path == full_path; });
+}
+
 int Local_Storage::get_file_data(std::string full_path, char *data, unsigned int max_length, unsigned int offset)
 {
+    std::shared_ptr<struct Mapped_File> mapped = map_file(full_path);
+    if (mapped) {
+        if (offset >= mapped->size) return 0;
+        size_t length = std::min((size_t)max_length, mapped->size - offset);
+        memcpy(data, mapped->data + offset, length);
+        return length;
+    }
+
+    //small files or files that couldn't be mapped
     std::ifstream myfile;
     myfile.open(utf8_decode(full_path), std::ios::binary | std::ios::in);
     if (!myfile.is_open()) return -1;
@@ -598,29 +1478,30 @@ int Local_Storage::count_files(std::string folder)
         folder.append(PATH_SEPARATOR);
     }
 
-    return get_filenames_recursive(save_directory + appid + folder).size();
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    return get_folder_index(folder).files.size();
 }
 
 bool Local_Storage::file_exists(std::string folder, std::string file)
 {
-    file = sanitize_file_name(file);
     if (folder.back() != *PATH_SEPARATOR) {
         folder.append(PATH_SEPARATOR);
     }
 
-    std::string full_path = save_directory + appid + folder + file;
-    return file_exists_(full_path);
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    return find_index_entry(folder, file) != NULL;
 }
 
 unsigned int Local_Storage::file_size(std::string folder, std::string file)
 {
-    file = sanitize_file_name(file);
     if (folder.back() != *PATH_SEPARATOR) {
         folder.append(PATH_SEPARATOR);
     }
 
-    std::string full_path = save_directory + appid + folder + file;
-    return file_size_(full_path);
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    struct File_Index_Entry *entry = find_index_entry(folder, file);
+    if (!entry) return 0;
+    return entry->size;
 }
 
 bool Local_Storage::file_delete(std::string folder, std::string file)
@@ -631,30 +1512,21 @@ bool Local_Storage::file_delete(std::string folder, std::string file)
     }
 
     std::string full_path = save_directory + appid + folder + file;
-#if defined(STEAM_WIN32)
-    return _wremove(utf8_decode(full_path).c_str()) == 0;
-#else
-    return remove(full_path.c_str()) == 0;
-#endif
+    bool deleted = journaled_delete(full_path);
+    if (deleted) update_folder_index(folder, file);
+    return deleted;
 }
 
 uint64_t Local_Storage::file_timestamp(std::string folder, std::string file)
 {
-    file = sanitize_file_name(file);
     if (folder.back() != *PATH_SEPARATOR) {
         folder.append(PATH_SEPARATOR);
     }
 
-    std::string full_path = save_directory + appid + folder + file;
-
-#if defined(STEAM_WIN32)
-    struct _stat buffer = {};
-    if (_wstat(utf8_decode(full_path).c_str(), &buffer) != 0) return 0;
-#else
-    struct stat buffer = {};
-    if (stat (full_path.c_str(), &buffer) != 0) return 0;
-#endif
-    return buffer.st_mtime;
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    struct File_Index_Entry *entry = find_index_entry(folder, file);
+    if (!entry) return 0;
+    return entry->timestamp;
 }
 
 bool Local_Storage::iterate_file(std::string folder, int index, char *output_filename, int32 *output_size)
@@ -663,15 +1535,13 @@ bool Local_Storage::iterate_file(std::string folder, int index, char *output_fil
         folder.append(PATH_SEPARATOR);
     }
 
-    std::vector<struct File_Data> files = get_filenames_recursive(save_directory + appid + folder);
-    if (index < 0 || index >= files.size()) return false;
+    std::lock_guard<std::recursive_mutex> lock(folder_indexes_mutex);
+    struct Folder_Index &folder_index = get_folder_index(folder);
+    if (index < 0 || index >= folder_index.files.size()) return false;
 
-    std::string name = desanitize_file_name(files[index].name);
-    if (output_size) *output_size = file_size(folder, name);
-#if defined(STEAM_WIN32)
-    name = replace_with(name, PATH_SEPARATOR, "/");
-#endif
-    strcpy(output_filename, name.c_str());
+    struct File_Index_Entry &entry = folder_index.files[index];
+    if (output_size) *output_size = entry.size;
+    strcpy(output_filename, entry.api_name.c_str());
     return true;
 }
 
@@ -691,12 +1561,18 @@ bool Local_Storage::update_save_filenames(std::string folder)
             std::string from = (save_directory + appid + folder + PATH_SEPARATOR + path);
             to = (save_directory + appid + folder + PATH_SEPARATOR + to);
             PRINT_DEBUG("Local_Storage::update_save_filenames renaming %s to %s\n", from.c_str(), to.c_str());
+            unmap_file(from);
             if (std::rename(from.c_str(), to.c_str()) < 0) {
                 PRINT_DEBUG("ERROR RENAMING\n");
             }
         }
     }
 
+    if (folder.back() != *PATH_SEPARATOR) {
+        folder.append(PATH_SEPARATOR);
+    }
+
+    invalidate_folder_index(folder);
     return true;
 }
 
@@ -751,12 +1627,12 @@ bool Local_Storage::write_json_file(std::string folder, std::string const&file,
     std::string inv_path = std::move(save_directory + appid + folder);
     std::string full_path = inv_path + file;
 
-    create_directory(inv_path);
-
-    std::ofstream inventory_file(utf8_decode(full_path), std::ios::trunc | std::ios::out);
-    if (inventory_file)
+    std::stringstream contents;
+    contents << std::setw(2) << json;
+    std::string data = contents.str();
+    if (journaled_write(full_path, data.data(), data.size()) == data.size())
     {
-        inventory_file << std::setw(2) << json;
+        update_folder_index(folder, file);
         return true;
     }
     
@@ -788,7 +1664,9 @@ bool Local_Storage::save_screenshot(std::string const& image_path, uint8_t* img_
     std::string screenshot_path = std::move(save_directory + appid + screenshots_folder + PATH_SEPARATOR); 
     create_directory(screenshot_path);
     screenshot_path += image_path;
-    return stbi_write_png(screenshot_path.c_str(), width, height, channels, img_ptr, 0) == 1;
+    bool saved = stbi_write_png(screenshot_path.c_str(), width, height, channels, img_ptr, 0) == 1;
+    if (saved) update_folder_index(std::string(screenshots_folder) + PATH_SEPARATOR, image_path);
+    return saved;
 }
 
 #endif
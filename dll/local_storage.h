@@ -41,6 +41,42 @@ struct image_t
     std::vector<image_pixel_t> pix_map;
 };
 
+struct File_Index_Entry {
+    std::string name; //sanitized name, relative to the folder
+    std::string api_name; //name returned to the game
+    uint64_t size;
+    uint64_t timestamp;
+};
+
+//cached listing and metadata of a storage folder so enumerating it or querying a file doesn't hit the disk every call
+struct Folder_Index {
+    bool loaded = false;
+    std::vector<struct File_Index_Entry> files;
+    std::unordered_map<std::string, size_t> positions;
+#if defined(__LINUX__)
+    int inotify_fd = -1;
+    std::map<int, std::string> watches;
+    std::chrono::high_resolution_clock::time_point events_checked;
+#endif
+};
+
+//read only view of a whole file, shared by every reader until the file changes or it falls out of the cache
+struct Mapped_File {
+    std::string path;
+    char *data = nullptr;
+    size_t size = 0;
+    //what the file looked like when it was mapped, a replaced file has a different inode
+    uint64_t timestamp = 0;
+    uint64_t inode = 0;
+#if defined(STEAM_WIN32)
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#else
+    int fd = -1;
+#endif
+    ~Mapped_File();
+};
+
 class Local_Storage {
 public:
     static constexpr auto inventory_storage_folder = "inventory";
@@ -55,15 +91,29 @@ public:
 private:
     std::string save_directory;
     std::string appid;
+
+    std::map<std::string, struct Folder_Index> folder_indexes;
+    std::recursive_mutex folder_indexes_mutex;
+    std::unordered_map<std::string, std::string> sanitized_names;
+    struct Folder_Index &get_folder_index(std::string folder);
+    struct File_Index_Entry *find_index_entry(std::string folder, std::string const& file);
+    void update_folder_index(std::string folder, std::string file);
+    void invalidate_folder_index(std::string folder);
 public:
     static std::string get_program_path();
     static std::string get_game_settings_path();
     static std::string get_user_appdata_path();
     Local_Storage(std::string save_directory);
     static int get_file_data(std::string full_path, char *data, unsigned int max_length, unsigned int offset=0);
+    //returns nullptr for files that are too small to be worth mapping, the mapping stays valid as long as it's held
+    static std::shared_ptr<struct Mapped_File> map_file(std::string full_path);
+    static void unmap_file(std::string full_path);
+    static void flush_journal();
     void setAppId(uint32 appid);
     static int store_file_data(std::string folder, std::string file, char *data, unsigned int length);
     static std::vector<std::string> get_filenames_path(std::string path);
+    //the name a file is stored under on disk, names that map to the same file compare equal
+    static std::string sanitized_file_name(std::string file);
 
     int store_data(std::string folder, std::string file, char *data, unsigned int length);
     int store_data_settings(std::string file, char *data, unsigned int length);
@@ -0,0 +1,118 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+#include "message_pool.h"
+
+#define MAX_POOLED_MESSAGES 1024
+#define MAX_POOLED_PAYLOAD (64 * 1024)
+
+struct Pooled_Steam_Message : public SteamNetworkingMessage_t {
+    std::string payload;
+};
+
+//each thread keeps its own free list so allocating and releasing never takes a lock
+struct Message_Free_List {
+    std::vector<struct Pooled_Steam_Message *> entries;
+    ~Message_Free_List()
+    {
+        for (auto &entry : entries) {
+            delete entry;
+        }
+    }
+};
+
+static thread_local struct Message_Free_List free_list;
+
+static void free_pooled_message_data(SteamNetworkingMessage_t *pMsg)
+{
+    struct Pooled_Steam_Message *entry = static_cast<struct Pooled_Steam_Message *>(pMsg);
+    if (entry->payload.capacity() > MAX_POOLED_PAYLOAD) {
+        std::string().swap(entry->payload);
+    } else {
+        entry->payload.clear();
+    }
+
+    pMsg->m_pData = NULL;
+}
+
+static void release_pooled_message(SteamNetworkingMessage_t *pMsg)
+{
+    if (pMsg->m_pfnFreeData) pMsg->m_pfnFreeData(pMsg);
+
+    struct Pooled_Steam_Message *entry = static_cast<struct Pooled_Steam_Message *>(pMsg);
+    if (free_list.entries.size() >= MAX_POOLED_MESSAGES) {
+        delete entry;
+        return;
+    }
+
+    free_list.entries.push_back(entry);
+}
+
+static struct Pooled_Steam_Message *get_pooled_message()
+{
+    struct Pooled_Steam_Message *entry;
+    if (free_list.entries.empty()) {
+        entry = new Pooled_Steam_Message();
+    } else {
+        entry = free_list.entries.back();
+        free_list.entries.pop_back();
+    }
+
+    memset((void *)static_cast<SteamNetworkingMessage_t *>(entry), 0, sizeof(SteamNetworkingMessage_t));
+    entry->m_pfnRelease = &release_pooled_message;
+    return entry;
+}
+
+SteamNetworkingMessage_t *Steam_Message_Pool::allocate(int size)
+{
+    struct Pooled_Steam_Message *entry = get_pooled_message();
+    entry->payload.clear();
+    if (size > 0) {
+        entry->payload.resize(size);
+        entry->m_pData = &entry->payload[0];
+        entry->m_cbSize = size;
+        entry->m_pfnFreeData = &free_pooled_message_data;
+    }
+
+    return entry;
+}
+
+SteamNetworkingMessage_t *Steam_Message_Pool::adopt(std::string &data)
+{
+    struct Pooled_Steam_Message *entry = get_pooled_message();
+    entry->payload.swap(data);
+    entry->m_pData = &entry->payload[0];
+    entry->m_cbSize = entry->payload.size();
+    entry->m_pfnFreeData = &free_pooled_message_data;
+    return entry;
+}
+
+bool Steam_Message_Pool::take_payload(SteamNetworkingMessage_t *pMsg, std::string &data)
+{
+    if (pMsg->m_pfnFreeData != &free_pooled_message_data) return false;
+
+    struct Pooled_Steam_Message *entry = static_cast<struct Pooled_Steam_Message *>(pMsg);
+    if (pMsg->m_pData != &entry->payload[0] || pMsg->m_cbSize < 0 || pMsg->m_cbSize > entry->payload.size()) return false;
+
+    entry->payload.resize(pMsg->m_cbSize);
+    data.swap(entry->payload);
+    entry->payload.clear();
+    pMsg->m_pData = NULL;
+    pMsg->m_cbSize = 0;
+    return true;
+}
@@ -0,0 +1,37 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+#ifndef MESSAGE_POOL_INCLUDE
+#define MESSAGE_POOL_INCLUDE
+
+#include "base.h"
+
+//SteamNetworkingMessage_t objects handed to the game get recycled instead of
+//being allocated for every message. The payload lives in a std::string owned
+//by the message so received data can be swapped in without a copy.
+class Steam_Message_Pool {
+public:
+    //message with a zeroed header and a payload buffer of size bytes
+    static SteamNetworkingMessage_t *allocate(int size);
+    //message whose payload takes over the contents of data
+    static SteamNetworkingMessage_t *adopt(std::string &data);
+    //moves the payload of a pool allocated message into data, returns false if the game set its own buffer
+    static bool take_payload(SteamNetworkingMessage_t *pMsg, std::string &data);
+};
+
+#endif
@@ -16,6 +16,7 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "network.h"
+#include "gossip.h"
 
 #define MAX_BROADCASTS 16
 static int number_broadcasts = -1;
@@ -23,12 +24,21 @@ static IP_PORT broadcasts[MAX_BROADCASTS];
 static uint32_t lower_range_ips[MAX_BROADCASTS];
 static uint32_t upper_range_ips[MAX_BROADCASTS];
 
-#define BROADCAST_INTERVAL 5.0
 #define HEARTBEAT_TIMEOUT 20.0
-#define USER_TIMEOUT 20.0
+//how often connection stats get updated and a stats heartbeat is sent to each peer
+#define STATS_INTERVAL 1.0
 
 #define MAX_UDP_SIZE 16384
 
+//messages that would grow the tcp send buffers past these get refused so a peer that stops reading can't use up all the memory
+#define MAX_TCP_SEND_BUFFER (32 * 1024 * 1024)
+#define MAX_TCP_SEND_BUFFER_TOTAL (256 * 1024 * 1024)
+//unreliable messages that have to go over tcp get dropped once this much is waiting
+#define TCP_SEND_BUFFER_DROP_UNRELIABLE (256 * 1024)
+
+//bytes waiting in all tcp send buffers
+static uint64 tcp_send_buffered;
+
 #if defined(STEAM_WIN32)
 
 //windows xp support
@@ -238,6 +248,8 @@ static void kill_tcp_socket(struct TCP_Socket &socket)
         kill_socket(socket.sock);
     }
 
+    tcp_send_buffered -= socket.send_buffer.size();
+
     socket = TCP_Socket();
 }
 
@@ -401,6 +413,62 @@ static void connect_socket(sock_t sock, IP_PORT ip_port)
     connect(sock, (struct sockaddr *)&addr, addrsize);
 }
 
+//linux uses an abstract unix socket so nothing is left behind if the broker crashes, windows a loopback tcp port right below the normal one
+static sock_t broker_socket(uint16 port, struct sockaddr_storage *addr, int *addrsize)
+{
+    memset(addr, 0, sizeof(*addr));
+#if defined(STEAM_WIN32)
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)addr;
+    addr4->sin_family = AF_INET;
+    addr4->sin_addr.s_addr = htonl(0x7F000001);
+    addr4->sin_port = htons(port - 1);
+    *addrsize = sizeof(struct sockaddr_in);
+    return socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+#else
+    struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+    addr_un->sun_family = AF_UNIX;
+    int len = snprintf(addr_un->sun_path + 1, sizeof(addr_un->sun_path) - 1, "goldberg_emu_broker_%hu", port);
+    *addrsize = offsetof(struct sockaddr_un, sun_path) + 1 + len;
+    return socket(AF_UNIX, SOCK_STREAM, 0);
+#endif
+}
+
+static sock_t listen_broker(uint16 port)
+{
+    struct sockaddr_storage addr;
+    int addrsize;
+    sock_t sock = broker_socket(port, &addr, &addrsize);
+    if (!is_socket_valid(sock)) return sock;
+
+#if defined(STEAM_WIN32)
+    int set = 1;
+    setsockopt(sock, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *)&set, sizeof(set));
+#endif
+    if (bind(sock, (struct sockaddr *)&addr, addrsize) == 0 && listen(sock, 128) == 0 && set_socket_nonblocking(sock)) {
+        return sock;
+    }
+
+    kill_socket(sock);
+    return ~0;
+}
+
+static sock_t connect_broker(uint16 port)
+{
+    struct sockaddr_storage addr;
+    int addrsize;
+    sock_t sock = broker_socket(port, &addr, &addrsize);
+    if (!is_socket_valid(sock)) return sock;
+
+    //blocking, the broker is on the same host so this returns right away
+    if (connect(sock, (struct sockaddr *)&addr, addrsize) == 0 && set_socket_nonblocking(sock)) {
+        buffers_set(sock);
+        return sock;
+    }
+
+    kill_socket(sock);
+    return ~0;
+}
+
 unsigned int receive_buffer_amount(sock_t sock)
 {
 #if defined(STEAM_WIN32)
@@ -424,16 +492,24 @@ static void send_tcp_pending(struct TCP_Socket &socket)
     if (len <= 0) return;
 
     socket.send_buffer.erase(socket.send_buffer.begin(), socket.send_buffer.begin() + len);
+    tcp_send_buffered -= len;
 }
 
-static void send_buffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
+static bool send_buffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
 {
     uint32 size = msg->ByteSizeLong(), old_size = socket.send_buffer.size();
+    if (old_size + sizeof(uint32) + size > MAX_TCP_SEND_BUFFER || tcp_send_buffered + sizeof(uint32) + size > MAX_TCP_SEND_BUFFER_TOTAL) {
+        PRINT_DEBUG("TCP SEND BUFFER FULL %u %u %llu\n", old_size, size, tcp_send_buffered);
+        return false;
+    }
+
+    tcp_send_buffered += sizeof(uint32) + size;
     socket.send_buffer.resize(old_size + sizeof(uint32) + size);
     memcpy(&(socket.send_buffer[old_size]), &size, sizeof(size));
     msg->SerializeToArray(&(socket.send_buffer[old_size + sizeof(uint32)]), size);
 
     send_tcp_pending(socket);
+    return true;
 }
 
 static unsigned long peek_buffer_tcp(struct TCP_Socket &socket)
@@ -447,7 +523,7 @@ static unsigned long peek_buffer_tcp(struct TCP_Socket &socket)
     return length;
 }
 
-static bool unbuffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
+static bool unbuffer_tcp(struct TCP_Socket &socket, Common_Message *msg, uint32 *size = NULL)
 {
     uint32 l = peek_buffer_tcp(socket);
     if (!l) {
@@ -456,6 +532,7 @@ static bool unbuffer_tcp(struct TCP_Socket &socket, Common_Message *msg)
 
     if (msg->ParseFromArray(&(socket.recv_buffer[sizeof(uint32)]), l)) {
         socket.recv_buffer.erase(socket.recv_buffer.begin(), socket.recv_buffer.begin() + sizeof(l) + l);
+        if (size) *size = l;
         return true;
     } else {
         PRINT_DEBUG("BAD TCP DATA %lu %zu %zu %hhu\n", l, socket.recv_buffer.size(), sizeof(uint32), *((char *)&(socket.recv_buffer[sizeof(uint32)])));
@@ -481,6 +558,11 @@ static bool recv_tcp(struct TCP_Socket &socket)
     return false;
 }
 
+static uint64 heartbeat_time(std::chrono::high_resolution_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(time.time_since_epoch()).count();
+}
+
 static void socket_timeouts(struct TCP_Socket &socket, double extra_time)
 {
     if (check_timedout(socket.last_heartbeat_sent, HEARTBEAT_TIMEOUT / 2.0)) {
@@ -531,6 +613,14 @@ std::set<IP_PORT> Networking::resolve_ip(std::string dns)
 
 void Networking::do_callbacks_message(Common_Message *msg)
 {
+    if (is_socket_valid(broker_listen) && msg->dest_id() && std::find(ids.begin(), ids.end(), CSteamID((uint64)msg->dest_id())) == ids.end()) {
+        Connection *conn = find_connection((uint64)msg->dest_id());
+        if (conn && conn->local) {
+            send_message(msg, true, conn);
+            return;
+        }
+    }
+
     if (msg->has_network() || msg->has_network_old()) {
         PRINT_DEBUG("has_network\n");
         run_callbacks(CALLBACK_ID_NETWORKING, msg);
@@ -546,11 +636,26 @@ void Networking::do_callbacks_message(Common_Message *msg)
         run_callbacks(CALLBACK_ID_LOBBY, msg);
     }
 
+    if (msg->has_lobby_delta()) {
+        PRINT_DEBUG("has_lobby_delta\n");
+        run_callbacks(CALLBACK_ID_LOBBY, msg);
+    }
+
     if (msg->has_gameserver()) {
         PRINT_DEBUG("has_gameserver\n");
         run_callbacks(CALLBACK_ID_GAMESERVER, msg);
     }
 
+    if (msg->has_gameserver_digest()) {
+        PRINT_DEBUG("has_gameserver_digest\n");
+        run_callbacks(CALLBACK_ID_GAMESERVER, msg);
+    }
+
+    if (msg->has_gameserver_delta()) {
+        PRINT_DEBUG("has_gameserver_delta\n");
+        run_callbacks(CALLBACK_ID_GAMESERVER, msg);
+    }
+
     if (msg->has_friend_()) {
         PRINT_DEBUG("has_friend_\n");
         run_callbacks(CALLBACK_ID_FRIEND, msg);
@@ -582,7 +687,79 @@ void Networking::do_callbacks_message(Common_Message *msg)
     }
 }
 
-bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket)
+//returns true when the message was dropped or queued to go through later
+bool Networking::impair(Common_Message *msg, bool reliable, bool send)
+{
+    if (!impairment.active() && peer_impairments.empty()) return false;
+
+    uint64 peer = send ? msg->dest_id() : msg->source_id();
+    if (std::find(ids.begin(), ids.end(), CSteamID(peer)) != ids.end()) return false;
+
+    struct Network_Impairment *current = &impairment;
+    auto peer_impairment = peer_impairments.find(peer);
+    if (peer_impairment != peer_impairments.end()) current = &(peer_impairment->second);
+
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    if (!current->active() && !(reliable && last_reliable_delayed[send] > now)) return false;
+
+    if (send && msg->ByteSizeLong() >= MAX_UDP_SIZE) reliable = true;
+    std::uniform_real_distribution<float> percent(0.0, 100.0);
+    int32 delay = send ? current->lag_send : current->lag_recv;
+    Delayed_Message delayed_message;
+    if (!reliable) {
+        //reliable data would get resent so it only gets lag, everything else would break the ordering
+        float loss = send ? current->loss_send : current->loss_recv;
+        int32 jitter = send ? current->jitter_send : current->jitter_recv;
+        float reorder = send ? current->reorder_send : current->reorder_recv;
+        float dup = send ? current->dup_send : current->dup_recv;
+
+        if (loss > 0.0 && percent(impairment_random) < loss) {
+            PRINT_DEBUG("impairment dropped %u\n", send);
+            return true;
+        }
+
+        if (jitter > 0) delay += std::uniform_int_distribution<int32>(0, jitter)(impairment_random);
+        if (reorder > 0.0 && percent(impairment_random) < reorder) delay += current->reorder_time;
+        if (dup > 0.0 && percent(impairment_random) < dup) {
+            int32 dup_delay = delay + std::uniform_int_distribution<int32>(0, std::max(current->dup_time_max, 0))(impairment_random);
+            delayed_message.msg = *msg;
+            delayed_message.send = send;
+            delayed_message.reliable = reliable;
+            delayed.insert(std::make_pair(now + std::chrono::milliseconds(dup_delay), delayed_message));
+        }
+    }
+
+    std::chrono::high_resolution_clock::time_point release = now + std::chrono::milliseconds(std::max(delay, 0));
+    if (reliable) {
+        //lowering the lag must not let reliable messages pass the ones still waiting
+        if (release < last_reliable_delayed[send]) release = last_reliable_delayed[send];
+        last_reliable_delayed[send] = release;
+    }
+
+    if (release <= now) return false;
+
+    delayed_message.msg = *msg;
+    delayed_message.send = send;
+    delayed_message.reliable = reliable;
+    delayed.insert(std::make_pair(release, delayed_message));
+    return true;
+}
+
+void Networking::run_delayed()
+{
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    while (!delayed.empty() && delayed.begin()->first <= now) {
+        struct Delayed_Message delayed_message = delayed.begin()->second;
+        delayed.erase(delayed.begin());
+        if (delayed_message.send) {
+            send_message(&delayed_message.msg, delayed_message.reliable, NULL);
+        } else {
+            do_callbacks_message(&delayed_message.msg);
+        }
+    }
+}
+
+bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket, struct Connection *connection)
 {
     socket.last_heartbeat_received = std::chrono::high_resolution_clock::now();
     if (msg->has_low_level()) {
@@ -592,11 +769,12 @@ bool Networking::handle_tcp(Common_Message *msg, struct TCP_Socket &socket)
                 break;
             case Low_Level::HEARTBEAT:
                 //socket.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+                handle_heartbeat(msg, connection);
                 break;
         }
     }
 
-    do_callbacks_message(msg);
+    if (!impair(msg, true, false)) do_callbacks_message(msg);
     return true;
 }
 
@@ -660,6 +838,7 @@ struct Connection *Networking::new_connection(CSteamID search_id, uint32 appid)
     connection.ids.push_back(search_id);
     connection.appid = appid;
     connection.last_received = std::chrono::high_resolution_clock::now();
+    connection.stats_updated = connection.last_received;
 
     connections.push_back(connection);
     return &(connections[connections.size() - 1]);
@@ -693,7 +872,13 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
         Connection *conn = find_connection((uint64)msg->announce().peers(i).id(), msg->announce().peers(i).appid());
         PRINT_DEBUG("%p %lu %lu %llu\n", conn, conn ? conn->appid : 0, msg->announce().peers(i).appid(), msg->announce().peers(i).id());
         if (!conn || conn->appid != msg->announce().peers(i).appid()) {
+            //many peers can list the same new peer, it only needs one ping
+            auto pinged = peers_pinged.find(msg->announce().peers(i).id());
+            if (pinged != peers_pinged.end() && !check_timedout(pinged->second, BROADCAST_INTERVAL)) continue;
+            peers_pinged[msg->announce().peers(i).id()] = std::chrono::high_resolution_clock::now();
+
             Common_Message msg_ = create_announce(true);
+            msg_.mutable_announce()->set_direct(true);
 
             size_t size = msg_.ByteSizeLong();
             char *buffer = new char[size];
@@ -707,18 +892,24 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
     }
 
     conn->last_received = std::chrono::high_resolution_clock::now();
+    conn->gossip = msg->announce().gossip();
+    start_shm(conn, msg->announce());
 
     if (msg->announce().type() == Announce::PING) {
-        Common_Message msg = create_announce(false);
-        size_t size = msg.ByteSizeLong(); 
-        char *buffer = new char[size];
-        msg.SerializeToArray(buffer, size);
-        send_packet_to(udp_socket, ip_port, buffer, size);
-        delete[] buffer;
+        if (answer_announce(conn, msg->announce())) {
+            bool with_peers = share_peers(conn, msg->announce());
+            Common_Message msg = create_announce(false, conn, with_peers);
+            size_t size = msg.ByteSizeLong(); 
+            char *buffer = new char[size];
+            msg.SerializeToArray(buffer, size);
+            send_packet_to(udp_socket, ip_port, buffer, size);
+            delete[] buffer;
+        }
 
         //send ping packet if not pinged
         if (!conn->udp_pinged) {
             Common_Message msg = create_announce(true);
+            msg.mutable_announce()->set_direct(true);
             size_t size = msg.ByteSizeLong(); 
             char *buffer = new char[size];
             msg.SerializeToArray(buffer, size);
@@ -727,12 +918,148 @@ bool Networking::handle_announce(Common_Message *msg, IP_PORT ip_port)
         }
     } else if (msg->announce().type() == Announce::PONG) {
         conn->udp_ip_port = ip_port;
+        if (!conn->udp_pinged) conn->learned_seq = ++peer_seq;
         conn->udp_pinged = true;
     }
 
     return true;
 }
 
+void Networking::start_shm(struct Connection *conn, const Announce &announce)
+{
+    if (conn->local || !conn->ids.size()) return;
+    if (!announce.host_id().size() || announce.host_id() != Shm_Ring::host_id()) return;
+    if ((conn->shm || conn->shm_failed) && conn->shm_peer_session != announce.shm_session()) {
+        //the peer restarted with the same id, whatever is in the old rings never gets read
+        PRINT_DEBUG("Networking: peer shared memory session changed\n");
+        stop_shm(*conn);
+        conn->shm_failed = false;
+    }
+
+    if (conn->shm || conn->shm_failed) return;
+
+    uint64 peer = conn->ids[0].ConvertToUint64(), own = ids[0].ConvertToUint64();
+    if (std::find(ids.begin(), ids.end(), conn->ids[0]) != ids.end()) return;
+
+    //the lower id creates the segment, the other side only opens the one with the session from the announce
+    bool create = own < peer;
+    conn->shm = std::make_shared<Shm_Ring>(Shm_Ring::segment_name(own, peer), create, create ? shm_session : announce.shm_session());
+    conn->shm_peer_session = announce.shm_session();
+}
+
+static struct TCP_Socket *reliable_socket(struct Connection &conn)
+{
+    if (conn.tcp_socket_incoming.received_data) return &(conn.tcp_socket_incoming);
+    if (conn.tcp_socket_outgoing.received_data) return &(conn.tcp_socket_outgoing);
+    return NULL;
+}
+
+void Networking::stop_shm(struct Connection &conn)
+{
+    if (!conn.shm) return;
+
+    //reliable messages still waiting for room in the ring go out over tcp, in the same order
+    std::deque<std::string> pending = conn.shm->take_pending();
+    struct TCP_Socket *socket = reliable_socket(conn);
+    for (auto &data : pending) {
+        Common_Message msg;
+        if (!msg.ParseFromString(data)) continue;
+        if (!socket || !send_buffer_tcp(*socket, &msg)) {
+            PRINT_DEBUG("Networking: lost %zu pending shared memory messages\n", pending.size());
+            break;
+        }
+    }
+
+    conn.shm.reset();
+    conn.shm_reliable = false;
+}
+
+void Networking::run_shm(struct Connection &conn)
+{
+    if (!conn.shm->connect()) {
+        if (conn.shm->failed()) {
+            PRINT_DEBUG("Networking: shared memory not reachable, staying on udp/tcp\n");
+            conn.shm.reset();
+            conn.shm_failed = true;
+        }
+
+        return;
+    }
+
+    if (conn.shm->closed()) {
+        //the other side got restarted, died or dropped us, the next announce sets it up again
+        stop_shm(conn);
+        return;
+    }
+
+    conn.shm->heartbeat();
+    if (!conn.shm_reliable && conn.tcp_socket_incoming.send_buffer.empty() && conn.tcp_socket_outgoing.send_buffer.empty()) {
+        conn.shm_reliable = true;
+    }
+
+    conn.shm->flush();
+    std::shared_ptr<Shm_Ring> shm = conn.shm;
+    Common_Message msg;
+    uint32 size;
+    while (shm->receive(&msg, &size)) {
+        conn.stats.in_packets += 1;
+        conn.stats.in_bytes += size;
+        conn.last_received = std::chrono::high_resolution_clock::now();
+        msg.set_source_ip(ntohl(conn.tcp_ip_port.ip));
+        if (msg.has_low_level()) {
+            handle_heartbeat(&msg, &conn);
+        } else if (!impair(&msg, true, false)) {
+            do_callbacks_message(&msg);
+        }
+    }
+}
+
+uint64 Networking::peers_digest(uint32 *count)
+{
+    uint64 digest = gossip_mix(ids[0].ConvertToUint64(), this->appid);
+    *count = 1;
+    for (auto &conn: connections) {
+        if (!conn.udp_pinged || !conn.ids.size()) continue;
+        digest += gossip_mix(conn.ids[0].ConvertToUint64(), conn.appid);
+        *count += 1;
+    }
+
+    return digest;
+}
+
+//peers that gossip and are connected already know about us so their broadcasts only get an answer if their peer list is different
+//and then only from about GOSSIP_FANOUT of the peers that heard the announce, with the peers they weren't sent yet
+bool Networking::answer_announce(struct Connection *conn, const Announce &announce)
+{
+    if (!announce.gossip() || announce.direct() || !conn->connected || !conn->udp_pinged) return true;
+
+    uint32 count;
+    if (announce.peers_digest() == peers_digest(&count)) return false;
+
+    bool delta = false;
+    for (auto &c: connections) {
+        if (&c != conn && c.udp_pinged && c.learned_seq > conn->gossip_sent_seq) {
+            delta = true;
+            break;
+        }
+    }
+
+    //everyone on the LAN hears a broadcast, a peer that just started doesn't know that yet so its own count can be far too low
+    if (!delta) return false;
+    return gossip_selected(std::max(announce.peers_count(), count - 1), discovery_random);
+}
+
+//a new peer gets an answer from every peer that heard its broadcast so it only needs
+//the peer list from about GOSSIP_FANOUT of them, for the peers it can't reach with broadcasts
+bool Networking::share_peers(struct Connection *conn, const Announce &announce)
+{
+    if (!announce.gossip() || conn->connected || conn->udp_pinged) return true;
+
+    uint32 count;
+    peers_digest(&count);
+    return gossip_selected(count - 1, discovery_random);
+}
+
 bool Networking::handle_low_level_udp(Common_Message *msg, IP_PORT ip_port)
 {
     //TODO: connection appid
@@ -740,26 +1067,116 @@ bool Networking::handle_low_level_udp(Common_Message *msg, IP_PORT ip_port)
     if (!connection)
         return false;
 
+    connection->stats.in_packets += 1;
+    connection->stats.in_bytes += msg->ByteSizeLong();
     switch (msg->low_level().type()) {
         case Low_Level::DISCONNECT:
             
             break;
         case Low_Level::HEARTBEAT:
-            
+            handle_heartbeat(msg, connection);
             break;
     }
 
     return false;
 }
 
+void Networking::handle_heartbeat(Common_Message *msg, struct Connection *connection)
+{
+    //the keep alive heartbeats of the tcp sockets don't carry any stats
+    if (!connection || !msg->low_level().timestamp()) return;
+
+    const Low_Level &heartbeat = msg->low_level();
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    connection->heartbeats_received += 1;
+    if (heartbeat.sequence() > connection->heartbeat_sequence_received) connection->heartbeat_sequence_received = heartbeat.sequence();
+    connection->heartbeat_timestamp_received = heartbeat.timestamp();
+    connection->heartbeat_received = now;
+    connection->stats.quality_remote = heartbeat.quality();
+
+    //the other side tells how long it held on to our timestamp so that doesn't count as round trip time
+    uint64 now_time = heartbeat_time(now);
+    if (heartbeat.echo_timestamp() && now_time > heartbeat.echo_timestamp() + heartbeat.echo_delay()) {
+        uint64 rtt = now_time - heartbeat.echo_timestamp() - heartbeat.echo_delay();
+        if (connection->stats.rtt) {
+            connection->stats.rtt = (connection->stats.rtt * 7 + rtt) / 8;
+        } else {
+            connection->stats.rtt = rtt;
+        }
+
+        connection->rtt_updated = now;
+    }
+}
+
+void Networking::update_stats(struct Connection &conn)
+{
+    if (!check_timedout(conn.stats_updated, STATS_INTERVAL)) return;
+
+    std::chrono::high_resolution_clock::time_point now = std::chrono::high_resolution_clock::now();
+    float elapsed = std::chrono::duration_cast<std::chrono::duration<float>>(now - conn.stats_updated).count();
+    conn.stats_updated = now;
+
+    struct Connection_Stats &stats = conn.stats;
+    stats.out_packets_per_sec = (stats.out_packets - conn.stats_out_packets) / elapsed;
+    stats.out_bytes_per_sec = (stats.out_bytes - conn.stats_out_bytes) / elapsed;
+    stats.in_packets_per_sec = (stats.in_packets - conn.stats_in_packets) / elapsed;
+    stats.in_bytes_per_sec = (stats.in_bytes - conn.stats_in_bytes) / elapsed;
+    conn.stats_out_packets = stats.out_packets;
+    conn.stats_out_bytes = stats.out_bytes;
+    conn.stats_in_packets = stats.in_packets;
+    conn.stats_in_bytes = stats.in_bytes;
+
+    //heartbeats are numbered so the gaps in the sequence are the lost ones
+    uint32 expected = conn.heartbeat_sequence_received - conn.heartbeat_sequence_updated;
+    if (expected) {
+        float received = std::min((float)conn.heartbeats_received / (float)expected, 1.0f);
+        stats.quality_local = stats.quality_local * 0.75f + received * 0.25f;
+        conn.heartbeats_received = 0;
+        conn.heartbeat_sequence_updated = conn.heartbeat_sequence_received;
+    }
+
+    if ((conn.connected || conn.udp_pinged) && !conn.local && conn.ids.size() && ids.size()) {
+        Common_Message msg;
+        msg.set_source_id(ids[0].ConvertToUint64());
+        msg.set_dest_id(conn.ids[0].ConvertToUint64());
+        msg.set_allocated_low_level(new Low_Level());
+        Low_Level *heartbeat = msg.mutable_low_level();
+        heartbeat->set_type(Low_Level::HEARTBEAT);
+        conn.heartbeat_sequence += 1;
+        heartbeat->set_sequence(conn.heartbeat_sequence);
+        heartbeat->set_timestamp(heartbeat_time(now));
+        if (conn.heartbeat_timestamp_received) {
+            heartbeat->set_echo_timestamp(conn.heartbeat_timestamp_received);
+            heartbeat->set_echo_delay(std::chrono::duration_cast<std::chrono::microseconds>(now - conn.heartbeat_received).count());
+        }
+
+        heartbeat->set_quality(stats.quality_local);
+        sendTo(&msg, false, &conn);
+    }
+
+    if (stats_log.is_open() && conn.ids.size()) {
+        uint64 log_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        stats_log << log_time << "," << conn.ids[0].ConvertToUint64() << "," << stats.rtt << "," << stats.quality_local << "," << stats.quality_remote << ","
+                  << stats.out_packets_per_sec << "," << stats.out_bytes_per_sec << "," << stats.in_packets_per_sec << "," << stats.in_bytes_per_sec << ","
+                  << conn.tcp_socket_outgoing.send_buffer.size() + conn.tcp_socket_incoming.send_buffer.size() << "\n";
+        stats_log.flush();
+    }
+}
+
 #define NUM_TCP_WAITING 128
 
-Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets)
+Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets, bool local_broker)
 {
+    this->port = port;
+    this->local_broker = local_broker;
     tcp_port = udp_port = port;
     own_ip = 0x7F000001;
     last_run = std::chrono::high_resolution_clock::now();
     this->appid = appid;
+    impairment_random.seed(generate_random_int());
+    discovery_random.seed(generate_random_int());
+    shm_session = ((uint64)(uint32)generate_random_int() << 32) | (uint32)generate_random_int();
+    broadcast_interval = BROADCAST_INTERVAL;
 
     if (disable_sockets) {
         enabled = false;
@@ -777,6 +1194,20 @@ Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT>
     }
 
     run_at_startup();
+    ids.push_back(id);
+    if (local_broker) {
+        start_broker();
+    } else {
+        init_sockets();
+    }
+
+    reset_last_error();
+}
+
+bool Networking::init_sockets()
+{
+    udp_socket = ~0;
+    tcp_socket = ~0;
     sock_t sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     PRINT_DEBUG("UDP socket: %u\n", sock);
     if (is_socket_valid(sock) && set_socket_nonblocking(sock)) {
@@ -844,9 +1275,218 @@ Networking::Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT>
         enabled = true;
     }
 
-    ids.push_back(id);
+    return enabled;
+}
 
-    reset_last_error();
+void Networking::start_broker()
+{
+    broker_listen = listen_broker(port);
+    if (is_socket_valid(broker_listen)) {
+        PRINT_DEBUG("Networking: local broker for port %hu\n", port);
+        init_sockets();
+        return;
+    }
+
+    sock_t sock = connect_broker(port);
+    if (is_socket_valid(sock)) {
+        PRINT_DEBUG("Networking: using the local broker for port %hu\n", port);
+        broker = TCP_Socket();
+        broker.sock = sock;
+        broker.received_data = true;
+        broker.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+        broker_client = true;
+        enabled = true;
+        send_broker_hello();
+        return;
+    }
+
+    init_sockets();
+}
+
+void Networking::send_broker_hello()
+{
+    Common_Message msg;
+    msg.set_source_id(ids[0].ConvertToUint64());
+    Broker *hello = new Broker();
+    hello->set_type(Broker::HELLO);
+    for (auto &id : ids) hello->add_ids(id.ConvertToUint64());
+    hello->set_appid(appid);
+    msg.set_allocated_broker(hello);
+    send_buffer_tcp(broker, &msg);
+}
+
+void Networking::send_broker_peers(struct Connection *conn, std::vector<CSteamID> &peer_ids, uint32 peer_appid, uint32 ip, bool online)
+{
+    Common_Message msg;
+    msg.set_source_id(ids[0].ConvertToUint64());
+    msg.set_dest_id(conn->ids[0].ConvertToUint64());
+    Broker *peers = new Broker();
+    peers->set_type(Broker::PEERS);
+    for (auto &id : peer_ids) peers->add_ids(id.ConvertToUint64());
+    peers->set_appid(peer_appid);
+    peers->set_online(online);
+    peers->set_ip(ip);
+    peers->set_broker_ip(htonl(own_ip));
+    msg.set_allocated_broker(peers);
+    send_buffer_tcp(conn->tcp_socket_incoming, &msg);
+}
+
+void Networking::handle_broker_hello(Common_Message *msg, struct TCP_Socket &socket)
+{
+    if (!msg->has_broker() || msg->broker().type() != Broker::HELLO || !msg->broker().ids_size()) {
+        kill_tcp_socket(socket);
+        return;
+    }
+
+    const Broker &hello = msg->broker();
+    CSteamID id((uint64)hello.ids(0));
+    Connection *conn = find_connection(id, hello.appid());
+    if (conn && conn->appid == hello.appid() && conn->local) {
+        kill_tcp_socket(conn->tcp_socket_incoming);
+    } else {
+        conn = new_connection(id, hello.appid());
+        if (!conn) {
+            PRINT_DEBUG("Networking: local instance with the id of a lan peer\n");
+            kill_tcp_socket(socket);
+            return;
+        }
+    }
+
+    PRINT_DEBUG("Networking: local instance %llu\n", id.ConvertToUint64());
+    conn->local = true;
+    conn->tcp_socket_incoming = socket;
+    conn->tcp_ip_port.ip = htonl(own_ip);
+    conn->tcp_ip_port.port = htons(tcp_port);
+    conn->last_received = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < hello.ids_size(); ++i) {
+        add_id_connection(conn, (uint64)hello.ids(i));
+    }
+
+    //the ones that come or go later get sent from run_callback_user
+    send_broker_peers(conn, ids, appid, htonl(own_ip), true);
+    for (auto &c: connections) {
+        if (&c != conn && c.connected) send_broker_peers(conn, c.ids, c.appid, c.tcp_ip_port.ip, true);
+    }
+
+    //so the lan knows where the ids of the new instance are
+    send_announce_broadcasts();
+}
+
+void Networking::handle_broker_local(Common_Message *msg, struct Connection *conn)
+{
+    conn->tcp_socket_incoming.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+    if (msg->has_low_level()) return;
+
+    if (msg->has_broker()) {
+        if (msg->broker().type() != Broker::HELLO) return;
+        for (int i = 0; i < msg->broker().ids_size(); ++i) {
+            add_id_connection(conn, (uint64)msg->broker().ids(i));
+        }
+
+        send_announce_broadcasts();
+        return;
+    }
+
+    //the instance already applied its impairment
+    bool reliable = !msg->broker_unreliable();
+    msg->clear_broker_unreliable();
+    msg->set_source_ip(own_ip);
+    msg->set_source_port(udp_port);
+    send_message(msg, reliable, NULL);
+}
+
+void Networking::handle_broker_peers(Common_Message *msg)
+{
+    const Broker &peers = msg->broker();
+    if (peers.type() != Broker::PEERS) return;
+    if (peers.broker_ip()) own_ip = ntohl(peers.broker_ip());
+
+    for (int i = 0; i < peers.ids_size(); ++i) {
+        CSteamID steam_id((uint64)peers.ids(i));
+        if (std::find(ids.begin(), ids.end(), steam_id) != ids.end()) continue;
+
+        Connection *conn = find_connection(steam_id, peers.appid());
+        if (conn && conn->appid != peers.appid()) conn = NULL;
+        if (peers.online()) {
+            if (!conn) conn = new_connection(steam_id, peers.appid());
+            if (!conn) continue;
+            conn->tcp_ip_port.ip = peers.ip();
+            conn->last_received = std::chrono::high_resolution_clock::now();
+            if (!conn->connected) {
+                conn->connected = true;
+                run_callback_user(steam_id, true, peers.appid());
+            }
+        } else if (conn) {
+            if (conn->connected) run_callback_user(steam_id, false, peers.appid());
+            connections.erase(connections.begin() + (conn - &connections[0]));
+        }
+    }
+}
+
+void Networking::run_broker_hub(double time_extra)
+{
+    sock_t sock;
+    while (is_socket_valid(sock = accept(broker_listen, NULL, NULL))) {
+        if (!set_socket_nonblocking(sock)) {
+            kill_socket(sock);
+            continue;
+        }
+
+        buffers_set(sock);
+        struct TCP_Socket socket;
+        socket.sock = sock;
+        socket.received_data = true;
+        socket.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+        broker_accepted.push_back(socket);
+    }
+
+    auto socket = std::begin(broker_accepted);
+    while (socket != std::end(broker_accepted)) {
+        recv_tcp(*socket);
+        Common_Message msg;
+        if (unbuffer_tcp(*socket, &msg)) {
+            struct TCP_Socket s = *socket;
+            socket = broker_accepted.erase(socket);
+            handle_broker_hello(&msg, s);
+        } else if (check_timedout(socket->last_heartbeat_received, HEARTBEAT_TIMEOUT + time_extra)) {
+            kill_tcp_socket(*socket);
+            socket = broker_accepted.erase(socket);
+        } else {
+            ++socket;
+        }
+    }
+}
+
+void Networking::run_broker_client(double time_extra)
+{
+    recv_tcp(broker);
+    Common_Message msg;
+    while (unbuffer_tcp(broker, &msg)) {
+        broker.last_heartbeat_received = std::chrono::high_resolution_clock::now();
+        if (msg.has_broker()) {
+            handle_broker_peers(&msg);
+        } else if (!msg.has_low_level()) {
+            if (!impair(&msg, true, false)) do_callbacks_message(&msg);
+        }
+    }
+
+    run_delayed();
+    run_local_send();
+    send_tcp_pending(broker);
+    socket_timeouts(broker, time_extra);
+
+    if (!is_tcp_socket_valid(broker)) {
+        //the broker went away, one of the instances that used it takes over
+        PRINT_DEBUG("Networking: lost the local broker\n");
+        for (auto &conn: connections) {
+            if (conn.connected) for (auto &steam_id : conn.ids) run_callback_user(steam_id, false, conn.appid);
+        }
+
+        connections.clear();
+        broker_client = false;
+        enabled = false;
+        start_broker();
+    }
 }
 
 Networking::~Networking()
@@ -860,11 +1500,17 @@ Networking::~Networking()
         kill_tcp_socket(c);
     }
 
-    kill_socket(udp_socket);
-    kill_socket(tcp_socket);
+    for (auto &c : broker_accepted) {
+        kill_tcp_socket(c);
+    }
+
+    kill_tcp_socket(broker);
+    if (is_socket_valid(broker_listen)) kill_socket(broker_listen);
+    if (is_socket_valid(udp_socket)) kill_socket(udp_socket);
+    if (is_socket_valid(tcp_socket)) kill_socket(tcp_socket);
 }
 
-Common_Message Networking::create_announce(bool request)
+Common_Message Networking::create_announce(bool request, struct Connection *dest, bool with_peers)
 {
     Announce *announce = new Announce();
     PRINT_DEBUG("Networking:: ids length %zu\n", ids.size());
@@ -873,7 +1519,10 @@ Common_Message Networking::create_announce(bool request)
     } else {
         announce->set_type(Announce::PONG);
         for (auto &conn: connections) {
+            if (!with_peers) break;
             PRINT_DEBUG("Connection %u %llu %lu\n", conn.udp_pinged, conn.ids[0].ConvertToUint64(), conn.appid);
+            //peers that gossip only get the peers added since the last time, and themselves so they know their own ip
+            if (dest && dest->gossip && &conn != dest && conn.learned_seq <= dest->gossip_sent_seq) continue;
             if (conn.udp_pinged) {
                 Announce_Other_Peers *peer = announce->add_peers();
                 peer->set_id(conn.ids[0].ConvertToUint64());
@@ -884,9 +1533,22 @@ Common_Message Networking::create_announce(bool request)
         }
     }
 
+    if (!request && with_peers && dest && dest->gossip) dest->gossip_sent_seq = peer_seq;
+
+    uint32 count;
+    announce->set_gossip(true);
+    announce->set_peers_digest(peers_digest(&count));
+    announce->set_peers_count(count);
+    announce->set_host_id(Shm_Ring::host_id());
+    announce->set_shm_session(shm_session);
     announce->set_tcp_port(tcp_port);
     announce->set_appid(this->appid);
     for (auto &id : ids) announce->add_ids(id.ConvertToUint64());
+    //the instances we are the broker for are reached through us
+    for (auto &conn: connections) {
+        if (conn.local) for (auto &id : conn.ids) announce->add_ids(id.ConvertToUint64());
+    }
+
     Common_Message msg;
     msg.set_allocated_announce(announce);
     msg.set_source_id(ids[0].ConvertToUint64());
@@ -907,7 +1569,24 @@ void Networking::send_announce_broadcasts()
 
     delete[] buffer;
     last_broadcast = std::chrono::high_resolution_clock::now();
-    PRINT_DEBUG("Networking:: sent broadcasts\n");
+
+    unsigned connected = 0;
+    for (auto &conn: connections) {
+        if (conn.connected) ++connected;
+    }
+
+    broadcast_interval = gossip_broadcast_interval(connected, discovery_random);
+
+    auto pinged = peers_pinged.begin();
+    while (pinged != peers_pinged.end()) {
+        if (check_timedout(pinged->second, BROADCAST_INTERVAL)) {
+            pinged = peers_pinged.erase(pinged);
+        } else {
+            ++pinged;
+        }
+    }
+
+    PRINT_DEBUG("Networking:: sent broadcasts, next in %f\n", broadcast_interval);
 }
 
 void Networking::Run()
@@ -920,9 +1599,15 @@ void Networking::Run()
         return;
     }
 
+    if (broker_client) {
+        run_broker_client(time_extra);
+        reset_last_error();
+        return;
+    }
+
     //PRINT_DEBUG("Networking::Run() %lf\n", time_extra);
     PRINT_DEBUG("Networking::Run()\n");
-    if (check_timedout(last_broadcast, BROADCAST_INTERVAL)) {
+    if (check_timedout(last_broadcast, broadcast_interval)) {
         send_announce_broadcasts();
     }
 
@@ -945,23 +1630,22 @@ void Networking::Run()
                 } else
 
                 {
+                    Connection *connection = find_connection((uint64)msg.source_id());
+                    if (connection) {
+                        connection->stats.in_packets += 1;
+                        connection->stats.in_bytes += len;
+                    }
+
                     msg.set_source_ip(ntohl(ip_port.ip));
                     msg.set_source_port(ntohs(ip_port.port));
-                    do_callbacks_message(&msg);
+                    if (!impair(&msg, false, false)) do_callbacks_message(&msg);
                 }
             }
         }
     }
 
-    PRINT_DEBUG("RECV LOCAL\n");
-    std::vector<Common_Message> local_send_copy = local_send;
-    local_send.clear();
-
-    for (auto & m: local_send_copy) {
-        m.set_source_ip(ntohl(own_ip));
-        m.set_source_port(ntohs(udp_port));
-        do_callbacks_message(&m);
-    }
+    run_delayed();
+    run_local_send();
 
     struct sockaddr_storage addr;
 #if defined(STEAM_WIN32)
@@ -1033,9 +1717,11 @@ void Networking::Run()
         }
     }
 
+    if (is_socket_valid(broker_listen)) run_broker_hub(time_extra);
+
     PRINT_DEBUG("CONNECTIONS %zu\n", connections.size());
     for (auto &conn: connections) {
-        if (!is_tcp_socket_valid(conn.tcp_socket_outgoing)) {
+        if (!conn.local && !is_tcp_socket_valid(conn.tcp_socket_outgoing)) {
             sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
             if (is_socket_valid(sock) && set_socket_nonblocking(sock)) {
                 PRINT_DEBUG("NEW SOCKET %u %u\n", sock, conn.tcp_socket_outgoing.sock);
@@ -1083,30 +1769,40 @@ void Networking::Run()
 
         PRINT_DEBUG("RUN SOCKET3 %u %u\n", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
         Common_Message msg;
-        while (unbuffer_tcp(conn.tcp_socket_outgoing, &msg)) {
+        uint32 size;
+        while (unbuffer_tcp(conn.tcp_socket_outgoing, &msg, &size)) {
             PRINT_DEBUG("UNBUFFER SOCKET\n");
+            conn.stats.in_packets += 1;
+            conn.stats.in_bytes += size;
             msg.set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
-            handle_tcp(&msg, conn.tcp_socket_outgoing);
+            handle_tcp(&msg, conn.tcp_socket_outgoing, &conn);
             conn.last_received = std::chrono::high_resolution_clock::now();
         }
 
-        while (unbuffer_tcp(conn.tcp_socket_incoming, &msg)) {
+        while (unbuffer_tcp(conn.tcp_socket_incoming, &msg, &size)) {
             PRINT_DEBUG("UNBUFFER SOCKET\n");
+            conn.stats.in_packets += 1;
+            conn.stats.in_bytes += size;
             msg.set_source_ip(ntohl(conn.tcp_ip_port.ip)); //TODO: get from tcp socket
-            handle_tcp(&msg, conn.tcp_socket_incoming);
+            if (conn.local) {
+                handle_broker_local(&msg, &conn);
+            } else {
+                handle_tcp(&msg, conn.tcp_socket_incoming, &conn);
+            }
             conn.last_received = std::chrono::high_resolution_clock::now();
         }
 
         PRINT_DEBUG("RUN SOCKET4 %u %u\n", conn.tcp_socket_outgoing.sock, conn.tcp_socket_incoming.sock);
+        if (conn.shm) run_shm(conn);
         socket_timeouts(conn.tcp_socket_outgoing, time_extra);
         socket_timeouts(conn.tcp_socket_incoming, time_extra);
-
+        update_stats(conn);
     }
 
     {
         auto conn = std::begin(connections);
         while (conn != std::end(connections)) {
-            if (check_timedout(conn->last_received, USER_TIMEOUT + time_extra)) {
+            if (check_timedout(conn->last_received, USER_TIMEOUT + time_extra) || (conn->local && !is_tcp_socket_valid(conn->tcp_socket_incoming))) {
                 if (conn->connected) for (auto &steam_id : conn->ids) run_callback_user(steam_id, false, conn->appid);
                 kill_tcp_socket(conn->tcp_socket_outgoing);
                 kill_tcp_socket(conn->tcp_socket_incoming);
@@ -1138,10 +1834,33 @@ void Networking::addListenId(CSteamID id)
 
     PRINT_DEBUG("ADDED ID\n");
     ids.push_back(id);
+    if (broker_client) {
+        send_broker_hello();
+        return;
+    }
+
+    std::vector<CSteamID> new_ids(1, id);
+    for (auto &conn: connections) {
+        if (conn.local) send_broker_peers(&conn, new_ids, appid, htonl(own_ip), true);
+    }
+
     send_announce_broadcasts();
     return;
 }
 
+void Networking::run_local_send()
+{
+    PRINT_DEBUG("RECV LOCAL\n");
+    std::vector<Common_Message> local_send_copy = local_send;
+    local_send.clear();
+
+    for (auto & m: local_send_copy) {
+        m.set_source_ip(ntohl(own_ip));
+        m.set_source_port(ntohs(udp_port));
+        do_callbacks_message(&m);
+    }
+}
+
 void Networking::setAppID(uint32 appid)
 {
     this->appid = appid;
@@ -1178,6 +1897,13 @@ uint32 Networking::getIP(CSteamID id)
 bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
 {
     if (!enabled) return false;
+    if (impair(msg, reliable, true)) return true;
+
+    return send_message(msg, reliable, conn);
+}
+
+bool Networking::send_message(Common_Message *msg, bool reliable, Connection *conn)
+{
 
     size_t size = msg->ByteSizeLong();
     if (size >= MAX_UDP_SIZE) reliable = true; //too big for UDP
@@ -1193,20 +1919,63 @@ bool Networking::sendTo(Common_Message *msg, bool reliable, Connection *conn)
         }
     }
 
+    if (broker_client) {
+        //everything goes through the broker, it knows where the peers are
+        if (!ret) {
+            if (!reliable && broker.send_buffer.size() >= TCP_SEND_BUFFER_DROP_UNRELIABLE) {
+                PRINT_DEBUG("dropping unreliable %zu\n", size);
+                ret = true;
+            } else {
+                msg->set_broker_unreliable(!reliable);
+                ret = send_buffer_tcp(broker, msg);
+                msg->clear_broker_unreliable();
+                if (ret && conn) {
+                    conn->stats.out_packets += 1;
+                    conn->stats.out_bytes += size;
+                }
+            }
+        }
+
+        reset_last_error();
+        return ret;
+    }
+
     if (!conn) {
         conn = find_connection(dest_id, this->appid);
     }
 
+    if (!ret && conn && conn->shm && conn->shm->connected() && (conn->shm_reliable || !reliable)) {
+        //once reliable messages use the ring they only use the ring, a refused one is not sent some other way
+        ret = conn->shm->send(msg, reliable);
+        if (ret) {
+            conn->stats.out_packets += 1;
+            conn->stats.out_bytes += size;
+        }
+
+        if (reliable) {
+            reset_last_error();
+            return ret;
+        }
+    }
+
     if (!ret && conn) {
         if (reliable || !conn->udp_pinged) {
-            if (conn->tcp_socket_incoming.received_data) {
-                send_buffer_tcp(conn->tcp_socket_incoming, msg);
-                ret = true;
-            } else if (conn->tcp_socket_outgoing.received_data) {
-                send_buffer_tcp(conn->tcp_socket_outgoing, msg);
+            struct TCP_Socket *socket = reliable_socket(*conn);
+
+            if (socket && !reliable && socket->send_buffer.size() >= TCP_SEND_BUFFER_DROP_UNRELIABLE) {
+                //the peer isn't keeping up, unreliable data is the first to go
+                PRINT_DEBUG("dropping unreliable %zu\n", size);
                 ret = true;
+            } else if (socket) {
+                ret = send_buffer_tcp(*socket, msg);
+                if (ret) {
+                    conn->stats.out_packets += 1;
+                    conn->stats.out_bytes += size;
+                }
             }
         } else {
+            conn->stats.out_packets += 1;
+            conn->stats.out_bytes += size;
             char *buffer = new char[size];
             msg->SerializeToArray(buffer, size);
             send_packet_to(udp_socket, conn->udp_ip_port, buffer, size);
@@ -1256,6 +2025,17 @@ void Networking::run_callbacks(Callback_Ids id, Common_Message *msg)
 
 void Networking::run_callback_user(CSteamID steam_id, bool online, uint32 appid)
 {
+    //the instances we are the broker for keep the same peer list as us
+    if (is_socket_valid(broker_listen)) {
+        Connection *peer = find_connection(steam_id, appid);
+        uint32 ip = peer ? peer->tcp_ip_port.ip : 0;
+        std::vector<CSteamID> peer_ids(1, steam_id);
+        for (auto &conn: connections) {
+            if (!conn.local || std::find(conn.ids.begin(), conn.ids.end(), steam_id) != conn.ids.end()) continue;
+            send_broker_peers(&conn, peer_ids, appid, ip, online);
+        }
+    }
+
     //only give callbacks for right game accounts
     if (steam_id.BIndividualAccount() && appid != this->appid && appid != LOBBY_CONNECT_APPID) return;
 
@@ -1288,3 +2068,55 @@ uint32 Networking::getOwnIP()
 {
     return own_ip;
 }
+
+bool Networking::getStats(CSteamID id, struct Connection_Stats *stats)
+{
+    Connection *conn = find_connection(id, this->appid);
+    if (!conn) return false;
+
+    *stats = conn->stats;
+    stats->pending_reliable = conn->tcp_socket_outgoing.send_buffer.size() + conn->tcp_socket_incoming.send_buffer.size();
+    return true;
+}
+
+std::map<uint64, uint64> Networking::getPeerRTTs(double *age)
+{
+    std::map<uint64, uint64> rtts;
+    std::chrono::high_resolution_clock::time_point newest = {};
+    for (auto &conn : connections) {
+        if (!conn.stats.rtt) continue;
+        for (auto &steam_id : conn.ids) {
+            rtts[steam_id.ConvertToUint64()] = conn.stats.rtt;
+        }
+
+        if (conn.rtt_updated > newest) newest = conn.rtt_updated;
+    }
+
+    if (age) {
+        *age = rtts.empty() ? 0.0 : std::chrono::duration_cast<std::chrono::duration<double>>(std::chrono::high_resolution_clock::now() - newest).count();
+    }
+
+    return rtts;
+}
+
+void Networking::setStatsLog(std::string path)
+{
+    if (stats_log.is_open()) stats_log.close();
+    stats_log.open(path, std::ios::out | std::ios::app);
+    if (!stats_log.is_open()) {
+        PRINT_DEBUG("Networking: could not open stats log %s\n", path.c_str());
+        return;
+    }
+
+    stats_log << "time_ms,steam_id,rtt_us,quality_local,quality_remote,out_packets_per_sec,out_bytes_per_sec,in_packets_per_sec,in_bytes_per_sec,pending_reliable_bytes\n";
+    stats_log.flush();
+}
+
+void Networking::setImpairment(struct Network_Impairment impairment, CSteamID peer)
+{
+    if (peer == k_steamIDNil) {
+        this->impairment = impairment;
+    } else {
+        peer_impairments[peer.ConvertToUint64()] = impairment;
+    }
+}
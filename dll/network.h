@@ -19,6 +19,8 @@
 #define NETWORK_INCLUDE
 
 #include "base.h"
+#include "network_impairment.h"
+#include "shm_ring.h"
 
 inline bool protobuf_message_equal(const google::protobuf::MessageLite& msg_a,
                 const google::protobuf::MessageLite& msg_b) {
@@ -77,6 +79,20 @@ struct TCP_Socket {
     std::chrono::high_resolution_clock::time_point last_heartbeat_sent, last_heartbeat_received;
 };
 
+struct Connection_Stats {
+    //smoothed round trip time in microseconds, 0 until a heartbeat came back
+    uint64 rtt = 0;
+    //fraction of heartbeats from the other side that were received, and what the other side measured for ours
+    float quality_local = 1.0;
+    float quality_remote = 1.0;
+
+    uint64 out_packets = 0, out_bytes = 0, in_packets = 0, in_bytes = 0;
+    float out_packets_per_sec = 0.0, out_bytes_per_sec = 0.0, in_packets_per_sec = 0.0, in_bytes_per_sec = 0.0;
+
+    //bytes still waiting in the tcp send buffers
+    uint32 pending_reliable = 0;
+};
+
 struct Connection {
     struct TCP_Socket tcp_socket_outgoing, tcp_socket_incoming;
     bool connected = false;
@@ -86,12 +102,44 @@ struct Connection {
     std::vector<CSteamID> ids;
     uint32 appid;
     std::chrono::high_resolution_clock::time_point last_received;
+
+    //another instance on this host that goes through us as its broker
+    bool local = false;
+
+    //a process on the same host, everything goes through the shared memory rings once they are connected
+    std::shared_ptr<Shm_Ring> shm;
+    bool shm_failed = false;
+    //the session from the peer's announce when the rings were set up, it changes when the peer restarts
+    uint64 shm_peer_session = 0;
+    //reliable messages only move to the rings once the tcp send buffers are empty, so they can't pass older ones
+    bool shm_reliable = false;
+
+    //the peer only answers announces when the peer lists differ
+    bool gossip = false;
+    //when this peer got added to the peer list and how much of the peer list the peer was sent
+    uint64 learned_seq = 0, gossip_sent_seq = 0;
+
+    struct Connection_Stats stats;
+    //counters at the last rate update
+    uint64 stats_out_packets = 0, stats_out_bytes = 0, stats_in_packets = 0, stats_in_bytes = 0;
+    std::chrono::high_resolution_clock::time_point stats_updated;
+    uint32 heartbeat_sequence = 0;
+    //heartbeats received from the other side since the last rate update and the highest sequence seen
+    uint32 heartbeats_received = 0, heartbeat_sequence_received = 0, heartbeat_sequence_updated = 0;
+    uint64 heartbeat_timestamp_received = 0;
+    std::chrono::high_resolution_clock::time_point heartbeat_received, rtt_updated;
+};
+
+struct Delayed_Message {
+    Common_Message msg;
+    bool send;
+    bool reliable;
 };
 
 class Networking {
     bool enabled = false;
     std::chrono::high_resolution_clock::time_point last_run;
-    sock_t udp_socket, tcp_socket;
+    sock_t udp_socket = ~0, tcp_socket = ~0;
     uint16 udp_port, tcp_port;
     uint32 own_ip;
     std::vector<struct Connection> connections;
@@ -100,31 +148,78 @@ class Networking {
 
     bool handle_announce(Common_Message *msg, IP_PORT ip_port);
     bool handle_low_level_udp(Common_Message *msg, IP_PORT ip_port);
-    bool handle_tcp(Common_Message *msg, struct TCP_Socket &socket);
+    bool handle_tcp(Common_Message *msg, struct TCP_Socket &socket, struct Connection *connection);
+    void handle_heartbeat(Common_Message *msg, struct Connection *connection);
+    void update_stats(struct Connection &conn);
     void send_announce_broadcasts();
 
     std::vector<CSteamID> ids;
     uint32 appid;
     std::chrono::high_resolution_clock::time_point last_broadcast;
+    //randomized every broadcast so peers that started together don't keep broadcasting at the same time
+    double broadcast_interval;
+    //counts the peers added to the peer list, the ones added after a peer was last sent the list are the ones it gets next
+    uint64 peer_seq = 0;
+    //peers from peer lists that were sent a ping, so every peer list that has them doesn't cause another one
+    std::map<uint64, std::chrono::high_resolution_clock::time_point> peers_pinged;
+    std::mt19937 discovery_random;
+    uint64 shm_session;
+    void start_shm(struct Connection *conn, const Announce &announce);
+    void run_shm(struct Connection &conn);
+    void stop_shm(struct Connection &conn);
+    uint64 peers_digest(uint32 *count);
+    bool answer_announce(struct Connection *conn, const Announce &announce);
+    bool share_peers(struct Connection *conn, const Announce &announce);
     std::vector<IP_PORT> custom_broadcasts;
 
     std::vector<struct TCP_Socket> accepted;
     std::recursive_mutex mutex;
 
+    //with the local broker enabled the first instance on the host listens on broker_listen and does all the lan networking,
+    //the other instances only have the broker socket and their connections are copies of the ones the broker has
+    bool local_broker = false;
+    bool broker_client = false;
+    sock_t broker_listen = ~0;
+    struct TCP_Socket broker;
+    std::vector<struct TCP_Socket> broker_accepted;
+    uint16 port;
+    bool init_sockets();
+    void start_broker();
+    void run_broker_client(double time_extra);
+    void run_broker_hub(double time_extra);
+    void handle_broker_hello(Common_Message *msg, struct TCP_Socket &socket);
+    void handle_broker_local(Common_Message *msg, struct Connection *conn);
+    void handle_broker_peers(Common_Message *msg);
+    void send_broker_peers(struct Connection *conn, std::vector<CSteamID> &peer_ids, uint32 peer_appid, uint32 ip, bool online);
+    void send_broker_hello();
+    void run_local_send();
+
     struct Network_Callback_Container callbacks[CALLBACK_IDS_MAX];
     std::vector<Common_Message> local_send;
+    std::ofstream stats_log;
+
+    //impairment for everyone and overrides for some peers, by steam id
+    struct Network_Impairment impairment;
+    std::map<uint64, struct Network_Impairment> peer_impairments;
+    std::multimap<std::chrono::high_resolution_clock::time_point, struct Delayed_Message> delayed;
+    //index 1 is for sending
+    std::chrono::high_resolution_clock::time_point last_reliable_delayed[2];
+    std::mt19937 impairment_random;
+    bool impair(Common_Message *msg, bool reliable, bool send);
+    void run_delayed();
+    bool send_message(Common_Message *msg, bool reliable, Connection *conn);
 
     bool add_id_connection(struct Connection *connection, CSteamID steam_id);
     void run_callbacks(Callback_Ids id, Common_Message *msg);
     void run_callback_user(CSteamID steam_id, bool online, uint32 appid);
     void do_callbacks_message(Common_Message *msg);
 
-    Common_Message create_announce(bool request);
+    Common_Message create_announce(bool request, struct Connection *conn = NULL, bool with_peers = true);
 public:
     //NOTE: for all functions ips/ports are passed/returned in host byte order
     //ex: 127.0.0.1 should be passed as 0x7F000001
     static std::set<IP_PORT> resolve_ip(std::string dns);
-    Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets);
+    Networking(CSteamID id, uint32 appid, uint16 port, std::set<IP_PORT> *custom_broadcasts, bool disable_sockets, bool local_broker = false);
     ~Networking();
     void addListenId(CSteamID id);
     void setAppID(uint32 appid);
@@ -137,6 +232,14 @@ public:
     bool setCallback(Callback_Ids id, CSteamID steam_id, void (*message_callback)(void *object, Common_Message *msg), void *object);
     uint32 getIP(CSteamID id);
     uint32 getOwnIP();
+
+    bool getStats(CSteamID id, struct Connection_Stats *stats);
+    //smoothed round trip time in microseconds to every id of the peers that answered a heartbeat, age is set to how old the newest measurement is in seconds
+    std::map<uint64, uint64> getPeerRTTs(double *age);
+    //appends a line per connection every stats update to the file
+    void setStatsLog(std::string path);
+    //fake packet loss/lag/etc..., for everyone if peer is nil
+    void setImpairment(struct Network_Impairment impairment, CSteamID peer = k_steamIDNil);
 };
 
 #endif
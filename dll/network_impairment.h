@@ -0,0 +1,41 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef NETWORK_IMPAIRMENT_INCLUDE
+#define NETWORK_IMPAIRMENT_INCLUDE
+
+#include "../sdk_includes/steamtypes.h"
+
+//fake network conditions, percentages and milliseconds like the k_ESteamNetworkingConfig_FakePacket* values
+struct Network_Impairment {
+    float loss_send = 0.0, loss_recv = 0.0;
+    int32 lag_send = 0, lag_recv = 0;
+    //random extra delay of up to this for unreliable packets, steam doesn't have a config value for it
+    int32 jitter_send = 0, jitter_recv = 0;
+    float reorder_send = 0.0, reorder_recv = 0.0;
+    int32 reorder_time = 15;
+    float dup_send = 0.0, dup_recv = 0.0;
+    int32 dup_time_max = 10;
+
+    bool active() const
+    {
+        return loss_send > 0.0 || loss_recv > 0.0 || lag_send > 0 || lag_recv > 0 || jitter_send > 0 || jitter_recv > 0 ||
+               reorder_send > 0.0 || reorder_recv > 0.0 || dup_send > 0.0 || dup_recv > 0.0;
+    }
+};
+
+#endif
@@ -19,6 +19,7 @@
 #define SETTINGS_INCLUDE
 
 #include "base.h"
+#include "network_impairment.h"
 
 struct IP_PORT;
 
@@ -149,6 +150,11 @@ public:
 
     //networking
     bool disable_networking = false;
+    //instances on the same host share one broker instance that does the lan networking for them
+    bool local_broker = false;
+    //write periodic connection stats to a csv file in the save directory
+    bool connection_stats_log = false;
+    struct Network_Impairment network_impairment;
 
     //overlay
     bool disable_overlay = false;
@@ -162,6 +168,9 @@ public:
     //make lobby creation fail in the matchmaking interface
     bool disable_lobby_creation = false;
 
+    //chat messages kept per lobby for GetLobbyChatEntry
+    uint32 lobby_chat_history = 256;
+
     //warn people who use force_ settings
     bool warn_forced = false;
 
@@ -42,6 +42,40 @@ static void load_custom_broadcasts(std::string broadcasts_filepath, std::set<IP_
     }
 }
 
+static void load_network_impairment(std::string impairment_filepath, struct Network_Impairment &impairment)
+{
+    PRINT_DEBUG("Network impairment file path: %s\n", impairment_filepath.c_str());
+    std::ifstream impairment_file(utf8_decode(impairment_filepath));
+    consume_bom(impairment_file);
+    if (impairment_file.is_open()) {
+        std::string line;
+        while (std::getline(impairment_file, line)) {
+            if (line.size() && line.back() == '\r') line.pop_back();
+            std::size_t deliminator = line.find("=");
+            if (deliminator == 0 || deliminator == std::string::npos) continue;
+
+            std::string name = line.substr(0, deliminator);
+            try {
+                float value = std::stof(line.substr(deliminator + 1));
+                if (name == "loss_send") impairment.loss_send = value;
+                else if (name == "loss_recv") impairment.loss_recv = value;
+                else if (name == "lag_send") impairment.lag_send = value;
+                else if (name == "lag_recv") impairment.lag_recv = value;
+                else if (name == "jitter_send") impairment.jitter_send = value;
+                else if (name == "jitter_recv") impairment.jitter_recv = value;
+                else if (name == "reorder_send") impairment.reorder_send = value;
+                else if (name == "reorder_recv") impairment.reorder_recv = value;
+                else if (name == "reorder_time") impairment.reorder_time = value;
+                else if (name == "dup_send") impairment.dup_send = value;
+                else if (name == "dup_recv") impairment.dup_recv = value;
+                else if (name == "dup_time_max") impairment.dup_time_max = value;
+                else continue;
+                PRINT_DEBUG("Network impairment %s %f\n", name.c_str(), value);
+            } catch (...) {}
+        }
+    }
+}
+
 template<typename Out>
 static void split_string(const std::string &s, char delim, Out result) {
     std::stringstream ss(s);
@@ -211,6 +245,9 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
     load_custom_broadcasts(local_storage->get_global_settings_path() + "custom_broadcasts.txt", custom_broadcasts);
     load_custom_broadcasts(Local_Storage::get_game_settings_path() + "custom_broadcasts.txt", custom_broadcasts);
 
+    struct Network_Impairment network_impairment;
+    load_network_impairment(Local_Storage::get_game_settings_path() + "network_impairment.txt", network_impairment);
+
     // Acount name
     char name[32] = {};
     if (local_storage->get_data_settings("account_name.txt", name, sizeof(name) - 1) <= 0) {
@@ -297,9 +334,12 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
 
     bool steam_offline_mode = false;
     bool disable_networking = false;
+    bool local_broker = false;
+    bool connection_stats_log = false;
     bool disable_overlay = false;
     bool disable_lobby_creation = false;
     int build_id = 10;
+    uint32 lobby_chat_history = 256;
 
     bool warn_forced = false;
 
@@ -313,6 +353,10 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
                 steam_offline_mode = true;
             } else if (p == "disable_networking.txt") {
                 disable_networking = true;
+            } else if (p == "local_broker.txt") {
+                local_broker = true;
+            } else if (p == "connection_stats.txt") {
+                connection_stats_log = true;
             } else if (p == "disable_overlay.txt") {
                 disable_overlay = true;
             } else if (p == "disable_lobby_creation.txt") {
@@ -349,6 +393,10 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
                 char array_id[10] = {};
                 int len = Local_Storage::get_file_data(steam_settings_path + "build_id.txt", array_id, sizeof(array_id) - 1);
                 if (len > 0) build_id = std::stoi(array_id);
+            } else if (p == "lobby_chat_history.txt") {
+                char array_history[16] = {};
+                int len = Local_Storage::get_file_data(steam_settings_path + "lobby_chat_history.txt", array_history, sizeof(array_history) - 1);
+                if (len > 0) lobby_chat_history = std::max(std::atoi(array_history), 1);
             }
         }
     }
@@ -361,12 +409,20 @@ uint32 create_localstorage_settings(Settings **settings_client_out, Settings **s
     settings_server->custom_broadcasts = custom_broadcasts;
     settings_client->disable_networking = disable_networking;
     settings_server->disable_networking = disable_networking;
+    settings_client->local_broker = local_broker;
+    settings_server->local_broker = local_broker;
+    settings_client->connection_stats_log = connection_stats_log;
+    settings_server->connection_stats_log = connection_stats_log;
+    settings_client->network_impairment = network_impairment;
+    settings_server->network_impairment = network_impairment;
     settings_client->disable_overlay = disable_overlay;
     settings_server->disable_overlay = disable_overlay;
     settings_client->disable_lobby_creation = disable_lobby_creation;
     settings_server->disable_lobby_creation = disable_lobby_creation;
     settings_client->build_id = build_id;
     settings_server->build_id = build_id;
+    settings_client->lobby_chat_history = lobby_chat_history;
+    settings_server->lobby_chat_history = lobby_chat_history;
     settings_client->warn_forced = warn_forced;
     settings_server->warn_forced = warn_forced;
     settings_client->warn_local_save = local_save;
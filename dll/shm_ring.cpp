@@ -0,0 +1,364 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "shm_ring.h"
+
+#define SHM_RING_MAGIC 0x474F4C45
+//set in the size of every piece of a split message except the last one
+#define SHM_RING_MORE 0x80000000
+
+static void ring_copy_in(char *ring, uint32 pos, const char *data, uint32 size)
+{
+    uint32 offset = pos & (SHM_RING_SIZE - 1);
+    uint32 first = std::min(size, (uint32)SHM_RING_SIZE - offset);
+    memcpy(ring + offset, data, first);
+    memcpy(ring, data + first, size - first);
+}
+
+static void ring_copy_out(const char *ring, uint32 pos, char *data, uint32 size)
+{
+    uint32 offset = pos & (SHM_RING_SIZE - 1);
+    uint32 first = std::min(size, (uint32)SHM_RING_SIZE - offset);
+    memcpy(data, ring + offset, first);
+    memcpy(data + first, ring, size - first);
+}
+
+const std::string &Shm_Ring::host_id()
+{
+    static std::string id;
+    if (id.empty()) {
+#if defined(STEAM_WIN32)
+        char name[MAX_COMPUTERNAME_LENGTH + 1] = {};
+        DWORD size = sizeof(name);
+        if (GetComputerNameA(name, &size)) id = std::string(name, size);
+#else
+        std::ifstream boot_id("/proc/sys/kernel/random/boot_id");
+        std::getline(boot_id, id);
+#endif
+    }
+
+    return id;
+}
+
+std::string Shm_Ring::segment_name(uint64 id_a, uint64 id_b)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "goldberg_emu_%llx_%llx", (unsigned long long)std::min(id_a, id_b), (unsigned long long)std::max(id_a, id_b));
+    return name;
+}
+
+Shm_Ring::Shm_Ring(std::string name, bool create, uint64 session)
+{
+    this->name = name;
+    this->create = create;
+    this->session = session;
+    started = std::chrono::high_resolution_clock::now();
+    if (create) init_segment();
+}
+
+Shm_Ring::~Shm_Ring()
+{
+    if (segment) segment->closed.store(1, std::memory_order_release);
+    if (create) unlink_segment();
+    unmap_segment();
+}
+
+bool Shm_Ring::map_segment()
+{
+#if defined(STEAM_WIN32)
+    std::string path = "Local\\" + name;
+    if (create) {
+        mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(Segment), path.c_str());
+        if (mapping && GetLastError() == ERROR_ALREADY_EXISTS) {
+            //still open in the process that used it last
+            CloseHandle(mapping);
+            mapping = NULL;
+        }
+    } else {
+        mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, path.c_str());
+    }
+
+    if (!mapping) return false;
+
+    segment = (Segment *)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Segment));
+    if (!segment) {
+        CloseHandle(mapping);
+        mapping = NULL;
+        return false;
+    }
+#else
+    std::string path = "/dev/shm/" + name;
+    int fd;
+    if (create) {
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            //left behind by a process that crashed before the other side opened it
+            unlink(path.c_str());
+            fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        }
+
+        if (fd >= 0 && ftruncate(fd, sizeof(Segment)) != 0) {
+            close(fd);
+            unlink(path.c_str());
+            fd = -1;
+        }
+    } else {
+        fd = open(path.c_str(), O_RDWR);
+        struct stat st;
+        if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Segment))) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd < 0) return false;
+
+    void *mem = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        if (create) unlink(path.c_str());
+        return false;
+    }
+
+    segment = (Segment *)mem;
+    unlinked = false;
+#endif
+
+    return true;
+}
+
+void Shm_Ring::unmap_segment()
+{
+    if (!segment) return;
+
+#if defined(STEAM_WIN32)
+    UnmapViewOfFile(segment);
+    CloseHandle(mapping);
+    mapping = NULL;
+#else
+    munmap(segment, sizeof(Segment));
+#endif
+    segment = NULL;
+    send_ring = recv_ring = NULL;
+}
+
+void Shm_Ring::unlink_segment()
+{
+#if !defined(STEAM_WIN32)
+    //both sides have it mapped once it's attached so the name isn't needed anymore
+    if (segment && !unlinked) {
+        unlink(("/dev/shm/" + name).c_str());
+        unlinked = true;
+    }
+#endif
+}
+
+bool Shm_Ring::init_segment()
+{
+    if (!map_segment()) return false;
+
+    //a new segment is all zeroes
+    segment->session = session;
+    segment->magic = SHM_RING_MAGIC;
+    segment->ready.store(1, std::memory_order_release);
+    PRINT_DEBUG("Shm_Ring: created %s\n", name.c_str());
+    return true;
+}
+
+bool Shm_Ring::connect()
+{
+    if (connected()) return true;
+    if (failed()) return false;
+
+    if (create) {
+        if (!segment && !init_segment()) return false;
+        if (!segment->attached.load(std::memory_order_acquire)) return false;
+
+        unlink_segment();
+        send_ring = &(segment->rings[0]);
+        recv_ring = &(segment->rings[1]);
+        own_beat = &(segment->beats[0]);
+        peer_beat = &(segment->beats[1]);
+    } else {
+        if (!segment && !map_segment()) return false;
+        if (!segment->ready.load(std::memory_order_acquire) || segment->magic != SHM_RING_MAGIC || segment->session != session) {
+            unmap_segment();
+            return false;
+        }
+
+        uint32 attached = 0;
+        if (!segment->attached.compare_exchange_strong(attached, 1, std::memory_order_acq_rel)) {
+            unmap_segment();
+            return false;
+        }
+
+        send_ring = &(segment->rings[1]);
+        recv_ring = &(segment->rings[0]);
+        own_beat = &(segment->beats[1]);
+        peer_beat = &(segment->beats[0]);
+    }
+
+    peer_beat_value = peer_beat->load(std::memory_order_relaxed);
+    peer_beat_changed = std::chrono::high_resolution_clock::now();
+    PRINT_DEBUG("Shm_Ring: connected %s\n", name.c_str());
+    return true;
+}
+
+bool Shm_Ring::connected()
+{
+    return send_ring != NULL;
+}
+
+bool Shm_Ring::failed()
+{
+    return !connected() && check_timedout(started, SHM_CONNECT_TIMEOUT);
+}
+
+bool Shm_Ring::closed()
+{
+    if (!segment) return false;
+    if (segment->closed.load(std::memory_order_acquire)) return true;
+    return connected() && check_timedout(peer_beat_changed, SHM_PEER_TIMEOUT);
+}
+
+void Shm_Ring::heartbeat()
+{
+    if (!connected()) return;
+
+    own_beat->fetch_add(1, std::memory_order_relaxed);
+    uint32 beat = peer_beat->load(std::memory_order_relaxed);
+    if (beat != peer_beat_value) {
+        peer_beat_value = beat;
+        peer_beat_changed = std::chrono::high_resolution_clock::now();
+    }
+}
+
+bool Shm_Ring::write(const char *data, uint32 size, bool more)
+{
+    uint32 header = size | (more ? SHM_RING_MORE : 0);
+    uint32 head = send_ring->head.load(std::memory_order_relaxed);
+    uint32 tail = send_ring->tail.load(std::memory_order_acquire);
+    if (SHM_RING_SIZE - (head - tail) < sizeof(header) + size) return false;
+
+    ring_copy_in(send_ring->data, head, (const char *)&header, sizeof(header));
+    ring_copy_in(send_ring->data, head + sizeof(header), data, size);
+    send_ring->head.store(head + sizeof(header) + size, std::memory_order_release);
+    return true;
+}
+
+bool Shm_Ring::send(Common_Message *msg, bool reliable)
+{
+    if (!connected()) return false;
+
+    size_t size = msg->ByteSizeLong();
+    if (!reliable) {
+        //unreliable messages can't pass the ones waiting so they get dropped, same when they don't fit
+        if (!pending.empty() || size > SHM_RING_FRAGMENT_SIZE) return true;
+
+        std::string data;
+        msg->SerializeToString(&data);
+        write(data.data(), data.size(), false);
+        return true;
+    }
+
+    //one message bigger than the limit still goes through when nothing else is waiting
+    if (!pending.empty() && pending_size + size > SHM_RING_MAX_PENDING) {
+        PRINT_DEBUG("Shm_Ring: pending full %zu\n", pending_size);
+        return false;
+    }
+
+    if (size > SHM_RING_MAX_PENDING) {
+        PRINT_DEBUG("Shm_Ring: message too big %zu\n", size);
+        return false;
+    }
+
+    std::string data;
+    msg->SerializeToString(&data);
+    pending_size += data.size();
+    pending.push_back(std::move(data));
+    flush();
+    return true;
+}
+
+void Shm_Ring::flush()
+{
+    while (connected() && !pending.empty()) {
+        std::string &data = pending.front();
+        uint32 size = std::min(data.size() - pending_offset, (size_t)SHM_RING_FRAGMENT_SIZE);
+        bool more = pending_offset + size < data.size();
+        if (!write(data.data() + pending_offset, size, more)) return;
+
+        pending_offset += size;
+        if (!more) {
+            pending_size -= data.size();
+            pending_offset = 0;
+            pending.pop_front();
+        }
+    }
+}
+
+std::deque<std::string> Shm_Ring::take_pending()
+{
+    std::deque<std::string> out;
+    out.swap(pending);
+    pending_size = pending_offset = 0;
+    return out;
+}
+
+bool Shm_Ring::receive(Common_Message *msg, uint32 *size)
+{
+    if (!connected()) return false;
+
+    while (true) {
+        uint32 tail = recv_ring->tail.load(std::memory_order_relaxed);
+        uint32 head = recv_ring->head.load(std::memory_order_acquire);
+        uint32 header;
+        if (head - tail < sizeof(header)) return false;
+
+        ring_copy_out(recv_ring->data, tail, (char *)&header, sizeof(header));
+        uint32 length = header & ~SHM_RING_MORE;
+        if (length > SHM_RING_SIZE - sizeof(header) || head - tail < sizeof(header) + length) return false;
+
+        recv_buffer.resize(length);
+        if (length) ring_copy_out(recv_ring->data, tail + sizeof(header), &(recv_buffer[0]), length);
+        recv_ring->tail.store(tail + sizeof(header) + length, std::memory_order_release);
+
+        if (header & SHM_RING_MORE || !recv_message.empty()) {
+            if (recv_message.size() + length > SHM_RING_MAX_PENDING) {
+                PRINT_DEBUG("Shm_Ring: split message too big\n");
+                recv_message.clear();
+                continue;
+            }
+
+            recv_message.append(recv_buffer.data(), length);
+            if (header & SHM_RING_MORE) continue;
+
+            bool parsed = msg->ParseFromString(recv_message);
+            length = recv_message.size();
+            recv_message.clear();
+            if (parsed) {
+                if (size) *size = length;
+                return true;
+            }
+        } else if (msg->ParseFromArray(recv_buffer.data(), length)) {
+            if (size) *size = length;
+            return true;
+        }
+
+        PRINT_DEBUG("Shm_Ring: bad message %u\n", length);
+    }
+}
@@ -0,0 +1,113 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+
+//outside the guard so that including this first still declares everything network.h needs from here
+#include "common_includes.h"
+
+#ifndef SHM_RING_INCLUDE
+#define SHM_RING_INCLUDE
+
+//bytes in each direction, a power of 2 so the positions can wrap around
+#define SHM_RING_SIZE (4 * 1024 * 1024)
+//messages that don't fit in the ring right now wait up to this much before reliable ones get refused
+#define SHM_RING_MAX_PENDING (32 * 1024 * 1024)
+//messages bigger than this are written in pieces so they never have to leave the ring
+#define SHM_RING_FRAGMENT_SIZE (SHM_RING_SIZE / 4)
+//how long the other side gets to open the segment before the peer stays on udp/tcp
+#define SHM_CONNECT_TIMEOUT 10.0
+//the other side is treated as gone if its heartbeat doesn't change for this long
+#define SHM_PEER_TIMEOUT 10.0
+
+//Two single producer single consumer byte rings in a shared memory segment,
+//one for each direction between two processes on the same host. Each message
+//is its size followed by the serialized Common_Message, big messages are
+//split into several of those. The side with the lower steam id creates the
+//segment, the other side opens it and checks the session the creator put in
+//its announces so it can't attach to a segment left behind by a crashed
+//process. Each side bumps a heartbeat in the segment so the other one notices
+//when it dies without closing it.
+class Shm_Ring {
+    struct Ring {
+        alignas(64) std::atomic<uint32> head;
+        alignas(64) std::atomic<uint32> tail;
+        alignas(64) char data[SHM_RING_SIZE];
+    };
+
+    struct Segment {
+        uint32 magic;
+        uint64 session;
+        std::atomic<uint32> ready;
+        std::atomic<uint32> attached;
+        //set by the side that stops using the segment so the other one goes back to udp/tcp
+        std::atomic<uint32> closed;
+        //0 is bumped by the creator
+        std::atomic<uint32> beats[2];
+        //0 is written by the creator
+        Ring rings[2];
+    };
+
+    std::string name;
+    bool create;
+    uint64 session;
+    Segment *segment = NULL;
+    std::vector<char> recv_buffer;
+    //pieces of a split message received so far
+    std::string recv_message;
+    Ring *send_ring = NULL, *recv_ring = NULL;
+    std::atomic<uint32> *own_beat = NULL, *peer_beat = NULL;
+    uint32 peer_beat_value = 0;
+    std::chrono::high_resolution_clock::time_point started, peer_beat_changed;
+    bool unlinked = false;
+    //serialized reliable messages, the front one might already be partly in the ring
+    std::deque<std::string> pending;
+    size_t pending_size = 0, pending_offset = 0;
+
+#if defined(STEAM_WIN32)
+    HANDLE mapping = NULL;
+#endif
+
+    bool map_segment();
+    bool init_segment();
+    void unmap_segment();
+    void unlink_segment();
+    bool write(const char *data, uint32 size, bool more);
+
+public:
+    //a value that is the same for every process on this host and different on others
+    static const std::string &host_id();
+    static std::string segment_name(uint64 id_a, uint64 id_b);
+
+    Shm_Ring(std::string name, bool create, uint64 session);
+    ~Shm_Ring();
+    //has to be called every run until it returns true or failed() does
+    bool connect();
+    bool connected();
+    bool failed();
+    //also true once the other side stopped beating
+    bool closed();
+    //has to be called every run while connected
+    void heartbeat();
+    //unreliable messages get dropped instead of waiting when the ring is full
+    bool send(Common_Message *msg, bool reliable);
+    bool receive(Common_Message *msg, uint32 *size);
+    void flush();
+    //reliable messages that never made it into the ring, whole, oldest first
+    std::deque<std::string> take_pending();
+};
+
+#endif
@@ -19,26 +19,32 @@
 #include "settings_parser.h"
 
 static std::mutex kill_background_thread_mutex;
-static std::condition_variable kill_background_thread_cv;
 static bool kill_background_thread;
 static void background_thread(Steam_Client *client)
 {
     PRINT_DEBUG("background thread starting\n");
+    //the nagle wakeups can come much more often than the once a second keepalive run
+    std::chrono::steady_clock::time_point last_run;
 
     while (1) {
+        //wakes up early when a networking sockets nagle timer runs out or starts before the next second
+        client->steam_networking_sockets->wait_nagle_timer(std::chrono::seconds(1));
+
         {
-            std::unique_lock<std::mutex> lck(kill_background_thread_mutex);
-            if (kill_background_thread || kill_background_thread_cv.wait_for(lck, std::chrono::seconds(1)) != std::cv_status::timeout) {
-                if (kill_background_thread) {
-                    PRINT_DEBUG("background thread exit\n");
-                    return;
-                }
+            std::lock_guard<std::mutex> lck(kill_background_thread_mutex);
+            if (kill_background_thread) {
+                PRINT_DEBUG("background thread exit\n");
+                return;
             }
         }
 
+        //the client and gameserver sockets share their connections
+        client->steam_networking_sockets->flush_nagle_timers();
+
         unsigned long long time = std::chrono::duration_cast<std::chrono::duration<unsigned long long>>(std::chrono::system_clock::now().time_since_epoch()).count();
 
-        if (time > client->last_cb_run + 1) {
+        if (time > client->last_cb_run + 1 && std::chrono::steady_clock::now() - last_run >= std::chrono::seconds(1)) {
+            last_run = std::chrono::steady_clock::now();
             global_mutex.lock();
             PRINT_DEBUG("background thread run\n");
             client->network->Run();
@@ -52,7 +58,13 @@ Steam_Client::Steam_Client()
 {
     uint32 appid = create_localstorage_settings(&settings_client, &settings_server, &local_storage);
 
-    network = new Networking(settings_server->get_local_steam_id(), appid, settings_server->get_port(), &(settings_server->custom_broadcasts), settings_server->disable_networking);
+    network = new Networking(settings_server->get_local_steam_id(), appid, settings_server->get_port(), &(settings_server->custom_broadcasts), settings_server->disable_networking, settings_server->local_broker);
+    if (settings_client->connection_stats_log) {
+        std::string stats_path = local_storage->get_path("");
+        if (stats_path.size()) network->setStatsLog(stats_path + "connection_stats.csv");
+    }
+
+    network->setImpairment(settings_client->network_impairment);
 
     callback_results_client = new SteamCallResults();
     callback_results_server = new SteamCallResults();
@@ -78,7 +90,7 @@ Steam_Client::Steam_Client()
     steam_user_stats = new Steam_User_Stats(settings_client, local_storage, callback_results_client, callbacks_client, steam_overlay);
     steam_apps = new Steam_Apps(settings_client, callback_results_client);
     steam_networking = new Steam_Networking(settings_client, network, callbacks_client, run_every_runcb);
-    steam_remote_storage = new Steam_Remote_Storage(settings_client, local_storage, callback_results_client);
+    steam_remote_storage = new Steam_Remote_Storage(settings_client, local_storage, callback_results_client, run_every_runcb);
     steam_screenshots = new Steam_Screenshots(local_storage, callbacks_client);
     steam_http = new Steam_HTTP(settings_client, network, callback_results_client, callbacks_client);
     steam_controller = new Steam_Controller(settings_client, callback_results_client, callbacks_client, run_every_runcb);
@@ -94,7 +106,7 @@ Steam_Client::Steam_Client()
     steam_networking_sockets_serialized = new Steam_Networking_Sockets_Serialized(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
     steam_networking_messages = new Steam_Networking_Messages(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
     steam_game_coordinator = new Steam_Game_Coordinator(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
-    steam_networking_utils = new Steam_Networking_Utils(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
+    steam_networking_utils = new Steam_Networking_Utils(settings_client, network, callback_results_client, callbacks_client, run_every_runcb, steam_networking_sockets->get_shared_between_client_server());
     steam_unified_messages = new Steam_Unified_Messages(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
     steam_game_search = new Steam_Game_Search(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
     steam_parties = new Steam_Parties(settings_client, network, callback_results_client, callbacks_client, run_every_runcb);
@@ -889,10 +901,12 @@ bool Steam_Client::BShutdownIfAllPipesClosed()
             kill_background_thread_mutex.lock();
             kill_background_thread = true;
             kill_background_thread_mutex.unlock();
-            kill_background_thread_cv.notify_one();
+            steam_networking_sockets->wake_background_thread();
         }
 
         steam_controller->Shutdown();
+        steam_remote_storage->flush_io();
+        Local_Storage::flush_journal();
 #ifdef EMU_OVERLAY
     if(!settings_client->disable_overlay)
         steam_overlay->UnSetupOverlay();
@@ -22,6 +22,8 @@
 #include "../overlay_experimental/steam_overlay.h"
 
 #define SEND_FRIEND_RATE 4.0
+//friend data is only sent when it changes, changes closer together than this are sent as one update
+#define FRIEND_DATA_COALESCE 0.5
 
 struct Avatar_Numbers {
     int smallest;
@@ -1062,7 +1064,7 @@ void RunCallbacks()
         resend_friend_data();
     }
 
-    if (modified) {
+    if (modified && check_timedout(last_sent_friends, FRIEND_DATA_COALESCE)) {
         Common_Message msg;
         msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
         Friend *f = new Friend(us);
@@ -18,6 +18,16 @@
 #include "steam_gameserver.h"
 
 #define SEND_SERVER_RATE 5.0
+//after a change the full server info is sent right away, then only digests with a doubling interval
+#define SERVER_KEEPALIVE_MAX 60.0
+
+static void steam_gameserver_callback(void *object, Common_Message *msg)
+{
+    PRINT_DEBUG("steam_gameserver_callback\n");
+
+    Steam_GameServer *steam_gameserver = (Steam_GameServer *)object;
+    steam_gameserver->Callback(msg);
+}
 
 Steam_GameServer::Steam_GameServer(class Settings *settings, class Networking *network, class SteamCallBacks *callbacks)
 {
@@ -26,11 +36,110 @@ Steam_GameServer::Steam_GameServer(class Settings *settings, class Networking *n
     server_data.set_id(settings->get_local_steam_id().ConvertToUint64());
     this->callbacks = callbacks;
     ticket_manager = new Auth_Ticket_Manager(settings, network, callbacks);
+    a2s = new A2S_Responder(&server_data, &players);
+    keepalive_interval = SEND_SERVER_RATE;
+    this->network->setCallback(CALLBACK_ID_GAMESERVER, settings->get_local_steam_id(), &steam_gameserver_callback, this);
+    this->network->setCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &steam_gameserver_callback, this);
+}
+
+void Steam_GameServer::server_changed()
+{
+    server_data_changed = true;
+    a2s->server_changed();
+}
+
+//the full info with a hash of it, the values map is hashed separately because its serialization order isn't fixed
+Gameserver *Steam_GameServer::server_info()
+{
+    server_data.set_appid(settings->get_local_game_id().AppID());
+    Gameserver *info = new Gameserver(server_data);
+    info->set_num_players(ticket_manager->countInboundAuth());
+    info->clear_values();
+    uint64 version = std::hash<std::string>()(info->SerializeAsString());
+    for (auto &v : server_data.values()) {
+        version ^= std::hash<std::string>()(v.first + '\0' + v.second) * 31;
+    }
+
+    *info->mutable_values() = server_data.values();
+    info->set_state_version(version);
+    info->set_keepalive_interval(keepalive_interval * 1000);
+    return info;
+}
+
+void Steam_GameServer::send_server_info(uint64 dest)
+{
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    msg.set_allocated_gameserver(server_info());
+    state_version = msg.gameserver().state_version();
+    if (dest) {
+        msg.set_dest_id(dest);
+        network->sendTo(&msg, true);
+    } else {
+        network->sendToAllIndividuals(&msg, true);
+    }
+}
+
+//the fields that aren't in the values map or about the digests
+static std::string server_header(const Gameserver &info)
+{
+    Gameserver header(info);
+    header.clear_values();
+    header.clear_state_version();
+    header.clear_keepalive_interval();
+    return header.SerializeAsString();
+}
+
+//peers that understand digests get only what changed since the last update, the others get the full info
+void Steam_GameServer::send_server_update()
+{
+    Gameserver *info = server_info();
+    state_version = info->state_version();
+    Common_Message msg;
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    if (!sent_server_data.state_version()) {
+        sent_server_data = *info;
+        msg.set_allocated_gameserver(info);
+        network->sendToAllIndividuals(&msg, true);
+        return;
+    }
+
+    Gameserver_Delta *delta = new Gameserver_Delta();
+    delta->set_id(info->id());
+    delta->set_appid(info->appid());
+    delta->set_base_state_version(sent_server_data.state_version());
+    delta->set_state_version(info->state_version());
+    delta->set_keepalive_interval(info->keepalive_interval());
+    if (server_header(sent_server_data) != server_header(*info)) {
+        delta->set_header_changed(true);
+        *delta->mutable_header() = *info;
+        delta->mutable_header()->clear_values();
+    }
+
+    for (auto &v : info->values()) {
+        auto f = sent_server_data.values().find(v.first);
+        if (f == sent_server_data.values().end() || f->second != v.second) (*delta->mutable_values())[v.first] = v.second;
+    }
+
+    for (auto &v : sent_server_data.values()) {
+        if (info->values().find(v.first) == info->values().end()) delta->add_removed_values(v.first);
+    }
+
+    PRINT_DEBUG("Steam_GameServer Sending Gameserver delta, header %u values %i removed %i\n", delta->header_changed(), delta->values_size(), delta->removed_values_size());
+    sent_server_data = *info;
+    delete info;
+    msg.set_allocated_gameserver_delta(delta);
+    network->sendToAllIndividuals(&msg, true);
+
+    for (auto &peer : peers) {
+        if (!digest_peers.count(peer)) send_server_info(peer);
+    }
 }
 
 Steam_GameServer::~Steam_GameServer()
 {
     delete ticket_manager;
+    delete a2s;
 }
 
 //
@@ -62,6 +171,8 @@ bool Steam_GameServer::InitGameServer( uint32 unIP, uint16 usGamePort, uint16 us
     server_data.set_query_port(usQueryPort);
     server_data.set_offline(false);
     if (!settings->get_local_game_id().AppID()) settings->set_game_id(CGameID(nGameAppId));
+    server_data.set_appid(settings->get_local_game_id().AppID());
+    server_changed();
     //TODO: flags should be k_unServerFlag
     flags = unFlags;
     policy_response_called = false;
@@ -79,6 +190,7 @@ void Steam_GameServer::SetProduct( const char *pszProduct )
     PRINT_DEBUG("SetProduct\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_product(pszProduct);
+    server_changed();
 }
 
 
@@ -89,6 +201,7 @@ void Steam_GameServer::SetGameDescription( const char *pszGameDescription )
     PRINT_DEBUG("SetGameDescription\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_game_description(pszGameDescription);
+    server_changed();
 }
 
 
@@ -101,6 +214,7 @@ void Steam_GameServer::SetModDir( const char *pszModDir )
     PRINT_DEBUG("SetModDir\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_mod_dir(pszModDir);
+    server_changed();
 }
 
 
@@ -110,6 +224,7 @@ void Steam_GameServer::SetDedicatedServer( bool bDedicated )
     PRINT_DEBUG("SetDedicatedServer\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_dedicated_server(bDedicated);
+    server_changed();
 }
 
 
@@ -129,6 +244,7 @@ void Steam_GameServer::LogOn( const char *pszToken )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     call_servers_connected = true;
     logged_in = true;
+    server_data_changed = true;
 }
 
 void Steam_GameServer::LogOn(
@@ -150,6 +266,7 @@ void Steam_GameServer::LogOnAnonymous()
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     call_servers_connected = true;
     logged_in = true;
+    server_data_changed = true;
 }
 
 void Steam_GameServer::LogOn()
@@ -216,6 +333,7 @@ void Steam_GameServer::SetMaxPlayerCount( int cPlayersMax )
     PRINT_DEBUG("SetMaxPlayerCount\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_max_player_count(cPlayersMax);
+    server_changed();
 }
 
 
@@ -225,6 +343,7 @@ void Steam_GameServer::SetBotPlayerCount( int cBotplayers )
     PRINT_DEBUG("SetBotPlayerCount\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_bot_player_count(cBotplayers);
+    server_changed();
 }
 
 
@@ -236,6 +355,7 @@ void Steam_GameServer::SetServerName( const char *pszServerName )
     PRINT_DEBUG("SetServerName\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_server_name(pszServerName);
+    server_changed();
 }
 
 
@@ -247,6 +367,7 @@ void Steam_GameServer::SetMapName( const char *pszMapName )
     PRINT_DEBUG("SetMapName\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_map_name(pszMapName);
+    server_changed();
 }
 
 
@@ -256,6 +377,7 @@ void Steam_GameServer::SetPasswordProtected( bool bPasswordProtected )
     PRINT_DEBUG("SetPasswordProtected\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_password_protected(bPasswordProtected);
+    server_changed();
 }
 
 
@@ -266,6 +388,7 @@ void Steam_GameServer::SetSpectatorPort( uint16 unSpectatorPort )
     PRINT_DEBUG("SetSpectatorPort\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_spectator_port(unSpectatorPort);
+    server_changed();
 }
 
 
@@ -277,6 +400,7 @@ void Steam_GameServer::SetSpectatorServerName( const char *pszSpectatorServerNam
     PRINT_DEBUG("SetSpectatorServerName\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_spectator_server_name(pszSpectatorServerName);
+    server_changed();
 }
 
 
@@ -286,6 +410,7 @@ void Steam_GameServer::ClearAllKeyValues()
     PRINT_DEBUG("ClearAllKeyValues\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.clear_values();
+    server_changed();
 }
 
 
@@ -295,6 +420,7 @@ void Steam_GameServer::SetKeyValue( const char *pKey, const char *pValue )
     PRINT_DEBUG("SetKeyValue %s %s\n", pKey, pValue);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     (*server_data.mutable_values())[std::string(pKey)] = std::string(pValue);
+    server_changed();
 }
 
 
@@ -307,6 +433,7 @@ void Steam_GameServer::SetGameTags( const char *pchGameTags )
     PRINT_DEBUG("SetGameTags\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_tags(pchGameTags);
+    server_changed();
 }
 
 
@@ -321,6 +448,7 @@ void Steam_GameServer::SetGameData( const char *pchGameData )
     PRINT_DEBUG("SetGameData\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_gamedata(pchGameData);
+    server_changed();
 }
 
 
@@ -330,6 +458,7 @@ void Steam_GameServer::SetRegion( const char *pszRegion )
     PRINT_DEBUG("SetRegion\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     server_data.set_region(pszRegion);
+    server_changed();
 }
 
 
@@ -381,6 +510,7 @@ void Steam_GameServer::SendUserDisconnect( CSteamID steamIDUser )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
     ticket_manager->endAuth(steamIDUser);
+    if (players.erase(steamIDUser.ConvertToUint64())) a2s->players_changed();
 }
 
 
@@ -392,6 +522,16 @@ void Steam_GameServer::SendUserDisconnect( CSteamID steamIDUser )
 bool Steam_GameServer::BUpdateUserData( CSteamID steamIDUser, const char *pchPlayerName, uint32 uScore )
 {
     PRINT_DEBUG("BUpdateUserData %llu %s %u\n", steamIDUser.ConvertToUint64(), pchPlayerName, uScore);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    auto player = players.find(steamIDUser.ConvertToUint64());
+    if (player == players.end()) {
+        player = players.emplace(steamIDUser.ConvertToUint64(), A2S_Player()).first;
+        player->second.joined = std::chrono::high_resolution_clock::now();
+    }
+
+    player->second.name = pchPlayerName ? pchPlayerName : "";
+    player->second.score = uScore;
+    a2s->players_changed();
     return true;
 }
 
@@ -425,6 +565,7 @@ bool Steam_GameServer::BSetServerType( uint32 unServerFlags, uint32 unGameIP, ui
     version.erase(std::remove(version.begin(), version.end(), ' '), version.end());
     version.erase(std::remove(version.begin(), version.end(), '.'), version.end());
     server_data.set_version(stoi(version));
+    server_changed();
     flags = unServerFlags;
 
     //TODO?
@@ -450,6 +591,7 @@ void Steam_GameServer::UpdateServerStatus( int cPlayers, int cPlayersMax, int cB
     server_data.set_server_name(pchServerName);
     server_data.set_spectator_server_name(pSpectatorServerName);
     server_data.set_map_name(pchMapName);
+    server_changed();
 }
 
 // This can be called if spectator goes away or comes back (passing 0 means there is no spectator server now).
@@ -514,6 +656,7 @@ void Steam_GameServer::EndAuthSession( CSteamID steamID )
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
     ticket_manager->endAuth(steamID);
+    if (players.erase(steamID.ConvertToUint64())) a2s->players_changed();
 }
 
 
@@ -608,7 +751,7 @@ bool Steam_GameServer::HandleIncomingPacket( const void *pData, int cbData, uint
 {
     PRINT_DEBUG("HandleIncomingPacket %i %X %i\n", cbData, srcIP, srcPort);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    return true;
+    return a2s->handle_packet(pData, cbData, srcIP, srcPort);
 }
 
 
@@ -620,14 +763,7 @@ int Steam_GameServer::GetNextOutgoingPacket( void *pOut, int cbMaxOut, uint32 *p
 {
     PRINT_DEBUG("GetNextOutgoingPacket\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    if (outgoing_packets.size() == 0) return 0;
-
-    if (outgoing_packets.back().data.size() < cbMaxOut) cbMaxOut = outgoing_packets.back().data.size();
-    if (pOut) memcpy(pOut, outgoing_packets.back().data.data(), cbMaxOut);
-    if (pNetAdr) *pNetAdr = outgoing_packets.back().ip;
-    if (pPort) *pPort = outgoing_packets.back().port;
-    outgoing_packets.pop_back();
-    return cbMaxOut;
+    return a2s->next_packet(pOut, cbMaxOut, pNetAdr, pPort);
 }
 
 
@@ -721,15 +857,41 @@ void Steam_GameServer::RunCallbacks()
         policy_response_called = true;
     }
 
-    if (logged_in && check_timedout(last_sent_server_info, SEND_SERVER_RATE)) {
-        PRINT_DEBUG("Steam_GameServer Sending Gameserver\n");
-        Common_Message msg;
-        msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-        server_data.set_appid(settings->get_local_game_id().AppID());
-        msg.set_allocated_gameserver(new Gameserver(server_data));
-        msg.mutable_gameserver()->set_num_players(ticket_manager->countInboundAuth());
-        network->sendToAllIndividuals(&msg, true);
-        last_sent_server_info = std::chrono::high_resolution_clock::now();
+    if (logged_in) {
+        uint32 num_players = ticket_manager->countInboundAuth();
+        if (num_players != sent_num_players) {
+            sent_num_players = num_players;
+            server_data_changed = true;
+        }
+
+        if (server_data_changed) {
+            keepalive_interval = SEND_SERVER_RATE;
+            send_server_update();
+            server_data_changed = false;
+            last_sent_server_info = std::chrono::high_resolution_clock::now();
+        } else if (check_timedout(last_sent_server_info, keepalive_interval)) {
+            keepalive_interval = std::min(keepalive_interval * 2, SERVER_KEEPALIVE_MAX);
+            PRINT_DEBUG("Steam_GameServer Sending Gameserver digest, next in %f\n", keepalive_interval);
+            Common_Message msg;
+            msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+            Gameserver_Digest *digest = new Gameserver_Digest();
+            digest->set_id(server_data.id());
+            digest->set_appid(server_data.appid());
+            digest->set_state_version(state_version);
+            digest->set_keepalive_interval(keepalive_interval * 1000);
+            msg.set_allocated_gameserver_digest(digest);
+            network->sendToAllIndividuals(&msg, true);
+            last_sent_server_info = std::chrono::high_resolution_clock::now();
+        }
+
+        //peers that don't know about digests drop servers they haven't heard from in SERVER_TIMEOUT
+        if (check_timedout(last_sent_legacy_info, SEND_SERVER_RATE)) {
+            for (auto &peer : peers) {
+                if (!digest_peers.count(peer)) send_server_info(peer);
+            }
+
+            last_sent_legacy_info = std::chrono::high_resolution_clock::now();
+        }
     }
 
     if (temp_call_servers_disconnected) {
@@ -743,6 +905,36 @@ void Steam_GameServer::RunCallbacks()
             msg.set_allocated_gameserver(new Gameserver(server_data));
             msg.mutable_gameserver()->set_offline(true);
             network->sendToAllIndividuals(&msg, true);
+            //the next log on starts over with the full info
+            sent_server_data.Clear();
         }
     }
 }
+
+void Steam_GameServer::Callback(Common_Message *msg)
+{
+    if (msg->has_low_level() && msg->low_level().type() == Low_Level::CONNECT) {
+        peers.insert(msg->source_id());
+    }
+
+    if (msg->has_low_level() && msg->low_level().type() == Low_Level::DISCONNECT) {
+        peers.erase(msg->source_id());
+        digest_peers.erase(msg->source_id());
+    }
+
+    if (msg->has_gameserver_digest() && msg->gameserver_digest().digest_supported() && msg->gameserver_digest().id() == server_data.id()) {
+        digest_peers.insert(msg->source_id());
+    }
+
+    if (!logged_in) return;
+
+    if (msg->has_low_level() && msg->low_level().type() == Low_Level::CONNECT) {
+        //new peers get the full info right away instead of waiting for a digest
+        send_server_info(msg->source_id());
+    }
+
+    if (msg->has_gameserver_digest() && msg->gameserver_digest().request_full() && msg->gameserver_digest().id() == server_data.id()) {
+        PRINT_DEBUG("Steam_GameServer full info requested by %llu\n", msg->source_id());
+        send_server_info(msg->source_id());
+    }
+}
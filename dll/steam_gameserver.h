@@ -16,18 +16,12 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "a2s_responder.h"
  
 //-----------------------------------------------------------------------------
 // Purpose: Functions for authenticating users via Steam to play on a game server
 //-----------------------------------------------------------------------------
 
-struct Gameserver_Outgoing_Packet {
-	std::string data;
-
-	uint32 ip;
-	uint16 port;
-};
-
 class Steam_GameServer : 
 public ISteamGameServer004,
 public ISteamGameServer005,
@@ -57,7 +51,23 @@ public ISteamGameServer
     std::chrono::high_resolution_clock::time_point last_sent_server_info;
     Auth_Ticket_Manager *ticket_manager;
 
-    std::vector<struct Gameserver_Outgoing_Packet> outgoing_packets;
+    std::map<uint64, A2S_Player> players;
+    A2S_Responder *a2s;
+
+    bool server_data_changed = true;
+    uint32 sent_num_players = 0;
+    double keepalive_interval;
+    uint64 state_version = 0;
+    //peers that said they understand digests, the ones that didn't still get the full info at SEND_SERVER_RATE
+    std::set<uint64> peers, digest_peers;
+    std::chrono::high_resolution_clock::time_point last_sent_legacy_info;
+    //the last info that went to every peer, changes are sent as a delta against it
+    Gameserver sent_server_data;
+
+    void server_changed();
+    Gameserver *server_info();
+    void send_server_info(uint64 dest);
+    void send_server_update();
 public:
 
     Steam_GameServer(class Settings *settings, class Networking *network, class SteamCallBacks *callbacks);
@@ -352,4 +362,5 @@ public:
 
     //
     void RunCallbacks();
+    void Callback(Common_Message *msg);
 };
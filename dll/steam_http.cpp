@@ -52,7 +52,8 @@ HTTPRequestHandle Steam_HTTP::CreateHTTPRequest( EHTTPMethod eHTTPRequestMethod,
     if (url_index) {
         if (url[url.size() - 1] == '/') url += "index.html";
         std::string file_path = Local_Storage::get_game_settings_path() + "http/" + url.substr(url_index);
-        unsigned long long file_size = file_size_(file_path);
+        request.mapped = Local_Storage::map_file(file_path);
+        unsigned long long file_size = request.mapped ? 0 : file_size_(file_path);
         if (file_size) {
             request.response.resize(file_size);
             long long read = Local_Storage::get_file_data(file_path, (char *)request.response.data(), file_size, 0);
@@ -148,14 +149,14 @@ bool Steam_HTTP::SendHTTPRequest( HTTPRequestHandle hRequest, SteamAPICall_t *pC
     struct HTTPRequestCompleted_t data = {};
     data.m_hRequest = request->handle;
     data.m_ulContextValue = request->context_value;
-    if (request->response.size() == 0) {
+    if (request->response_size() == 0) {
         data.m_bRequestSuccessful = false;
         data.m_eStatusCode = k_EHTTPStatusCode404NotFound;
-        data.m_unBodySize = request->response.size();
+        data.m_unBodySize = request->response_size();
     } else {
         data.m_bRequestSuccessful = true;
         data.m_eStatusCode = k_EHTTPStatusCode200OK;
-        data.m_unBodySize = request->response.size();
+        data.m_unBodySize = request->response_size();
     }
 
     if (pCallHandle) {
@@ -234,7 +235,7 @@ bool Steam_HTTP::GetHTTPResponseBodySize( HTTPRequestHandle hRequest, uint32 *un
         return false;
     }
 
-    if (unBodySize) *unBodySize = request->response.size();
+    if (unBodySize) *unBodySize = request->response_size();
     return true;
 }
 
@@ -250,11 +251,11 @@ bool Steam_HTTP::GetHTTPResponseBodyData( HTTPRequestHandle hRequest, uint8 *pBo
         return false;
     }
 
-    if (unBufferSize < request->response.size()) {
+    if (unBufferSize < request->response_size()) {
         return false;
     }
 
-    if (pBodyDataBuffer) memcpy(pBodyDataBuffer, request->response.data(), request->response.size());
+    if (pBodyDataBuffer) memcpy(pBodyDataBuffer, request->response_data(), request->response_size());
     return true;
 }
 
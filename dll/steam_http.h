@@ -22,7 +22,12 @@ struct Steam_Http_Request {
 	HTTPRequestHandle handle;
 	uint64 context_value;
 
+	//big files are served straight from a mapping of the file, small ones are copied into response
+	std::shared_ptr<struct Mapped_File> mapped;
 	std::string response;
+
+	size_t response_size() const { return mapped ? mapped->size : response.size(); }
+	const char *response_data() const { return mapped ? mapped->data : response.data(); }
 };
 
 class Steam_HTTP :
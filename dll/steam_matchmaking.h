@@ -16,6 +16,7 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "lobby_chat_ring.h"
 
 #define SEND_LOBBY_RATE 5.0
 
@@ -23,6 +24,8 @@
 #define REQUEST_LOBBY_DATA_TIMEOUT 6.0
 #define LOBBY_DELETED_TIMEOUT 2
 
+#define FILTER_MAX_DEFAULT 4096
+
 struct Pending_Joins {
     SteamAPICall_t api_id;
     CSteamID lobby_id;
@@ -50,13 +53,18 @@ struct Filter_Values {
 	ELobbyComparison eComparisonType;
 };
 
-struct Chat_Entry {
-    std::string message;
-    EChatEntryType type;
-    CSteamID lobby_id, user_id;
+struct Near_Filter_Values {
+	std::string key;
+	int value_int;
 };
 
-#define FILTER_MAX_DEFAULT 4096
+//filters are compiled once in RequestLobbyList: keys are lowercased and numbers parsed
+struct Lobby_Filters {
+	std::vector<struct Filter_Values> values;
+	std::vector<struct Near_Filter_Values> near_values;
+	int slots_available = -1;
+	int max_results = FILTER_MAX_DEFAULT;
+};
 
 
 class Steam_Matchmaking :
@@ -80,33 +88,196 @@ public ISteamMatchmaking
     std::vector<struct Pending_Joins> pending_joins;
     std::vector<struct Pending_Creates> pending_creates;
 
-    std::vector<struct Filter_Values> filter_values;
-    int filter_max_results;
-    std::vector<struct Filter_Values> filter_values_copy;
-    int filter_max_results_copy;
+    struct Lobby_Filters filters;
+    struct Lobby_Filters search_filters;
     std::vector<CSteamID> filtered_lobbies;
+    std::set<uint64> filtered_lobby_ids;
+    //lobbies that arrived or changed since they were last checked against search_filters
+    std::set<uint64> search_pending;
     std::chrono::high_resolution_clock::time_point lobby_last_search;
     SteamAPICall_t search_call_api_id;
     bool searching;
 
-    std::vector<struct Chat_Entry> chat_entries;
+    //chat history of the lobbies we are in
+    std::map<uint64, Lobby_Chat_Ring> lobby_chats;
     std::vector<struct Data_Requested> data_requested;
 
     std::map<uint64, ::google::protobuf::Map<std::string, std::string>> self_lobby_member_data;
-google::protobuf::Map<std::string,std::string>::const_iterator caseinsensitive_find(const ::google::protobuf::Map< ::std::string, ::std::string >& map, std::string key)
-{
-    auto x = map.begin();
-    while (x != map.end()) {
-        if (key.size() == x->first.size() && std::equal(x->first.begin(), x->first.end(), key.begin(),
-                      [](char a, char b) {
-                          return tolower(a) == tolower(b);
-                      })) {
-                          break;
-                      }
-        ++x;
+
+    //lookup indexes, rebuilt lazily after lobby_generation changes (any lobby, member or key was added or removed)
+    uint64 lobby_generation = 1;
+    uint64 lobby_index_generation = 0;
+    std::unordered_map<uint32, size_t> lobby_index;
+    std::unordered_map<const Lobby *, std::unordered_map<uint64, int>> member_index;
+    std::unordered_map<const void *, std::unordered_map<std::string, std::string>> key_index;
+    std::string lookup_key;
+
+    //last state sent for the lobbies we own, deltas are computed against it
+    std::map<uint64, Lobby> lobby_sent_state;
+    uint64 lobby_bytes_sent = 0;
+    uint64 lobby_bytes_full = 0;
+    //connected peers and the ones that told us they apply deltas, the others still get full lobbies
+    std::set<uint64> lobby_peers, lobby_delta_peers;
+void lobby_store_changed()
+{
+    ++lobby_generation;
+}
+
+void check_lobby_indexes()
+{
+    if (lobby_index_generation == lobby_generation) return;
+
+    lobby_index.clear();
+    member_index.clear();
+    key_index.clear();
+    for (size_t i = 0; i < lobbies.size(); ++i) {
+        lobby_index[lobbies[i].room_id() & 0xFFFFFFFF] = i;
     }
 
-    return x;
+    lobby_index_generation = lobby_generation;
+}
+
+//keys are interned on write (setting a key that only differs in case replaces the existing one)
+//so an exact match is tried first and the case folded index is only needed when the game uses another spelling
+google::protobuf::Map<std::string,std::string>::const_iterator caseinsensitive_find(const ::google::protobuf::Map< ::std::string, ::std::string >& map, const char *key)
+{
+    lookup_key.assign(key);
+    auto x = map.find(lookup_key);
+    if (x != map.end()) return x;
+
+    check_lobby_indexes();
+    auto index = key_index.find(&map);
+    if (index == key_index.end()) {
+        index = key_index.emplace(&map, std::unordered_map<std::string, std::string>()).first;
+        for (auto & v : map) {
+            index->second[lowercase_key(v.first)] = v.first;
+        }
+    }
+
+    std::transform(lookup_key.begin(), lookup_key.end(), lookup_key.begin(), [](unsigned char c){ return std::tolower(c); });
+    auto folded = index->second.find(lookup_key);
+    if (folded == index->second.end()) return map.end();
+    return map.find(folded->second);
+}
+
+google::protobuf::Map<std::string,std::string>::const_iterator caseinsensitive_find(const ::google::protobuf::Map< ::std::string, ::std::string >& map, const std::string &key)
+{
+    return caseinsensitive_find(map, key.c_str());
+}
+
+static std::string lowercase_key(const std::string &key)
+{
+    std::string out(key);
+    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c){ return std::tolower(c); });
+    return out;
+}
+
+static bool lobby_compare(int compare, ELobbyComparison eComparisonType)
+{
+    switch (eComparisonType) {
+        case k_ELobbyComparisonEqualToOrLessThan: return compare <= 0;
+        case k_ELobbyComparisonLessThan: return compare < 0;
+        case k_ELobbyComparisonEqual: return compare == 0;
+        case k_ELobbyComparisonGreaterThan: return compare > 0;
+        case k_ELobbyComparisonEqualToOrGreaterThan: return compare >= 0;
+        case k_ELobbyComparisonNotEqual: return compare != 0;
+    }
+
+    return false;
+}
+
+static bool lobby_value_int(const std::string &value, long long *out)
+{
+    //TODO: check if this is how real steam behaves
+    if (!value.size()) {
+        *out = 0;
+        return true;
+    }
+
+    try {
+        *out = std::stoll(value, 0, 0);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+void lobby_changed(uint64 id)
+{
+    lobby_store_changed();
+    if (searching) search_pending.insert(id);
+}
+
+bool lobby_matches(Lobby &l)
+{
+    bool use = l.joinable() && (l.type() == k_ELobbyTypePublic || l.type() == k_ELobbyTypeInvisible || l.type() == k_ELobbyTypeFriendsOnly) && !l.deleted();
+    if (!use) return false;
+
+    if (search_filters.slots_available >= 0 && l.member_limit() > 0) {
+        if ((l.member_limit() - l.members_size()) < search_filters.slots_available) return false;
+    }
+
+    if (search_filters.values.empty()) return true;
+
+    for (auto & f : search_filters.values) {
+        auto value = caseinsensitive_find(l.values(), f.key);
+        if (value == l.values().end()) {
+            PRINT_DEBUG("Compare Key %s not in lobby\n", f.key.c_str());
+            //If the key is not in the lobby only a not equal filter can match
+            if (f.eComparisonType != k_ELobbyComparisonNotEqual) return false;
+            continue;
+        }
+
+        int compare;
+        if (f.is_int) {
+            long long compare_to;
+            if (!lobby_value_int(value->second, &compare_to)) return false;
+            compare = (compare_to > f.value_int) - (compare_to < f.value_int);
+        } else {
+            compare = value->second.compare(f.value_string);
+        }
+
+        if (!lobby_compare(compare, f.eComparisonType)) return false;
+    }
+
+    return true;
+}
+
+long long lobby_near_distance(Lobby *l, struct Near_Filter_Values &f)
+{
+    auto value = caseinsensitive_find(l->values(), f.key);
+    long long compare_to;
+    if (value == l->values().end() || !lobby_value_int(value->second, &compare_to)) return LLONG_MAX;
+    return std::llabs(compare_to - f.value_int);
+}
+
+void finish_lobby_search()
+{
+    if (search_filters.near_values.size()) {
+        std::stable_sort(filtered_lobbies.begin(), filtered_lobbies.end(), [this](CSteamID a, CSteamID b) {
+            Lobby *la = get_lobby(a), *lb = get_lobby(b);
+            if (!la || !lb) return !!la;
+            for (auto & f : search_filters.near_values) {
+                long long da = lobby_near_distance(la, f), db = lobby_near_distance(lb, f);
+                if (da != db) return da < db;
+            }
+
+            return false;
+        });
+    }
+
+    if (search_filters.max_results >= 0 && filtered_lobbies.size() > search_filters.max_results) {
+        filtered_lobbies.resize(search_filters.max_results);
+    }
+
+    LobbyMatchList_t data;
+    data.m_nLobbiesMatching = filtered_lobbies.size();
+    callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
+    callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+    searching = false;
+    search_call_api_id = 0;
+    search_pending.clear();
+    filtered_lobby_ids.clear();
 }
 
 Lobby *get_lobby(CSteamID id)
@@ -114,13 +285,132 @@ Lobby *get_lobby(CSteamID id)
     if (!id.IsLobby())
         return NULL;
 
-    auto lobby = std::find_if(lobbies.begin(), lobbies.end(), [&id](Lobby const& item) { return (item.room_id() & 0xFFFFFFFF) == (id.GetAccountID()); });
-    if (lobbies.end() == lobby)
+    check_lobby_indexes();
+    auto lobby = lobby_index.find(id.GetAccountID());
+    if (lobby_index.end() == lobby || lobby->second >= lobbies.size() || (lobbies[lobby->second].room_id() & 0xFFFFFFFF) != id.GetAccountID())
         return NULL;
 
-    return &(*lobby);
+    return &(lobbies[lobby->second]);
+}
+
+static bool lobby_values_equal(const ::google::protobuf::Map<std::string, std::string> &a, const ::google::protobuf::Map<std::string, std::string> &b)
+{
+    if (a.size() != b.size()) return false;
+    for (auto & v : a) {
+        auto f = b.find(v.first);
+        if (f == b.end() || f->second != v.second) return false;
+    }
+
+    return true;
 }
 
+static bool lobby_header_equal(const Lobby &a, const Lobby &b)
+{
+    return a.owner() == b.owner() && a.member_limit() == b.member_limit() && a.type() == b.type() && a.joinable() == b.joinable() &&
+           a.deleted() == b.deleted() && a.time_deleted() == b.time_deleted() && a.gameserver().id() == b.gameserver().id() &&
+           a.gameserver().ip() == b.gameserver().ip() && a.gameserver().port() == b.gameserver().port() && a.gameserver().num_update() == b.gameserver().num_update();
+}
+
+//sends only what changed in a lobby we own since it was last sent, the first send of a lobby is a full one
+void send_lobby_update(Lobby *l)
+{
+    uint64 room_id = l->room_id();
+    Common_Message msg = Common_Message();
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+
+    auto state = lobby_sent_state.find(room_id);
+    if (state == lobby_sent_state.end()) {
+        l->set_version(l->version() + 1);
+        lobby_sent_state[room_id] = *l;
+        msg.set_allocated_lobby(new Lobby(*l));
+    } else {
+        Lobby &sent = state->second;
+        Lobby_Delta *delta = new Lobby_Delta();
+
+        if (!lobby_header_equal(sent, *l)) {
+            delta->set_header_changed(true);
+            delta->set_owner(l->owner());
+            delta->set_member_limit(l->member_limit());
+            delta->set_type(l->type());
+            delta->set_joinable(l->joinable());
+            delta->set_deleted(l->deleted());
+            delta->set_time_deleted(l->time_deleted());
+            *delta->mutable_gameserver() = l->gameserver();
+        }
+
+        for (auto & v : l->values()) {
+            auto f = sent.values().find(v.first);
+            if (f == sent.values().end() || f->second != v.second) (*delta->mutable_values())[v.first] = v.second;
+        }
+
+        for (auto & v : sent.values()) {
+            if (l->values().find(v.first) == l->values().end()) delta->add_removed_values(v.first);
+        }
+
+        for (auto & m : l->members()) {
+            Lobby_Member *old = get_lobby_member(&sent, (uint64)m.id());
+            if (!old || !lobby_values_equal(old->values(), m.values())) *delta->add_members() = m;
+        }
+
+        for (auto & m : sent.members()) {
+            if (!get_lobby_member(l, (uint64)m.id())) delta->add_removed_members(m.id());
+        }
+
+        if (!delta->header_changed() && !delta->values_size() && !delta->removed_values_size() && !delta->members_size() && !delta->removed_members_size()) {
+            delete delta;
+            return;
+        }
+
+        delta->set_room_id(room_id);
+        delta->set_appid(l->appid());
+        delta->set_base_version(l->version());
+        l->set_version(l->version() + 1);
+        delta->set_version(l->version());
+        sent = *l;
+        msg.set_allocated_lobby_delta(delta);
+    }
+
+    count_lobby_bytes(msg, l->ByteSizeLong(), lobby_peers.size());
+    network->sendToAllIndividuals(&msg, true);
+}
+
+//full is what sending the whole lobby instead would have cost
+void count_lobby_bytes(Common_Message const &msg, size_t full, size_t destinations)
+{
+    lobby_bytes_sent += msg.ByteSizeLong() * destinations;
+    lobby_bytes_full += full * destinations;
+    PRINT_DEBUG("Lobby traffic total sent %llu bytes, full lobbies would have been %llu\n", lobby_bytes_sent, lobby_bytes_full);
+}
+
+void send_lobby_snapshot(Lobby *l, CSteamID dest)
+{
+    Common_Message msg = Common_Message();
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    msg.set_dest_id(dest.ConvertToUint64());
+    msg.set_allocated_lobby(new Lobby(*l));
+    count_lobby_bytes(msg, l->ByteSizeLong(), 1);
+    network->sendTo(&msg, true);
+}
+
+//tells the owner of a lobby we have version and if we need the full lobby
+void send_lobby_version(uint64 room_id, uint64 version, CSteamID owner, bool request_full)
+{
+    Common_Message msg = Common_Message();
+    msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    msg.set_dest_id(owner.ConvertToUint64());
+    Lobby_Delta *delta = new Lobby_Delta();
+    delta->set_room_id(room_id);
+    delta->set_base_version(version);
+    delta->set_version(version);
+    delta->set_deltas_supported(true);
+    delta->set_request_full(request_full);
+    msg.set_allocated_lobby_delta(delta);
+    count_lobby_bytes(msg, 0, 1);
+    network->sendTo(&msg, true);
+}
+
+//every peer gets the current version of our lobbies so the ones that missed something ask for a full lobby,
+//peers that never said they apply deltas still get the full lobby
 void send_lobby_data()
 {
     PRINT_DEBUG("Sending lobbies %zu\n", lobbies.size());
@@ -128,10 +418,22 @@ void send_lobby_data()
     for(auto & l: lobbies) {
         if (get_lobby_member(&l, settings->get_local_steam_id()) && l.owner() == settings->get_local_steam_id().ConvertToUint64() && !l.deleted()) {
             PRINT_DEBUG("Sending lobby %llu\n", l.room_id());
+            send_lobby_update(&l);
+
             Common_Message msg = Common_Message();
             msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-            msg.set_allocated_lobby(new Lobby(l));
+            Lobby_Delta *delta = new Lobby_Delta();
+            delta->set_room_id(l.room_id());
+            delta->set_base_version(l.version());
+            delta->set_version(l.version());
+            delta->set_appid(l.appid());
+            msg.set_allocated_lobby_delta(delta);
+            count_lobby_bytes(msg, l.ByteSizeLong(), lobby_peers.size());
             network->sendToAllIndividuals(&msg, true);
+
+            for (auto peer : lobby_peers) {
+                if (!lobby_delta_peers.count(peer)) send_lobby_snapshot(&l, peer);
+            }
         }
     }
 }
@@ -139,6 +441,7 @@ void send_lobby_data()
 void trigger_lobby_dataupdate(CSteamID lobby, CSteamID member, bool success, double cb_timeout=0.005, bool send_changed_lobby=true)
 {
     PRINT_DEBUG("Lobby dataupdate %llu %llu\n", lobby.ConvertToUint64(), member.ConvertToUint64());
+    lobby_changed(lobby.ConvertToUint64());
     LobbyDataUpdate_t data;
     memset(&data, 0, sizeof(data));
 
@@ -156,11 +459,10 @@ void trigger_lobby_dataupdate(CSteamID lobby, CSteamID member, bool success, dou
     Lobby *l = get_lobby(lobby);
     if (l && l->owner() == settings->get_local_steam_id().ConvertToUint64()) {
         if (send_changed_lobby) {
-            Common_Message msg = Common_Message();
-            msg.set_source_id(settings->get_local_steam_id().ConvertToUint64());
-            msg.set_allocated_lobby(new Lobby(*l));
-            network->sendToAllIndividuals(&msg, true);
+            send_lobby_update(l);
         }
+    } else {
+        lobby_sent_state.erase(lobby.ConvertToUint64());
     }
 }
 
@@ -266,7 +568,10 @@ void remove_lobbies()
         if (g->members().size() == 0 || (g->deleted() && (g->time_deleted() + LOBBY_DELETED_TIMEOUT < current_time))) {
             PRINT_DEBUG("REMOVING LOBBY %llu\n", g->room_id());
             self_lobby_member_data.erase(g->room_id());
+            lobby_sent_state.erase(g->room_id());
+            lobby_chats.erase(g->room_id());
             g = lobbies.erase(g);
+            lobby_store_changed();
         } else {
             ++g;
         }
@@ -314,7 +619,6 @@ Steam_Matchmaking(class Settings *settings, class Networking *network, class Ste
 
     this->callback_results = callback_results;
     this->callbacks = callbacks;
-    this->filter_max_results = FILTER_MAX_DEFAULT;
     search_call_api_id = 0;
     searching = false;
 }
@@ -325,10 +629,28 @@ Steam_Matchmaking(class Settings *settings, class Networking *network, class Ste
     this->run_every_runcb->remove(&Steam_Matchmaking::steam_matchmaking_run_every_runcb, this);
 }
 
-static Lobby_Member *get_lobby_member(Lobby *lobby, CSteamID user_id)
+Lobby_Member *get_lobby_member(Lobby *lobby, CSteamID user_id)
 {
     if (!lobby) return NULL;
 
+    //lobbies in our list are indexed, other ones (messages, sent state) are searched
+    if (!lobbies.empty() && lobby >= &lobbies.front() && lobby <= &lobbies.back()) {
+        check_lobby_indexes();
+        auto index = member_index.find(lobby);
+        if (index == member_index.end()) {
+            index = member_index.emplace(lobby, std::unordered_map<uint64, int>()).first;
+            for (int i = 0; i < lobby->members_size(); ++i) {
+                index->second[lobby->members(i).id()] = i;
+            }
+        }
+
+        auto member = index->second.find(user_id.ConvertToUint64());
+        if (member != index->second.end() && member->second < lobby->members_size() && lobby->members(member->second).id() == user_id.ConvertToUint64())
+            return lobby->mutable_members(member->second);
+        if (member == index->second.end())
+            return NULL;
+    }
+
     auto member = std::find_if(lobby->mutable_members()->begin(), lobby->mutable_members()->end(), [&user_id](Lobby_Member const& item) { return item.id() == user_id.ConvertToUint64(); });
     if (lobby->mutable_members()->end() == member)
         return NULL;
@@ -411,18 +733,18 @@ SteamAPICall_t RequestLobbyList()
     PRINT_DEBUG("RequestLobbyList\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     filtered_lobbies.clear();
+    filtered_lobby_ids.clear();
     lobby_last_search = std::chrono::high_resolution_clock::now();
-    filter_values_copy = filter_values;
-    filter_max_results_copy = filter_max_results;
-    filter_values.clear();
-    filter_max_results = FILTER_MAX_DEFAULT;
+    search_filters = filters;
+    for (auto & f : search_filters.values) f.key = lowercase_key(f.key);
+    filters = Lobby_Filters();
     searching = true;
     if (search_call_api_id) callback_results->rmCallBack(search_call_api_id, NULL);
     search_call_api_id = callback_results->reserveCallResult();
 
-
-
-    
+    //every known lobby is checked once, after that only the ones that arrive or change
+    search_pending.clear();
+    for (auto & l : lobbies) search_pending.insert(l.room_id());
     return search_call_api_id;
 }
 
@@ -445,7 +767,7 @@ void AddRequestLobbyListStringFilter( const char *pchKeyToMatch, const char *pch
     fv.value_string = std::string(pchValueToMatch);
     fv.is_int = false;
     fv.eComparisonType = eComparisonType;
-    filter_values.push_back(fv);
+    filters.values.push_back(fv);
 
 }
 
@@ -459,7 +781,7 @@ void AddRequestLobbyListNumericalFilter( const char *pchKeyToMatch, int nValueTo
     fv.value_int = nValueToMatch;
     fv.is_int = true;
     fv.eComparisonType = eComparisonType;
-    filter_values.push_back(fv);
+    filters.values.push_back(fv);
 
 }
 
@@ -467,9 +789,13 @@ void AddRequestLobbyListNumericalFilter( const char *pchKeyToMatch, int nValueTo
 void AddRequestLobbyListNearValueFilter( const char *pchKeyToMatch, int nValueToBeCloseTo )
 {
     PRINT_DEBUG("AddRequestLobbyListNearValueFilter %s %u\n", pchKeyToMatch, nValueToBeCloseTo);
-    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    if (!pchKeyToMatch) return;
 
-    
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    struct Near_Filter_Values nf;
+    nf.key = std::string(pchKeyToMatch);
+    nf.value_int = nValueToBeCloseTo;
+    filters.near_values.push_back(nf);
 }
 
 // returns only lobbies with the specified number of slots available
@@ -477,17 +803,14 @@ void AddRequestLobbyListFilterSlotsAvailable( int nSlotsAvailable )
 {
     PRINT_DEBUG("AddRequestLobbyListFilterSlotsAvailable %i\n", nSlotsAvailable);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    
+    filters.slots_available = nSlotsAvailable;
 }
 
 // sets the distance for which we should search for lobbies (based on users IP address to location map on the Steam backed)
 void AddRequestLobbyListDistanceFilter( ELobbyDistanceFilter eLobbyDistanceFilter )
 {
     PRINT_DEBUG("AddRequestLobbyListDistanceFilter %i\n", eLobbyDistanceFilter);
-    std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    
+    //every lobby we can see is on the local network so they all pass any distance filter
 }
 
 // sets how many results to return, the lower the count the faster it is to download the lobby results & details to the client
@@ -495,8 +818,7 @@ void AddRequestLobbyListResultCountFilter( int cMaxResults )
 {
     PRINT_DEBUG("AddRequestLobbyListResultCountFilter %i\n", cMaxResults);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    filter_max_results = cMaxResults;
-    
+    filters.max_results = cMaxResults;
 }
 
 
@@ -520,7 +842,7 @@ void AddRequestLobbyListNumericalFilter( const char *pchKeyToMatch, int nValueTo
 
 void AddRequestLobbyListSlotsAvailableFilter()
 {
-    
+    AddRequestLobbyListFilterSlotsAvailable(1);
 }
 
 // returns the CSteamID of a lobby, as retrieved by a RequestLobbyList call
@@ -537,20 +859,22 @@ CSteamID GetLobbyByIndex( int iLobby )
     return id;
 }
 
-static bool enter_lobby(Lobby *lobby, CSteamID id)
+bool enter_lobby(Lobby *lobby, CSteamID id)
 {
     if (get_lobby_member(lobby, id)) return false;
 
+    lobby_store_changed();
     Lobby_Member *member = lobby->add_members();
     member->set_id(id.ConvertToUint64());
     return true;
 }
 
-static bool leave_lobby(Lobby *lobby, CSteamID id)
+bool leave_lobby(Lobby *lobby, CSteamID id)
 {
     auto member = std::find_if(lobby->mutable_members()->begin(), lobby->mutable_members()->end(), [&id](Lobby_Member const& item) { return item.id() == id.ConvertToUint64(); });
     if (member != lobby->mutable_members()->end()) {
         lobby->mutable_members()->erase(member);
+        lobby_store_changed();
         return true;
     }
 
@@ -575,6 +899,8 @@ void Create_pending_lobbies()
             lobby.set_appid(settings->get_local_game_id().AppID());
             enter_lobby(&lobby, settings->get_local_steam_id());
             lobbies.push_back(lobby);
+            lobby_store_changed();
+            lobby_changed(lobby.room_id());
 
             if (settings->disable_lobby_creation) {
                 LobbyCreated_t data;
@@ -690,6 +1016,8 @@ void LeaveLobby( CSteamID steamIDLobby )
         if (!lobby->deleted()) {
             on_self_enter_leave_lobby((uint64)lobby->room_id(), lobby->type(), true);
             self_lobby_member_data.erase(lobby->room_id());
+            lobby_chats.erase(lobby->room_id());
+            lobby_store_changed();
             if (lobby->owner() != settings->get_local_steam_id().ConvertToUint64()) {
                 PRINT_DEBUG("LeaveLobby not owner\n");
                 leave_lobby(&(*lobby), settings->get_local_steam_id());
@@ -709,6 +1037,7 @@ void LeaveLobby( CSteamID steamIDLobby )
                     send_clients_packet(steamIDLobby, message);
                     lobby->set_deleted(true);
                     lobby->set_time_deleted(std::chrono::duration_cast<std::chrono::duration<uint64>>(std::chrono::system_clock::now().time_since_epoch()).count());
+                    lobby_changed(lobby->room_id());
                 }
             }
         }
@@ -882,7 +1211,12 @@ bool DeleteLobbyData( CSteamID steamIDLobby, const char *pchKey )
         return false;
     }
 
-    lobby->mutable_values()->erase(pchKey);
+    auto result = caseinsensitive_find(lobby->values(), pchKey);
+    if (result != lobby->values().end()) {
+        std::string key = result->first;
+        lobby->mutable_values()->erase(key);
+    }
+
     trigger_lobby_dataupdate(steamIDLobby, steamIDLobby, true);
     
     return true;
@@ -947,6 +1281,7 @@ void SetLobbyMemberData( CSteamID steamIDLobby, const char *pchKey, const char *
         }
 
         {
+            lobby_store_changed();
             auto result = self_lobby_member_data.find(steamIDLobby.ConvertToUint64());
             if (result != self_lobby_member_data.end()) {
                 auto value = caseinsensitive_find(result->second, std::string(pchKey));
@@ -990,14 +1325,17 @@ int GetLobbyChatEntry( CSteamID steamIDLobby, int iChatID, STEAM_OUT_STRUCT() CS
 {
     PRINT_DEBUG("GetLobbyChatEntry %llu %i %p %p %i %p\n", steamIDLobby.ConvertToUint64(), iChatID, pSteamIDUser, pvData, cubData, peChatEntryType);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    if (iChatID >= chat_entries.size() || iChatID < 0 || cubData < 0) return 0;
-    if (chat_entries[iChatID].lobby_id != steamIDLobby) return 0;
-    if (pSteamIDUser) *pSteamIDUser = chat_entries[iChatID].user_id;
-    if (peChatEntryType) *peChatEntryType = chat_entries[iChatID].type;
+    if (cubData < 0) return 0;
+    auto chat = lobby_chats.find(steamIDLobby.ConvertToUint64());
+    if (chat == lobby_chats.end()) return 0;
+    const struct Lobby_Chat_Ring::Entry *entry = chat->second.get(iChatID);
+    if (!entry) return 0;
+    if (pSteamIDUser) *pSteamIDUser = entry->user_id;
+    if (peChatEntryType) *peChatEntryType = entry->type;
     if (pvData) {
-        if (chat_entries[iChatID].message.size() <= cubData) {
-            cubData = chat_entries[iChatID].message.size();
-            memcpy(pvData, chat_entries[iChatID].message.data(), cubData);
+        if (entry->message.size() <= cubData) {
+            cubData = entry->message.size();
+            memcpy(pvData, entry->message.data(), cubData);
             PRINT_DEBUG("Returned chat of len: %i\n", cubData);
             return cubData;
         }
@@ -1230,81 +1568,29 @@ void RunCallbacks()
 {
     RunBackground();
 
-    if (searching) {
-        PRINT_DEBUG("Searching for lobbies %zu\n", lobbies.size());
-        for(auto & l: lobbies) {
-            bool use = l.joinable() && (l.type() == k_ELobbyTypePublic || l.type() == k_ELobbyTypeInvisible || l.type() == k_ELobbyTypeFriendsOnly) && !l.deleted();
-            PRINT_DEBUG("use lobby: %u, filters: %zu, joinable: %u, type: %u, deleted: %u\n", use, filter_values_copy.size(), l.joinable(), l.type(), l.deleted());
-            for (auto & f : filter_values_copy) {
-                PRINT_DEBUG("%s:%s/%i %u %i\n", f.key.c_str(), f.value_string.c_str(), f.value_int, f.is_int, f.eComparisonType);
-                auto value = caseinsensitive_find(l.values(), f.key);
-                if (value != l.values().end()) {
-                    //TODO: eComparisonType
-                    if (!f.is_int) {
-                        PRINT_DEBUG("Compare Values %s %s\n", value->second.c_str(), f.value_string.c_str());
-                        if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                            if (value->second == f.value_string) {
-                                PRINT_DEBUG("Equal\n");
-                                //use = use;
-                            } else {
-                                PRINT_DEBUG("Not Equal\n");
-                                use = false;
-                            }
-                        }
-                    } else {
-                        try {
-                            PRINT_DEBUG("%s\n", value->second.c_str());
-                            int compare_to = 0;
-                            //TODO: check if this is how real steam behaves
-                            if (value->second.size()) {
-                                compare_to = std::stoll(value->second, 0, 0);
-                            }
-                            PRINT_DEBUG("Compare Values %i %i\n", compare_to, f.value_int);
-                            if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                                if (compare_to == f.value_int) {
-                                    PRINT_DEBUG("Equal\n");
-                                    //use = use;
-                                } else {
-                                    PRINT_DEBUG("Not Equal\n");
-                                    use = false;
-                                }
-                            }
-                        } catch (...) {
-                            //Same case as if the key is not in the lobby?
-                            use = false;
-                        }
-                        //TODO: add more comparisons
-                    }
-                } else {
-                    PRINT_DEBUG("Compare Key not in lobby\n");
-                    if (f.eComparisonType == k_ELobbyComparisonEqual) {
-                        //If the key is not in the lobby do we take it into account?
-                        use = false;
-                    }
-                }
+    if (searching && search_pending.size()) {
+        PRINT_DEBUG("Searching for lobbies %zu changed %zu\n", lobbies.size(), search_pending.size());
+        for (auto id : search_pending) {
+            Lobby *l = get_lobby((uint64)id);
+            bool use = l && lobby_matches(*l);
+            PRINT_DEBUG("Lobby %llu use %u\n", id, use);
+            if (use) {
+                if (filtered_lobby_ids.insert(id).second) filtered_lobbies.push_back((uint64)id);
+            } else if (filtered_lobby_ids.erase(id)) {
+                filtered_lobbies.erase(std::remove(filtered_lobbies.begin(), filtered_lobbies.end(), CSteamID((uint64)id)), filtered_lobbies.end());
             }
+        }
 
-            PRINT_DEBUG("Lobby %llu use %u\n", l.room_id(), use);
-            if (use) PUSH_BACK_IF_NOT_IN(filtered_lobbies, (uint64)l.room_id());
-            if (filtered_lobbies.size() >= filter_max_results_copy) {
-                searching = false;
-                LobbyMatchList_t data;
-                data.m_nLobbiesMatching = filtered_lobbies.size();
-                callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
-                callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-                search_call_api_id = 0;
-            }
+        search_pending.clear();
+        //near value filters need every candidate before picking the closest ones
+        if (search_filters.near_values.empty() && filtered_lobbies.size() >= search_filters.max_results) {
+            finish_lobby_search();
         }
     }
 
     if (searching && check_timedout(lobby_last_search, LOBBY_SEARCH_TIMEOUT)) {
         PRINT_DEBUG("LOBBY_SEARCH_TIMEOUT %zu\n", filtered_lobbies.size());
-        LobbyMatchList_t data;
-        data.m_nLobbiesMatching = filtered_lobbies.size();
-        callback_results->addCallResult(search_call_api_id, data.k_iCallback, &data, sizeof(data));
-        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-        searching = false;
-        search_call_api_id = 0;
+        finish_lobby_search();
     }
 
     auto g = std::begin(pending_joins);
@@ -1376,6 +1662,95 @@ void RunCallbacks()
 
 
 
+//called when the lobby owner added us to the lobby
+bool complete_pending_joins(Lobby *lobby)
+{
+    bool joined = false;
+    CSteamID id((uint64)lobby->room_id());
+    auto pd = pending_joins.begin();
+    while (pd != pending_joins.end()) {
+        if (pd->lobby_id == id) {
+            bool success = true;
+            LobbyEnter_t data;
+            data.m_ulSteamIDLobby = lobby->room_id();
+            data.m_rgfChatPermissions = 0; //Unused - Always 0
+            data.m_bLocked = false;
+            data.m_EChatRoomEnterResponse = success ? k_EChatRoomEnterResponseSuccess : k_EChatRoomEnterResponseError;
+            callback_results->addCallResult(pd->api_id, data.k_iCallback, &data, sizeof(data));
+            callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
+            pd = pending_joins.erase(pd);
+            joined = true;
+        } else {
+            ++pd;
+        }
+    }
+
+    if (joined) {
+        on_self_enter_leave_lobby((uint64)lobby->room_id(), lobby->type(), false);
+        trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+    }
+
+    return joined;
+}
+
+void apply_lobby_delta(Lobby *lobby, const Lobby_Delta &delta)
+{
+    PRINT_DEBUG("Lobby delta %llu version %llu values %i removed %i members %i removed %i\n", delta.room_id(), delta.version(), delta.values_size(), delta.removed_values_size(), delta.members_size(), delta.removed_members_size());
+    bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
+    if (we_are_in_lobby) trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+
+    bool gameserver_changed = false;
+    if (delta.header_changed()) {
+        gameserver_changed = we_are_in_lobby && (lobby->gameserver().num_update() != delta.gameserver().num_update());
+        lobby->set_owner(delta.owner());
+        lobby->set_member_limit(delta.member_limit());
+        lobby->set_type(delta.type());
+        lobby->set_joinable(delta.joinable());
+        lobby->set_deleted(delta.deleted());
+        lobby->set_time_deleted(delta.time_deleted());
+        *lobby->mutable_gameserver() = delta.gameserver();
+    }
+
+    for (auto & v : delta.values()) {
+        (*lobby->mutable_values())[v.first] = v.second;
+    }
+
+    for (auto & k : delta.removed_values()) {
+        lobby->mutable_values()->erase(k);
+    }
+
+    for (auto id : delta.removed_members()) {
+        if (leave_lobby(lobby, (uint64)id) && we_are_in_lobby) {
+            trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)id, true, true, 0.2);
+        }
+    }
+
+    bool joined = false;
+    for (auto & m : delta.members()) {
+        Lobby_Member *member = get_lobby_member(lobby, (uint64)m.id());
+        if (member) {
+            *member = m;
+            if (we_are_in_lobby) trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)m.id(), true);
+        } else {
+            *lobby->add_members() = m;
+            lobby_store_changed();
+            if (m.id() == settings->get_local_steam_id().ConvertToUint64()) {
+                joined = complete_pending_joins(lobby);
+            } else {
+                if (we_are_in_lobby) trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
+            }
+        }
+    }
+
+    if ((joined && lobby->gameserver().num_update()) || gameserver_changed) {
+        send_gameservercreated_cb(lobby->room_id(), lobby->gameserver().id(), lobby->gameserver().ip(), lobby->gameserver().port());
+        trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
+    }
+
+    lobby->set_version(delta.version());
+    lobby_changed(lobby->room_id());
+}
+
 void Callback(Common_Message *msg)
 {
     if (msg->has_lobby()) {
@@ -1386,10 +1761,16 @@ void Callback(Common_Message *msg)
                 size_t old_size = lobbies.size();
                 lobbies.resize(old_size + 1);
                 lobbies[old_size].set_room_id(msg->lobby().room_id());
+                lobby_store_changed();
                 lobby = &(lobbies[old_size]);
             }
 
-            if (!lobby->deleted()) {
+            //same version from the owner means we already have every change in it
+            bool up_to_date = msg->lobby().version() && lobby->version() == msg->lobby().version();
+            if (msg->source_id() == msg->lobby().owner() && msg->lobby().version()) {
+                send_lobby_version(msg->lobby().room_id(), msg->lobby().version(), (uint64)msg->lobby().owner(), false);
+            }
+            if (!lobby->deleted() && !up_to_date) {
                 if (!protobuf_message_equal(*lobby, msg->lobby())) {
                     bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
                     if (we_are_in_lobby) trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
@@ -1412,28 +1793,7 @@ void Callback(Common_Message *msg)
                         Lobby_Member *member = get_lobby_member(lobby, (uint64)m.id());
                         if (!member) {
                             if (m.id() == settings->get_local_steam_id().ConvertToUint64()) {
-                                CSteamID id((uint64)lobby->room_id());
-                                auto pd = pending_joins.begin();
-                                while (pd != pending_joins.end()) {
-                                    if (pd->lobby_id == id) {
-                                        bool success = true;
-                                        LobbyEnter_t data;
-                                        data.m_ulSteamIDLobby = lobby->room_id();
-                                        data.m_rgfChatPermissions = 0; //Unused - Always 0
-                                        data.m_bLocked = false;
-                                        data.m_EChatRoomEnterResponse = success ? k_EChatRoomEnterResponseSuccess : k_EChatRoomEnterResponseError;
-                                        callback_results->addCallResult(pd->api_id, data.k_iCallback, &data, sizeof(data));
-                                        callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
-                                        pd = pending_joins.erase(pd);
-                                        joined = true;
-                                    } else {
-                                        ++pd;
-                                    }
-                                }
-                                if (joined) {
-                                    on_self_enter_leave_lobby((uint64)lobby->room_id(), lobby->type(), false);
-                                    trigger_lobby_dataupdate((uint64)lobby->room_id(), (uint64)lobby->room_id(), true);
-                                }
+                                joined = complete_pending_joins(lobby);
                             } else {
                                 if (we_are_in_lobby) trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)m.id(), false, true);
                             }
@@ -1459,8 +1819,36 @@ void Callback(Common_Message *msg)
                     }
 
                     *lobby = msg->lobby();
+                    lobby_changed(lobby->room_id());
+                }
+            }
+        }
+    }
+
+    if (msg->has_lobby_delta()) {
+        const Lobby_Delta &delta = msg->lobby_delta();
+        Lobby *lobby = get_lobby((uint64)delta.room_id());
+        if (delta.deltas_supported()) {
+            if (lobby && !lobby->deleted() && lobby->owner() == settings->get_local_steam_id().ConvertToUint64()) {
+                lobby_delta_peers.insert(msg->source_id());
+                if (delta.request_full()) {
+                    PRINT_DEBUG("Lobby %llu full requested by %llu who has version %llu\n", lobby->room_id(), msg->source_id(), delta.version());
+                    send_lobby_snapshot(lobby, (uint64)msg->source_id());
                 }
             }
+        } else if (!lobby) {
+            //version announcement of a lobby we don't know yet
+            if (delta.appid() == settings->get_local_game_id().AppID()) {
+                send_lobby_version(delta.room_id(), 0, (uint64)msg->source_id(), true);
+            }
+        } else if (!lobby->deleted() && lobby->owner() != settings->get_local_steam_id().ConvertToUint64()) {
+            if (lobby->version() == delta.base_version()) {
+                //base and version are equal when the owner is only announcing its version
+                if (delta.version() != delta.base_version()) apply_lobby_delta(lobby, delta);
+            } else {
+                PRINT_DEBUG("Lobby delta %llu for version %llu but we have %llu, requesting the full lobby\n", lobby->room_id(), delta.base_version(), lobby->version());
+                send_lobby_version(lobby->room_id(), lobby->version(), (uint64)msg->source_id(), true);
+            }
         }
     }
 
@@ -1469,12 +1857,15 @@ void Callback(Common_Message *msg)
         PRINT_DEBUG("LOBBY MESSAGE %u %llu\n", msg->lobby_messages().type(), msg->lobby_messages().id());
         Lobby *lobby = get_lobby((uint64)msg->lobby_messages().id());
         if (lobby && !lobby->deleted()) {
+            lobby_changed(lobby->room_id());
             bool we_are_in_lobby = !!get_lobby_member(lobby, settings->get_local_steam_id());
             if (lobby->owner() == settings->get_local_steam_id().ConvertToUint64()) {
                 if (msg->lobby_messages().type() == Lobby_Messages::JOIN) {
                     PRINT_DEBUG("LOBBY MESSAGE: JOIN\n");
                     if (enter_lobby(lobby, (uint64)msg->source_id())) {
                         trigger_lobby_member_join_leave((uint64)lobby->room_id(), (uint64)msg->source_id(), false, true, 0.01);
+                        //the joiner may have missed deltas while it was only looking at the lobby
+                        send_lobby_snapshot(lobby, (uint64)msg->source_id());
                     }
                 }
 
@@ -1512,17 +1903,13 @@ void Callback(Common_Message *msg)
             if (msg->lobby_messages().type() == Lobby_Messages::CHAT_MESSAGE) {
                 PRINT_DEBUG("LOBBY MESSAGE: CHAT MESSAGE\n");
                 if (we_are_in_lobby) {
-                    struct Chat_Entry entry;
-                    entry.type = k_EChatEntryTypeChatMsg;
-                    entry.message = msg->lobby_messages().bdata();
-                    entry.lobby_id = CSteamID((uint64)msg->lobby_messages().id());
-                    entry.user_id = CSteamID((uint64)msg->source_id());
+                    auto chat = lobby_chats.find(msg->lobby_messages().id());
+                    if (chat == lobby_chats.end()) chat = lobby_chats.insert(std::make_pair((uint64)msg->lobby_messages().id(), Lobby_Chat_Ring(settings->lobby_chat_history))).first;
                     LobbyChatMsg_t data;
                     data.m_ulSteamIDLobby = msg->lobby_messages().id();
                     data.m_ulSteamIDUser = msg->source_id();
-                    data.m_eChatEntryType = entry.type;
-                    data.m_iChatID = chat_entries.size();
-                    chat_entries.push_back(entry);
+                    data.m_eChatEntryType = k_EChatEntryTypeChatMsg;
+                    data.m_iChatID = chat->second.add(CSteamID((uint64)msg->source_id()), k_EChatEntryTypeChatMsg, msg->lobby_messages().bdata());
                     callbacks->addCBResult(data.k_iCallback, &data, sizeof(data));
                 }
             }
@@ -1531,10 +1918,12 @@ void Callback(Common_Message *msg)
 
     if (msg->has_low_level()) {
         if (msg->low_level().type() == Low_Level::CONNECT) {
-            
+            lobby_peers.insert(msg->source_id());
         }
 
         if (msg->low_level().type() == Low_Level::DISCONNECT) {
+            lobby_peers.erase(msg->source_id());
+            lobby_delta_peers.erase(msg->source_id());
             for (auto & l: lobbies) {
                 if (leave_lobby(&(l), (uint64)msg->source_id()))
                     trigger_lobby_member_join_leave((uint64)l.room_id(), (uint64)msg->source_id(), true, true, 0.0);
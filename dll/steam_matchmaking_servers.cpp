@@ -35,19 +35,55 @@ Steam_Matchmaking_Servers::Steam_Matchmaking_Servers(class Settings *settings, c
 
 static int server_list_request;
 
-// Request a new list of servers of a particular type.  These calls each correspond to one of the EMatchMakingType values.
-// Each call allocates a new asynchronous request object.
-// Request object must be released by calling ReleaseRequest( hServerListRequest )
-HServerListRequest Steam_Matchmaking_Servers::RequestInternetServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
+static std::string lowercase_string(const std::string &str)
 {
-    PRINT_DEBUG("RequestInternetServerList\n");
-    //TODO
-    return RequestLANServerList(iApp, pRequestServersResponse);
+    std::string out(str);
+    std::transform(out.begin(), out.end(), out.begin(), [](unsigned char c){ return std::tolower(c); });
+    return out;
 }
 
-HServerListRequest Steam_Matchmaking_Servers::RequestLANServerList( AppId_t iApp, ISteamMatchmakingServerListResponse *pRequestServersResponse )
+static bool is_boolean_filter(const std::string &key)
+{
+    return key == "and" || key == "or" || key == "nand" || key == "nor";
+}
+
+static uint32 boolean_filter_size(const struct Steam_Matchmaking_Servers_Filter &filter)
+{
+    return strtoul(filter.value.c_str(), NULL, 10);
+}
+
+void Steam_Matchmaking_Servers::start_request(struct Steam_Matchmaking_Request *request, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters)
+{
+    //the filters are a pointer to an array of key values, not an array of pointers
+    if (ppchFilters && *ppchFilters) {
+        for (uint32 i = 0; i < nFilters; ++i) {
+            struct Steam_Matchmaking_Servers_Filter filter;
+            filter.key = lowercase_string((*ppchFilters)[i].m_szKey);
+            filter.value = (*ppchFilters)[i].m_szValue;
+            PRINT_DEBUG("server filter %s %s\n", filter.key.c_str(), filter.value.c_str());
+            request->filters.push_back(filter);
+        }
+    }
+
+    //a top level map filter narrows the candidates to the servers on that map
+    std::set<uint64> *candidates = NULL;
+    for (size_t i = 0; i < request->filters.size(); ++i) {
+        if (request->filters[i].key == "map") {
+            candidates = &gameservers_by_map[lowercase_string(request->filters[i].value)];
+            break;
+        }
+
+        if (is_boolean_filter(request->filters[i].key)) i += boolean_filter_size(request->filters[i]);
+    }
+
+    if (!candidates) candidates = &gameservers_by_appid[request->appid];
+    for (auto id : *candidates) {
+        request->pending.push_back(id);
+    }
+}
+
+HServerListRequest Steam_Matchmaking_Servers::request_server_list(AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse)
 {
-    PRINT_DEBUG("RequestLANServerList %u\n", iApp);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     struct Steam_Matchmaking_Request request;
     request.appid = iApp;
@@ -55,43 +91,60 @@ HServerListRequest Steam_Matchmaking_Servers::RequestLANServerList( AppId_t iApp
     request.old_callbacks = NULL;
     request.cancelled = false;
     request.completed = false;
-    requests.push_back(request);
+    request.released = false;
     ++server_list_request;
-    requests[requests.size() - 1].id = (void *)server_list_request;
-    HServerListRequest id = requests[requests.size() - 1].id;
-    PRINT_DEBUG("request id: %p\n", id);
-    return id;
+    request.id = (void *)server_list_request;
+    start_request(&request, ppchFilters, nFilters);
+    requests.push_back(request);
+    PRINT_DEBUG("request id: %p\n", request.id);
+    return request.id;
+}
+
+// Request a new list of servers of a particular type.  These calls each correspond to one of the EMatchMakingType values.
+// Each call allocates a new asynchronous request object.
+// Request object must be released by calling ReleaseRequest( hServerListRequest )
+HServerListRequest Steam_Matchmaking_Servers::RequestInternetServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
+{
+    PRINT_DEBUG("RequestInternetServerList\n");
+    //TODO
+    return request_server_list(iApp, ppchFilters, nFilters, pRequestServersResponse);
+}
+
+HServerListRequest Steam_Matchmaking_Servers::RequestLANServerList( AppId_t iApp, ISteamMatchmakingServerListResponse *pRequestServersResponse )
+{
+    PRINT_DEBUG("RequestLANServerList %u\n", iApp);
+    return request_server_list(iApp, NULL, 0, pRequestServersResponse);
 }
 
 HServerListRequest Steam_Matchmaking_Servers::RequestFriendsServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
 {
     PRINT_DEBUG("RequestFriendsServerList\n");
     //TODO
-    return RequestLANServerList(iApp, pRequestServersResponse);
+    return request_server_list(iApp, ppchFilters, nFilters, pRequestServersResponse);
 }
 
 HServerListRequest Steam_Matchmaking_Servers::RequestFavoritesServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
 {
     PRINT_DEBUG("RequestFavoritesServerList\n");
     //TODO
-    return RequestLANServerList(iApp, pRequestServersResponse);
+    return request_server_list(iApp, ppchFilters, nFilters, pRequestServersResponse);
 }
 
 HServerListRequest Steam_Matchmaking_Servers::RequestHistoryServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
 {
     PRINT_DEBUG("RequestHistoryServerList\n");
     //TODO
-    return RequestLANServerList(iApp, pRequestServersResponse);
+    return request_server_list(iApp, ppchFilters, nFilters, pRequestServersResponse);
 }
 
 HServerListRequest Steam_Matchmaking_Servers::RequestSpectatorServerList( AppId_t iApp, STEAM_ARRAY_COUNT(nFilters) MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse )
 {
     PRINT_DEBUG("RequestSpectatorServerList\n");
     //TODO
-    return RequestLANServerList(iApp, pRequestServersResponse);
+    return request_server_list(iApp, ppchFilters, nFilters, pRequestServersResponse);
 }
 
-void Steam_Matchmaking_Servers::RequestOldServerList(AppId_t iApp, ISteamMatchmakingServerListResponse001 *pRequestServersResponse, EMatchMakingType type)
+void Steam_Matchmaking_Servers::RequestOldServerList(AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse, EMatchMakingType type)
 {
     PRINT_DEBUG("RequestOldServerList %u\n", iApp);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
@@ -110,50 +163,52 @@ void Steam_Matchmaking_Servers::RequestOldServerList(AppId_t iApp, ISteamMatchma
     request.old_callbacks = pRequestServersResponse;
     request.cancelled = false;
     request.completed = false;
+    request.released = false;
+    request.id = (void *)type;
+    start_request(&request, ppchFilters, nFilters);
     requests.push_back(request);
-    requests[requests.size() - 1].id = (void *)type;
 }
 
 void Steam_Matchmaking_Servers::RequestInternetServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eInternetServer);
+    RequestOldServerList(iApp, ppchFilters, nFilters, pRequestServersResponse, eInternetServer);
 }
 
 void Steam_Matchmaking_Servers::RequestLANServerList( AppId_t iApp, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eLANServer);
+    RequestOldServerList(iApp, NULL, 0, pRequestServersResponse, eLANServer);
 }
 
 void Steam_Matchmaking_Servers::RequestFriendsServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eFriendsServer);
+    RequestOldServerList(iApp, ppchFilters, nFilters, pRequestServersResponse, eFriendsServer);
 }
 
 void Steam_Matchmaking_Servers::RequestFavoritesServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eFavoritesServer);
+    RequestOldServerList(iApp, ppchFilters, nFilters, pRequestServersResponse, eFavoritesServer);
 }
 
 void Steam_Matchmaking_Servers::RequestHistoryServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eHistoryServer);
+    RequestOldServerList(iApp, ppchFilters, nFilters, pRequestServersResponse, eHistoryServer);
 }
 
 void Steam_Matchmaking_Servers::RequestSpectatorServerList( AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse )
 {
     PRINT_DEBUG("%s old\n", __FUNCTION__);
     //TODO
-    RequestOldServerList(iApp, pRequestServersResponse, eSpectatorServer);
+    RequestOldServerList(iApp, ppchFilters, nFilters, pRequestServersResponse, eSpectatorServer);
 }
 
 
@@ -291,28 +346,14 @@ gameserveritem_t *Steam_Matchmaking_Servers::GetServerDetails( HServerListReques
     PRINT_DEBUG("GetServerDetails %p %i\n", hRequest, iServer);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
 
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers_filtered;
-    auto g = std::begin(requests);
-    while (g != std::end(requests)) {
-        PRINT_DEBUG("equal? %p %p\n", hRequest, g->id);
-        if (g->id == hRequest) {
-            gameservers_filtered = g->gameservers_filtered;
-            PRINT_DEBUG("found %u\n", gameservers_filtered.size());
-            break;
-        }
-
-        ++g;
-    }
-
-    if (iServer >= gameservers_filtered.size() || iServer < 0) {
+    auto g = std::find_if(requests.begin(), requests.end(), [&hRequest](struct Steam_Matchmaking_Request const& item) { return item.id == hRequest; });
+    if (g == requests.end() || iServer >= g->gameservers_filtered.size() || iServer < 0) {
         return NULL;
     }
 
-    Gameserver *gs = &gameservers_filtered[iServer].server;
-    gameserveritem_t *server = new gameserveritem_t(); //TODO: is the new here ok?
-    server_details(gs, server);
+    //the details are filled once when the server info is received and stay valid as long as the request
     PRINT_DEBUG("Returned server details\n");
-    return server;
+    return &(g->gameservers_filtered[iServer]->details);
 }
 
 
@@ -351,7 +392,10 @@ void Steam_Matchmaking_Servers::RefreshQuery( HServerListRequest hRequest )
 bool Steam_Matchmaking_Servers::IsRefreshing( HServerListRequest hRequest )
 {
     PRINT_DEBUG("IsRefreshing %p\n", hRequest);
-    return false;
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    auto g = std::find_if(requests.begin(), requests.end(), [&hRequest](struct Steam_Matchmaking_Request const& item) { return item.id == hRequest; });
+    if (g == requests.end()) return false;
+    return !g->completed && !g->cancelled;
 }
  
 
@@ -453,6 +497,116 @@ void Steam_Matchmaking_Servers::CancelServerQuery( HServerQuery hServerQuery )
     direct_ip_requests.erase(r);
 }
 
+static bool filter_list_contains(const std::string &list, const std::string &values, bool all)
+{
+    std::set<std::string> items;
+    std::stringstream list_stream(list);
+    std::string item;
+    while (std::getline(list_stream, item, ',')) items.insert(lowercase_string(item));
+
+    std::stringstream values_stream(values);
+    while (std::getline(values_stream, item, ',')) {
+        bool found = items.count(lowercase_string(item)) > 0;
+        if (all && !found) return false;
+        if (!all && found) return true;
+    }
+
+    return all;
+}
+
+static bool filter_address(uint32 ip, uint16 port, const std::string &value)
+{
+    unsigned a = 0, b = 0, c = 0, d = 0, p = 0;
+    int read = sscanf(value.c_str(), "%u.%u.%u.%u:%u", &a, &b, &c, &d, &p);
+    if (read < 4) return false;
+    if (ip != ((a << 24) | (b << 16) | (c << 8) | d)) return false;
+    return read < 5 || port == p;
+}
+
+//evaluates the filter at index i and returns the index after it and its operands
+static bool evaluate_filter(const Gameserver &g, const std::vector<struct Steam_Matchmaking_Servers_Filter> &filters, size_t &i)
+{
+    const struct Steam_Matchmaking_Servers_Filter &f = filters[i++];
+    if (is_boolean_filter(f.key)) {
+        size_t end = std::min(filters.size(), i + boolean_filter_size(f));
+        bool is_and = f.key == "and" || f.key == "nand";
+        bool result = is_and;
+        while (i < end) {
+            bool r = evaluate_filter(g, filters, i);
+            if (is_and) result = result && r;
+            else result = result || r;
+        }
+
+        i = end;
+        if (f.key == "nand" || f.key == "nor") result = !result;
+        return result;
+    }
+
+    uint16 query_port = g.query_port();
+    if (query_port == 0xFFFF) query_port = g.port();
+
+    if (f.key == "map") return lowercase_string(g.map_name()) == lowercase_string(f.value);
+    if (f.key == "gamedir") return lowercase_string(g.mod_dir()) == lowercase_string(f.value);
+    if (f.key == "gamedataand") return filter_list_contains(g.gamedata(), f.value, true);
+    if (f.key == "gamedataor") return filter_list_contains(g.gamedata(), f.value, false);
+    if (f.key == "gamedatanor") return !filter_list_contains(g.gamedata(), f.value, false);
+    if (f.key == "gametagsand") return filter_list_contains(g.tags(), f.value, true);
+    if (f.key == "gametagsnor") return !filter_list_contains(g.tags(), f.value, false);
+    if (f.key == "addr") return filter_address(g.ip(), query_port, f.value);
+    if (f.key == "gameaddr") return filter_address(g.ip(), g.port(), f.value);
+    if (f.key == "dedicated") return g.dedicated_server();
+    if (f.key == "secure") return g.secure();
+    if (f.key == "notfull") return g.num_players() < g.max_player_count();
+    if (f.key == "hasplayers") return g.num_players() > 0;
+    if (f.key == "noplayers") return g.num_players() == 0;
+    if (f.key == "appid") return g.appid() == strtoul(f.value.c_str(), NULL, 10);
+    //the server platform isn't sent so linux (and anything unknown) passes
+    return true;
+}
+
+static bool server_matches(const Gameserver &g, AppId_t appid, const std::vector<struct Steam_Matchmaking_Servers_Filter> &filters)
+{
+    if (g.appid() != appid) return false;
+
+    size_t i = 0;
+    while (i < filters.size()) {
+        if (!evaluate_filter(g, filters, i)) return false;
+    }
+
+    return true;
+}
+
+void Steam_Matchmaking_Servers::index_gameserver(struct Steam_Matchmaking_Servers_Gameserver *g, bool add)
+{
+    uint64 id = g->server.id();
+    std::string map = lowercase_string(g->server.map_name());
+    if (add) {
+        gameservers_by_appid[g->server.appid()].insert(id);
+        gameservers_by_map[map].insert(id);
+    } else {
+        gameservers_by_appid[g->server.appid()].erase(id);
+        gameservers_by_map[map].erase(id);
+        if (gameservers_by_map[map].empty()) gameservers_by_map.erase(map);
+    }
+}
+
+void Steam_Matchmaking_Servers::gameserver_changed(uint64 id)
+{
+    for (auto &r : requests) {
+        if (r.cancelled || r.completed) continue;
+        r.pending.push_back(id);
+    }
+}
+
+struct Server_List_Event {
+    HServerListRequest id;
+    ISteamMatchmakingServerListResponse *callbacks;
+    ISteamMatchmakingServerListResponse001 *old_callbacks;
+    int server;
+    bool complete;
+    EMatchMakingServerResponse response;
+};
+
 void Steam_Matchmaking_Servers::RunCallbacks()
 {
     PRINT_DEBUG("Steam_Matchmaking_Servers::RunCallbacks\n");
@@ -460,7 +614,8 @@ void Steam_Matchmaking_Servers::RunCallbacks()
     {
         auto g = std::begin(gameservers);
         while (g != std::end(gameservers)) {
-            if (check_timedout(g->last_recv, SERVER_TIMEOUT)) {
+            if (check_timedout(g->second->last_recv, g->second->timeout)) {
+                index_gameserver(g->second.get(), false);
                 g = gameservers.erase(g);
                 PRINT_DEBUG("SERVER TIMEOUT\n");
             } else {
@@ -471,55 +626,47 @@ void Steam_Matchmaking_Servers::RunCallbacks()
 
     PRINT_DEBUG("REQUESTS %zu gs: %zu\n", requests.size(), gameservers.size());
 
+    //the callbacks can make new requests so they are called after going through the list
+    std::vector<struct Server_List_Event> events;
     for (auto &r : requests) {
         if (r.cancelled || r.completed) continue;
 
-        r.gameservers_filtered.clear();
-        for (auto &g : gameservers) {
-            PRINT_DEBUG("game_server_check %u %u\n", g.server.appid(), r.appid);
-            if (g.server.appid() == r.appid) {
-                PRINT_DEBUG("REQUESTS server found\n");
-                r.gameservers_filtered.push_back(g);
-            }
+        unsigned responded = 0;
+        while (!r.pending.empty() && responded < SERVER_RESPONSES_PER_RUN) {
+            uint64 id = r.pending.front();
+            r.pending.pop_front();
+            if (r.gameserver_ids.count(id)) continue;
+
+            auto g = gameservers.find(id);
+            if (g == gameservers.end() || !server_matches(g->second->server, r.appid, r.filters)) continue;
+
+            PRINT_DEBUG("REQUESTS server found %llu\n", id);
+            r.gameserver_ids.insert(id);
+            r.gameservers_filtered.push_back(g->second);
+            events.push_back({r.id, r.callbacks, r.old_callbacks, (int)r.gameservers_filtered.size() - 1, false});
+            ++responded;
         }
-    }
 
-    std::vector <struct Steam_Matchmaking_Request> requests_temp(requests);
-    PRINT_DEBUG("REQUESTS_TEMP %zu\n", requests_temp.size());
-    for (auto &r : requests) {
-        r.completed = true;
+        if (r.pending.empty()) {
+            r.completed = true;
+            events.push_back({r.id, r.callbacks, r.old_callbacks, 0, true, r.gameservers_filtered.size() ? eServerResponded : eNoServersListedOnMasterServer});
+        }
     }
 
-    for (auto &r : requests_temp) {
-        if (r.cancelled || r.completed) continue;
-        int i = 0;
-
-        if (r.callbacks) {
-            for (auto &g : r.gameservers_filtered) {
-                PRINT_DEBUG("REQUESTS server responded cb %p\n", r.id);
-                r.callbacks->ServerResponded(r.id, i);
-                ++i;
-            }
+    for (auto &e : events) {
+        auto r = std::find_if(requests.begin(), requests.end(), [&e](struct Steam_Matchmaking_Request const& item) { return item.id == e.id; });
+        if (r == requests.end() || r->cancelled) continue;
 
-            if (i) {
-                r.callbacks->RefreshComplete(r.id, eServerResponded);
-            } else {
-                r.callbacks->RefreshComplete(r.id, eNoServersListedOnMasterServer);
-            }
+        if (e.callbacks) {
+            PRINT_DEBUG("REQUESTS server responded cb %p %i %u\n", e.id, e.server, e.complete);
+            if (e.complete) e.callbacks->RefreshComplete(e.id, e.response);
+            else e.callbacks->ServerResponded(e.id, e.server);
         }
 
-        if (r.old_callbacks) {
-            for (auto &g : r.gameservers_filtered) {
-                PRINT_DEBUG("old REQUESTS server responded cb %p\n", r.id);
-                r.old_callbacks->ServerResponded(i);
-                ++i;
-            }
-
-            if (i) {
-                r.old_callbacks->RefreshComplete(eServerResponded);
-            } else {
-                r.old_callbacks->RefreshComplete(eNoServersListedOnMasterServer);
-            }
+        if (e.old_callbacks) {
+            PRINT_DEBUG("old REQUESTS server responded cb %p %i %u\n", e.id, e.server, e.complete);
+            if (e.complete) e.old_callbacks->RefreshComplete(e.response);
+            else e.old_callbacks->ServerResponded(e.server);
         }
     }
 
@@ -536,7 +683,8 @@ void Steam_Matchmaking_Servers::RunCallbacks()
 
     for (auto &r : direct_ip_requests_temp) {
         PRINT_DEBUG("dip request: %lu:%hu\n", r.ip, r.port);
-        for (auto &g : gameservers) {
+        for (auto &gs : gameservers) {
+            auto &g = *gs.second;
             PRINT_DEBUG("server: %lu:%hu\n", g.server.ip(), g.server.query_port());
             uint16 query_port = g.server.query_port();
             if (query_port == 0xFFFF) {
@@ -575,35 +723,107 @@ void Steam_Matchmaking_Servers::RunCallbacks()
     }
 }
 
+void Steam_Matchmaking_Servers::request_full_server_info(uint64 id, uint64 server_steam_id)
+{
+    Common_Message reply;
+    reply.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+    reply.set_dest_id(server_steam_id);
+    Gameserver_Digest *request = new Gameserver_Digest();
+    request->set_id(id);
+    request->set_request_full(true);
+    reply.set_allocated_gameserver_digest(request);
+    network->sendTo(&reply, true);
+}
+
 void Steam_Matchmaking_Servers::Callback(Common_Message *msg)
 {
+    if (msg->has_gameserver_digest() && !msg->gameserver_digest().request_full() && !msg->gameserver_digest().digest_supported()) {
+        const Gameserver_Digest &digest = msg->gameserver_digest();
+        auto g = gameservers.find(digest.id());
+        if (g != gameservers.end() && g->second->server.state_version() == digest.state_version()) {
+            g->second->last_recv = std::chrono::high_resolution_clock::now();
+            g->second->timeout = std::max(SERVER_TIMEOUT, digest.keepalive_interval() * SERVER_KEEPALIVE_TIMEOUT_FACTOR / 1000.0);
+        } else if (digest.appid() == settings->get_local_game_id().AppID()) {
+            PRINT_DEBUG("SERVER %llu digest differs, requesting full info\n", digest.id());
+            request_full_server_info(digest.id(), msg->source_id());
+        }
+    }
+
+    if (msg->has_gameserver_delta()) {
+        const Gameserver_Delta &delta = msg->gameserver_delta();
+        auto g = gameservers.find(delta.id());
+        if (g != gameservers.end() && g->second->server.state_version() == delta.base_state_version()) {
+            PRINT_DEBUG("SERVER %llu delta, header %u values %i removed %i\n", delta.id(), delta.header_changed(), delta.values_size(), delta.removed_values_size());
+            index_gameserver(g->second.get(), false);
+            Gameserver &server = g->second->server;
+            if (delta.header_changed()) {
+                Gameserver header = delta.header();
+                header.mutable_values()->swap(*server.mutable_values());
+                server = header;
+                server.set_ip(msg->source_ip());
+            }
+
+            for (auto &v : delta.values()) {
+                (*server.mutable_values())[v.first] = v.second;
+            }
+
+            for (auto &k : delta.removed_values()) {
+                server.mutable_values()->erase(k);
+            }
+
+            server.set_state_version(delta.state_version());
+            server.set_keepalive_interval(delta.keepalive_interval());
+            g->second->last_recv = std::chrono::high_resolution_clock::now();
+            g->second->timeout = std::max(SERVER_TIMEOUT, delta.keepalive_interval() * SERVER_KEEPALIVE_TIMEOUT_FACTOR / 1000.0);
+            g->second->details = gameserveritem_t();
+            server_details(&server, &(g->second->details));
+            index_gameserver(g->second.get(), true);
+            gameserver_changed(delta.id());
+        } else if (g != gameservers.end() && g->second->server.state_version() == delta.state_version()) {
+            //already got it from a full info
+            g->second->last_recv = std::chrono::high_resolution_clock::now();
+        } else if (delta.appid() == settings->get_local_game_id().AppID()) {
+            PRINT_DEBUG("SERVER %llu delta is not for what we have, requesting full info\n", delta.id());
+            request_full_server_info(delta.id(), msg->source_id());
+        }
+    }
+
     if (msg->has_gameserver()) {
         PRINT_DEBUG("got SERVER %llu, offline:%u\n", msg->gameserver().id(), msg->gameserver().offline());
+        auto g = gameservers.find(msg->gameserver().id());
+        double timeout = std::max(SERVER_TIMEOUT, msg->gameserver().keepalive_interval() * SERVER_KEEPALIVE_TIMEOUT_FACTOR / 1000.0);
         if (msg->gameserver().offline()) {
-            for (auto &g : gameservers) {
-                if (g.server.id() == msg->gameserver().id()) {
-                    g.last_recv = std::chrono::high_resolution_clock::time_point();
-                }
+            if (g != gameservers.end()) {
+                g->second->last_recv = std::chrono::high_resolution_clock::time_point();
             }
         } else {
-            bool already = false;
-            for (auto &g : gameservers) {
-                if (g.server.id() == msg->gameserver().id()) {
-                    g.last_recv = std::chrono::high_resolution_clock::now();
-                    g.server = msg->gameserver();
-                    g.server.set_ip(msg->source_ip());
-                    already = true;
-                }
+            if (g == gameservers.end()) {
+                g = gameservers.emplace(msg->gameserver().id(), std::make_shared<struct Steam_Matchmaking_Servers_Gameserver>()).first;
+                PRINT_DEBUG("SERVER ADDED\n");
+            } else {
+                index_gameserver(g->second.get(), false);
             }
 
-            if (!already) {
-                struct Steam_Matchmaking_Servers_Gameserver g;
-                g.last_recv = std::chrono::high_resolution_clock::now();
-                g.server = msg->gameserver();
-                g.server.set_ip(msg->source_ip());
-                gameservers.push_back(g);
-                PRINT_DEBUG("SERVER ADDED\n");
+            if (msg->gameserver().keepalive_interval()) {
+                //tells the server it can stop sending us the full info on a timer, every time since the server might have restarted
+                Common_Message reply;
+                reply.set_source_id(settings->get_local_steam_id().ConvertToUint64());
+                reply.set_dest_id(msg->source_id());
+                Gameserver_Digest *supported = new Gameserver_Digest();
+                supported->set_id(msg->gameserver().id());
+                supported->set_digest_supported(true);
+                reply.set_allocated_gameserver_digest(supported);
+                network->sendTo(&reply, true);
             }
+
+            g->second->last_recv = std::chrono::high_resolution_clock::now();
+            g->second->timeout = timeout;
+            g->second->server = msg->gameserver();
+            g->second->server.set_ip(msg->source_ip());
+            g->second->details = gameserveritem_t();
+            server_details(&(g->second->server), &(g->second->details));
+            index_gameserver(g->second.get(), true);
+            gameserver_changed(msg->gameserver().id());
         }
     }
 }
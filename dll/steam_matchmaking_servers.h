@@ -18,7 +18,11 @@
 #include "base.h"
 
 #define SERVER_TIMEOUT 10.0
+//a server is dropped after missing this many of its keepalive intervals
+#define SERVER_KEEPALIVE_TIMEOUT_FACTOR 2.5
 #define DIRECT_IP_DELAY 0.05
+//ServerResponded calls made per request per RunCallbacks, the rest of the list is streamed on the next ones
+#define SERVER_RESPONSES_PER_RUN 32
 
 struct Steam_Matchmaking_Servers_Direct_IP_Request {
 	HServerQuery id;
@@ -33,7 +37,15 @@ struct Steam_Matchmaking_Servers_Direct_IP_Request {
 
 struct Steam_Matchmaking_Servers_Gameserver {
     Gameserver server;
+    gameserveritem_t details;
     std::chrono::high_resolution_clock::time_point last_recv;
+    //servers send digests less often the longer they stay unchanged
+    double timeout;
+};
+
+struct Steam_Matchmaking_Servers_Filter {
+    std::string key;
+    std::string value;
 };
 
 struct Steam_Matchmaking_Request {
@@ -42,7 +54,12 @@ struct Steam_Matchmaking_Request {
     ISteamMatchmakingServerListResponse *callbacks;
 	ISteamMatchmakingServerListResponse001 *old_callbacks;
     bool completed, cancelled, released;
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers_filtered;
+    std::vector <struct Steam_Matchmaking_Servers_Filter> filters;
+    //servers are shared with the server list so every request points to the same details
+    std::vector <std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> gameservers_filtered;
+    std::set<uint64> gameserver_ids;
+    //servers that appeared or changed and still have to be checked against the filters
+    std::deque<uint64> pending;
 };
 
 class Steam_Matchmaking_Servers : public ISteamMatchmakingServers,
@@ -51,10 +68,17 @@ public ISteamMatchmakingServers001
     class Settings *settings;
     class Networking *network;
 
-    std::vector <struct Steam_Matchmaking_Servers_Gameserver> gameservers;
+    std::map <uint64, std::shared_ptr<struct Steam_Matchmaking_Servers_Gameserver>> gameservers;
+    std::unordered_map <AppId_t, std::set<uint64>> gameservers_by_appid;
+    std::unordered_map <std::string, std::set<uint64>> gameservers_by_map;
     std::vector <struct Steam_Matchmaking_Request> requests;
     std::vector <struct Steam_Matchmaking_Servers_Direct_IP_Request> direct_ip_requests;
-	void RequestOldServerList(AppId_t iApp, ISteamMatchmakingServerListResponse001 *pRequestServersResponse, EMatchMakingType type);
+	void RequestOldServerList(AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse001 *pRequestServersResponse, EMatchMakingType type);
+	HServerListRequest request_server_list(AppId_t iApp, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters, ISteamMatchmakingServerListResponse *pRequestServersResponse);
+	void start_request(struct Steam_Matchmaking_Request *request, MatchMakingKeyValuePair_t **ppchFilters, uint32 nFilters);
+	void index_gameserver(struct Steam_Matchmaking_Servers_Gameserver *g, bool add);
+	void gameserver_changed(uint64 id);
+	void request_full_server_info(uint64 id, uint64 server_steam_id);
 public:
     Steam_Matchmaking_Servers(class Settings *settings, class Networking *network);
 	// Request a new list of servers of a particular type.  These calls each correspond to one of the EMatchMakingType values.
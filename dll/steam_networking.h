@@ -31,6 +31,13 @@ struct Steam_Networking_Connection {
     std::set<int> open_channels;
 };
 
+struct Steam_Networking_Packet {
+    uint64 source_id;
+    int channel;
+    uint64 time_processed;
+    std::string data;
+};
+
 struct steam_listen_socket {
     SNetListenSocket_t id;
     int nVirtualP2PPort;
@@ -72,11 +79,14 @@ public ISteamNetworking
     class RunEveryRunCB *run_every_runcb;
 
     std::recursive_mutex messages_mutex;
-    std::list<Common_Message> messages;
-    std::list<Common_Message> unprocessed_messages;
+    std::vector<struct Steam_Networking_Packet> unprocessed_messages;
+    //packets from users with an open session, one queue per channel
+    std::unordered_map<int, std::deque<struct Steam_Networking_Packet>> messages;
+    //packets from users that haven't been accepted yet
+    std::unordered_map<uint64, std::deque<struct Steam_Networking_Packet>> orphaned_messages;
 
     std::recursive_mutex connections_edit_mutex;
-    std::vector<struct Steam_Networking_Connection> connections;
+    std::unordered_map<uint64, struct Steam_Networking_Connection> connections;
 
     std::vector<struct steam_listen_socket> listen_sockets;
     std::vector<struct steam_connection_socket> connection_sockets;
@@ -87,61 +97,65 @@ public ISteamNetworking
 bool connection_exists(CSteamID id)
 {
     std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-    return std::find_if(connections.begin(), connections.end(), [&id](struct Steam_Networking_Connection const& conn) { return conn.remote == id;}) != connections.end();
+    return connections.count(id.ConvertToUint64()) != 0;
 }
 
 struct Steam_Networking_Connection *get_or_create_connection(CSteamID id)
 {
-    std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-    auto conn = std::find_if(connections.begin(), connections.end(), [&id](struct Steam_Networking_Connection const& conn) { return conn.remote == id;});
+    struct Steam_Networking_Connection *connection;
+    {
+        std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
+        auto conn = connections.find(id.ConvertToUint64());
+        if (conn != connections.end()) return &(conn->second);
 
-    if (connections.end() == conn) {
-        struct Steam_Networking_Connection connection;
-        connection.remote = id;
-        connections.push_back(connection);
-        return &(connections[connections.size() - 1]);
-    } else {
-        return &(*conn);
+        connection = &(connections[id.ConvertToUint64()]);
+        connection->remote = id;
+    }
+
+    //the packets that were waiting for the session to be accepted can be read now
+    release_orphaned_messages(id);
+    return connection;
+}
+
+void release_orphaned_messages(CSteamID id)
+{
+    std::lock_guard<std::recursive_mutex> lock(messages_mutex);
+    auto orphaned = orphaned_messages.find(id.ConvertToUint64());
+    if (orphaned == orphaned_messages.end()) return;
+
+    for (auto &packet : orphaned->second) {
+        messages[packet.channel].push_back(std::move(packet));
     }
+
+    orphaned_messages.erase(orphaned);
+}
+
+void remove_messages(CSteamID id)
+{
+    std::lock_guard<std::recursive_mutex> lock(messages_mutex);
+    uint64 source_id = id.ConvertToUint64();
+    for (auto &channel : messages) {
+        auto &packets = channel.second;
+        packets.erase(std::remove_if(packets.begin(), packets.end(), [source_id](struct Steam_Networking_Packet const& packet) { return packet.source_id == source_id; }), packets.end());
+    }
+
+    orphaned_messages.erase(source_id);
 }
 
 void remove_connection(CSteamID id)
 {
     {
         std::lock_guard<std::recursive_mutex> lock(connections_edit_mutex);
-        auto conn = std::begin(connections);
-        while (conn != std::end(connections)) {
-            if (conn->remote == id) {
-
-                conn = connections.erase(conn);
-            } else {
-                ++conn;
-            }
-        }
+        connections.erase(id.ConvertToUint64());
     }
 
     //pretty sure steam also clears the entire queue of messages for that connection
     {
         std::lock_guard<std::recursive_mutex> lock(messages_mutex);
-        auto msg = std::begin(messages);
-        while (msg != std::end(messages)) {
-            if (msg->source_id() == id.ConvertToUint64()) {
-                msg = messages.erase(msg);
-            } else {
-                ++msg;
-            }
-        }
-    }
+        remove_messages(id);
 
-    {
-        auto msg = std::begin(unprocessed_messages);
-        while (msg != std::end(unprocessed_messages)) {
-            if (msg->source_id() == id.ConvertToUint64()) {
-                msg = unprocessed_messages.erase(msg);
-            } else {
-                ++msg;
-            }
-        }
+        uint64 source_id = id.ConvertToUint64();
+        unprocessed_messages.erase(std::remove_if(unprocessed_messages.begin(), unprocessed_messages.end(), [source_id](struct Steam_Networking_Packet const& packet) { return packet.source_id == source_id; }), unprocessed_messages.end());
     }
 }
 
@@ -312,14 +326,12 @@ bool IsP2PPacketAvailable( uint32 *pcubMsgSize, int nChannel)
     //this->network->Run();
     //RunCallbacks();
 
-    PRINT_DEBUG("Messages %zu %p\n", messages.size(), &messages);
-    for (auto &msg : messages) {
-        if (connection_exists((uint64)msg.source_id()) && msg.mutable_network()->channel() == nChannel && msg.network().processed()) {
-            uint32 size = msg.mutable_network()->data().size();
-            if (pcubMsgSize) *pcubMsgSize = size;
-            PRINT_DEBUG("available with size: %lu\n", size);
-            return true;
-        }
+    auto channel = messages.find(nChannel);
+    if (channel != messages.end() && !channel->second.empty()) {
+        uint32 size = channel->second.front().data.size();
+        if (pcubMsgSize) *pcubMsgSize = size;
+        PRINT_DEBUG("available with size: %lu\n", size);
+        return true;
     }
 
     PRINT_DEBUG("Not available\n");
@@ -346,28 +358,23 @@ bool ReadP2PPacket( void *pubDest, uint32 cubDest, uint32 *pcubMsgSize, CSteamID
     //this->network->Run();
     //RunCallbacks();
 
-    bool read = false;
-    PRINT_DEBUG("Number messages %zu\n", messages.size());
-    auto msg = std::begin(messages);
-    while (msg != std::end(messages)) {
-        if (connection_exists((uint64)msg->source_id()) && msg->network().channel() == nChannel && msg->network().processed()) {
-            uint32 msg_size = msg->network().data().size();
-            if (msg_size > cubDest) msg_size = cubDest;
-            if (pcubMsgSize) *pcubMsgSize = msg_size;
-            memcpy(pubDest, msg->network().data().data(), msg_size);
+    auto channel = messages.find(nChannel);
+    if (channel != messages.end() && !channel->second.empty()) {
+        struct Steam_Networking_Packet &packet = channel->second.front();
+        uint32 msg_size = packet.data.size();
+        if (msg_size > cubDest) msg_size = cubDest;
+        if (pcubMsgSize) *pcubMsgSize = msg_size;
+        memcpy(pubDest, packet.data.data(), msg_size);
 
 #ifndef EMU_RELEASE_BUILD
-            for (int i = 0; i < msg_size; ++i) {
-                PRINT_DEBUG("%02hhX", ((char*)pubDest)[i]);
-            }PRINT_DEBUG("\n");
+        for (int i = 0; i < msg_size; ++i) {
+            PRINT_DEBUG("%02hhX", ((char*)pubDest)[i]);
+        }PRINT_DEBUG("\n");
 #endif
-            *psteamIDRemote = CSteamID((uint64)msg->source_id());
-            PRINT_DEBUG("Steam_Networking::ReadP2PPacket len %u channel: %u from: %llu\n", msg_size, nChannel, msg->source_id());
-            msg = messages.erase(msg);
-            return true;
-        }
-
-        ++msg;
+        *psteamIDRemote = CSteamID((uint64)packet.source_id);
+        PRINT_DEBUG("Steam_Networking::ReadP2PPacket len %u channel: %u from: %llu\n", msg_size, nChannel, packet.source_id);
+        channel->second.pop_front();
+        return true;
     }
 
     if (pcubMsgSize) *pcubMsgSize = 0;
@@ -460,11 +467,14 @@ bool GetP2PSessionState( CSteamID steamIDRemote, P2PSessionState_t *pConnectionS
     }
 
     if (pConnectionState) {
+        struct Connection_Stats stats;
+        network->getStats(steamIDRemote, &stats);
+
         pConnectionState->m_bConnectionActive = true;
         pConnectionState->m_bConnecting = false;
         pConnectionState->m_eP2PSessionError = 0;
         pConnectionState->m_bUsingRelay = false;
-        pConnectionState->m_nBytesQueuedForSend = 0;
+        pConnectionState->m_nBytesQueuedForSend = stats.pending_reliable;
         pConnectionState->m_nPacketsQueuedForSend = 0;
         pConnectionState->m_nRemoteIP = network->getIP(steamIDRemote);
         pConnectionState->m_nRemotePort = 12345;
@@ -830,42 +840,36 @@ void RunCallbacks()
     {
     std::lock_guard<std::recursive_mutex> lock(messages_mutex);
 
-    {
-        auto msg = std::begin(unprocessed_messages);
-        while (msg != std::end(unprocessed_messages)) {
-            CSteamID source_id((uint64)msg->source_id());
-            if (!connection_exists(source_id)) {
-                if (new_connection_times.find(source_id) == new_connection_times.end()) {
-                    new_connections_to_call_cb.push(source_id);
-                    new_connection_times[source_id] = std::chrono::high_resolution_clock::now();
-                }
-            } else {
-                struct Steam_Networking_Connection *conn = get_or_create_connection(source_id);
-                conn->open_channels.insert(msg->network().channel());
+    for (auto &packet : unprocessed_messages) {
+        CSteamID source_id((uint64)packet.source_id);
+        packet.time_processed = current_time;
+        if (!connection_exists(source_id)) {
+            if (new_connection_times.find(source_id) == new_connection_times.end()) {
+                new_connections_to_call_cb.push(source_id);
+                new_connection_times[source_id] = std::chrono::high_resolution_clock::now();
             }
 
-            msg->mutable_network()->set_processed(true);
-            msg->mutable_network()->set_time_processed(current_time);
-            messages.push_back(*msg);
-            msg = unprocessed_messages.erase(msg);
+            orphaned_messages[packet.source_id].push_back(std::move(packet));
+        } else {
+            struct Steam_Networking_Connection *conn = get_or_create_connection(source_id);
+            conn->open_channels.insert(packet.channel);
+            messages[packet.channel].push_back(std::move(packet));
         }
     }
 
-    auto msg = std::begin(messages);
-    while (msg != std::end(messages)) {
-        bool deleted = false;
-        if (msg->network().processed()) {
-            if (!connection_exists((uint64)msg->source_id())) {
-                if (msg->network().time_processed() + ORPHANED_PACKET_TIMEOUT < current_time) {
-                    deleted = true;
-                }
-            }
+    unprocessed_messages.clear();
+
+    auto orphaned = std::begin(orphaned_messages);
+    while (orphaned != std::end(orphaned_messages)) {
+        auto &packets = orphaned->second;
+        while (!packets.empty() && packets.front().time_processed + ORPHANED_PACKET_TIMEOUT < current_time) {
+            packets.pop_front();
         }
 
-        if (deleted) {
-            msg = messages.erase(msg);
+        if (packets.empty()) {
+            orphaned = orphaned_messages.erase(orphaned);
         } else {
-            ++msg;
+            ++orphaned;
         }
     }
 
@@ -914,20 +918,18 @@ void Callback(Common_Message *msg)
 #endif
 
         if (msg->network().type() == Network_pb::DATA) {
-            unprocessed_messages.push_back(Common_Message(*msg));
+            std::lock_guard<std::recursive_mutex> lock(messages_mutex);
+            struct Steam_Networking_Packet packet;
+            packet.source_id = msg->source_id();
+            packet.channel = msg->network().channel();
+            packet.time_processed = 0;
+            packet.data = msg->network().data();
+            unprocessed_messages.push_back(std::move(packet));
         }
 
         if (msg->network().type() == Network_pb::NEW_CONNECTION) {
-            std::lock_guard<std::recursive_mutex> lock(messages_mutex);
-            auto msg_temp = std::begin(messages);
-            while (msg_temp != std::end(messages)) {
-                //only delete processed to handle unreliable message arriving at the same time.
-                if (msg_temp->source_id() == msg->source_id() && msg_temp->network().processed()) {
-                    msg_temp = messages.erase(msg_temp);
-                } else {
-                    ++msg_temp;
-                }
-            }
+            //only delete processed to handle unreliable message arriving at the same time.
+            remove_messages((uint64)msg->source_id());
         }
     }
 
@@ -16,23 +16,31 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "message_pool.h"
 
 #define NETWORKING_MESSAGES_TIMEOUT 30.0
 
 struct Steam_Message_Connection {
     SteamNetworkingIdentity remote_identity;
-    std::map<int, std::queue<std::string>> data;
 
-    std::list<int> channels;
     bool accepted = false;
     bool dead = false;
 
     unsigned id;
     unsigned remote_id = 0;
+    //channels that were sent or received on, closing the last one closes the session
+    std::set<int> channels;
 
     std::chrono::high_resolution_clock::time_point created = std::chrono::high_resolution_clock::now();
 };
 
+struct Steam_Message_Received {
+    CSteamID source;
+    //id of the connection it came in on, messages from sessions that were closed since then get skipped
+    unsigned connection_id;
+    std::string data;
+};
+
 class Steam_Networking_Messages :
 public ISteamNetworkingMessages
 {
@@ -43,7 +51,10 @@ public ISteamNetworkingMessages
     class RunEveryRunCB *run_every_runcb;
 
     std::map<CSteamID, Steam_Message_Connection> connections;
-    std::list<Common_Message> incoming_data;
+    //received messages of all connections in the order they arrived, one queue per channel
+    std::unordered_map<int, std::deque<struct Steam_Message_Received>> inbox;
+    //data that arrived before the session it belongs to, gets one more chance on the next RunCallbacks
+    std::vector<Common_Message> incoming_data;
 
     unsigned id_counter = 0;
     std::chrono::steady_clock::time_point created;
@@ -207,22 +218,11 @@ EResult SendMessageToUser( const SteamNetworkingIdentity &identityRemote, const
     msg.mutable_networking_messages()->set_id_from(conn->second.id);
     msg.mutable_networking_messages()->set_data(pubData, cubData);
 
+    conn->second.channels.insert(nRemoteChannel);
     network->sendTo(&msg, reliable);
     return k_EResultOK;
 }
 
-static void free_steam_message_data(SteamNetworkingMessage_t *pMsg)
-{
-    free(pMsg->m_pData);
-    pMsg->m_pData = NULL;
-}
-
-static void delete_steam_message(SteamNetworkingMessage_t *pMsg)
-{
-    if (pMsg->m_pfnFreeData) pMsg->m_pfnFreeData(pMsg);
-    delete pMsg;
-}
-
 /// Reads the next message that has been sent from another user via SendMessageToUser() on the given channel.
 /// Returns number of messages returned into your list.  (0 if no message are available on that channel.)
 ///
@@ -233,35 +233,31 @@ int ReceiveMessagesOnChannel( int nLocalChannel, SteamNetworkingMessage_t **ppOu
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     int message_counter = 0;
 
-    for (auto & conn : connections) {
-        auto chan = conn.second.data.find(nLocalChannel);
-        if (chan != conn.second.data.end()) {
-            while (!chan->second.empty() && message_counter < nMaxMessages) {
-                SteamNetworkingMessage_t *pMsg = new SteamNetworkingMessage_t(); //TODO size is wrong
-                unsigned long size = chan->second.front().size();
-                pMsg->m_pData = malloc(size);
-                pMsg->m_cbSize = size;
-                memcpy(pMsg->m_pData, chan->second.front().data(), size);
-                pMsg->m_conn = conn.second.id;
-                pMsg->m_identityPeer = conn.second.remote_identity;
-                pMsg->m_nConnUserData = -1;
-                pMsg->m_usecTimeReceived = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created).count();
-                //TODO: messagenumber?
-                // pMsg->m_nMessageNumber = connect_socket->second.packet_receive_counter;
-                // ++connect_socket->second.packet_receive_counter;
-
-                pMsg->m_pfnFreeData = &free_steam_message_data;
-                pMsg->m_pfnRelease = &delete_steam_message;
-                pMsg->m_nChannel = nLocalChannel;
-                ppOutMessages[message_counter] = pMsg;
-                ++message_counter;
-                chan->second.pop();
-            }
-        }
+    auto chan = inbox.find(nLocalChannel);
+    if (chan == inbox.end()) return 0;
 
-        if (message_counter >= nMaxMessages) {
-            break;
+    auto &received = chan->second;
+    while (!received.empty() && message_counter < nMaxMessages) {
+        struct Steam_Message_Received &front = received.front();
+        auto conn = connections.find(front.source);
+        if (conn == connections.end() || conn->second.id != front.connection_id) {
+            received.pop_front();
+            continue;
         }
+
+        SteamNetworkingMessage_t *pMsg = Steam_Message_Pool::adopt(front.data);
+        pMsg->m_conn = conn->second.id;
+        pMsg->m_identityPeer = conn->second.remote_identity;
+        pMsg->m_nConnUserData = -1;
+        pMsg->m_usecTimeReceived = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created).count();
+        //TODO: messagenumber?
+        // pMsg->m_nMessageNumber = connect_socket->second.packet_receive_counter;
+        // ++connect_socket->second.packet_receive_counter;
+
+        pMsg->m_nChannel = nLocalChannel;
+        ppOutMessages[message_counter] = pMsg;
+        ++message_counter;
+        received.pop_front();
     }
 
     PRINT_DEBUG("Steam_Networking_Messages::ReceiveMessagesOnChannel got %u\n", message_counter);
@@ -311,6 +307,7 @@ bool CloseSessionWithUser( const SteamNetworkingIdentity &identityRemote )
     msg.mutable_networking_messages()->set_id_from(conn->second.id);
     network->sendTo(&msg, true);
 
+    remove_received(conn->first);
     connections.erase(conn);
     return true;
 }
@@ -323,8 +320,23 @@ bool CloseChannelWithUser( const SteamNetworkingIdentity &identityRemote, int nL
 {
     PRINT_DEBUG("Steam_Networking_Messages::CloseChannelWithUser\n");
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    //TODO
-    return false;
+    auto conn = connections.find(identityRemote.GetSteamID());
+    if (conn == connections.end()) {
+        return false;
+    }
+
+    auto chan = inbox.find(nLocalChannel);
+    if (chan != inbox.end()) {
+        CSteamID source = identityRemote.GetSteamID();
+        chan->second.erase(std::remove_if(chan->second.begin(), chan->second.end(), [&source](struct Steam_Message_Received const& received) { return received.source == source; }), chan->second.end());
+    }
+
+    if (conn->second.channels.erase(nLocalChannel) && conn->second.channels.empty()) {
+        PRINT_DEBUG("Steam_Networking_Messages::CloseChannelWithUser last channel closed\n");
+        return CloseSessionWithUser(identityRemote);
+    }
+
+    return true;
 }
 
 /// Returns information about the latest state of a connection, if any, with the given peer.
@@ -379,24 +391,50 @@ void end_connection(CSteamID steam_id)
     }
 }
 
-void RunCallbacks()
+//frees the queued messages of a session that got closed instead of waiting for them to be skipped on read
+void remove_received(CSteamID source)
 {
-    auto msg = std::begin(incoming_data);
-    while (msg != std::end(incoming_data)) {
-        CSteamID source_id((uint64)msg->source_id());
-
-        auto conn = connections.find(source_id);
-        if (conn != connections.end()) {
-            if (conn->second.remote_id == msg->networking_messages().id_from())
-                conn->second.data[msg->networking_messages().channel()].push(msg->networking_messages().data());
+    auto chan = inbox.begin();
+    while (chan != inbox.end()) {
+        chan->second.erase(std::remove_if(chan->second.begin(), chan->second.end(), [&source](struct Steam_Message_Received const& received) { return received.source == source; }), chan->second.end());
+        if (chan->second.empty()) {
+            chan = inbox.erase(chan);
+        } else {
+            ++chan;
         }
+    }
+}
+
+//takes the data out of the message
+bool push_received(Common_Message *msg)
+{
+    CSteamID source_id((uint64)msg->source_id());
+    auto conn = connections.find(source_id);
+    if (conn == connections.end() || conn->second.remote_id != msg->networking_messages().id_from()) {
+        return false;
+    }
+
+    struct Steam_Message_Received received;
+    received.source = source_id;
+    received.connection_id = conn->second.id;
+    received.data.swap(*msg->mutable_networking_messages()->mutable_data());
+    conn->second.channels.insert(msg->networking_messages().channel());
+    inbox[msg->networking_messages().channel()].push_back(std::move(received));
+    return true;
+}
 
-        msg = incoming_data.erase(msg);
+void RunCallbacks()
+{
+    for (auto &msg : incoming_data) {
+        push_received(&msg);
     }
 
+    incoming_data.clear();
+
     auto conn = std::begin(connections);
     while (conn != std::end(connections)) {
         if (!conn->second.accepted && check_timedout(conn->second.created, NETWORKING_MESSAGES_TIMEOUT)) {
+            remove_received(conn->first);
             conn = connections.erase(conn);
         } else {
             ++conn;
@@ -438,7 +476,13 @@ void Callback(Common_Message *msg)
         }
 
         if (msg->networking_messages().type() == Networking_Messages::DATA) {
-            incoming_data.push_back(Common_Message(*msg));
+            //the message might be dispatched to others too if it isn't addressed to us specifically so it has to stay intact
+            if (msg->dest_id() == settings->get_local_steam_id().ConvertToUint64()) {
+                if (!push_received(msg)) incoming_data.push_back(Common_Message(*msg));
+            } else {
+                Common_Message copy(*msg);
+                if (!push_received(&copy)) incoming_data.push_back(std::move(copy));
+            }
         }
     }
 }
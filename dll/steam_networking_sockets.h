@@ -16,6 +16,16 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "message_pool.h"
+
+//default k_ESteamNetworkingConfig_NagleTime in microseconds
+#define NAGLE_TIME_DEFAULT 5000
+//unreliable batches go over udp and should fit in a single datagram
+#define MAX_BATCH_BYTES_UNRELIABLE 1200
+#define MAX_BATCH_BYTES_RELIABLE (16 * 1024)
+#define MAX_CONNECTION_LANES 255
+//default k_ESteamNetworkingConfig_SendBufferSize, counts what is queued on the lanes and what the transport still has to send to the peer
+#define SEND_BUFFER_SIZE_DEFAULT (512 * 1024)
 
 struct Listen_Socket {
     HSteamListenSocket socket_id;
@@ -41,6 +51,25 @@ struct compare_snm_for_queue {
     }
 };
 
+struct Lane_Message {
+    std::string data;
+    uint64 message_number;
+    bool reliable;
+    std::chrono::steady_clock::time_point queued;
+};
+
+struct Connection_Lane {
+    int priority;
+    uint16 weight;
+    uint64 send_counter;
+
+    //messages waiting for the nagle timer in the order they were sent
+    std::deque<Lane_Message> queue;
+    unsigned pending_bytes[2];
+    //lanes with the same priority are served lowest virtual time first, it grows by bytes sent / weight
+    double virtual_time;
+};
+
 struct Connect_Socket {
     int virtual_port;
     int real_port;
@@ -53,12 +82,27 @@ struct Connect_Socket {
     enum connect_socket_status status;
     int64 user_data;
 
-    std::priority_queue<Networking_Sockets, std::vector<Networking_Sockets>, compare_snm_for_queue> data;
+    //received messages ordered by message number on each lane, data_order is the lane of each one in the order they arrived
+    std::vector<std::priority_queue<Networking_Sockets, std::vector<Networking_Sockets>, compare_snm_for_queue>> data;
+    std::deque<uint32> data_order;
     HSteamNetPollGroup poll_group;
+    //set while the connection is queued on the ready list of its poll group/listen socket
+    bool ready_poll_group;
+    bool ready_listen_socket;
 
-    unsigned long long packet_send_counter;
     CSteamID created_by;
 
+    std::vector<Connection_Lane> lanes;
+    double lanes_virtual_time;
+    //the peer said in the connection handshake that it can read batched messages
+    bool peer_batching;
+    //queued bytes on all lanes, index 1 is for reliable ones since they go out on a different transport
+    unsigned send_pending_bytes[2];
+    std::chrono::steady_clock::time_point send_batch_time;
+
+    std::map<ESteamNetworkingConfigValue, int32> config;
+    std::map<ESteamNetworkingConfigValue, float> config_float;
+
     std::chrono::steady_clock::time_point connect_request_last_sent;
     unsigned connect_requests_sent;
 };
@@ -67,7 +111,18 @@ struct shared_between_client_server {
     std::vector<struct Listen_Socket> listen_sockets;
     std::map<HSteamNetConnection, struct Connect_Socket> connect_sockets;
     std::map<HSteamNetPollGroup, std::list<HSteamNetConnection>> poll_groups;
+    //connections that might have pending messages, in the order they got them
+    std::map<HSteamNetPollGroup, std::deque<HSteamNetConnection>> ready_poll_groups;
+    std::map<HSteamListenSocket, std::deque<HSteamNetConnection>> ready_listen_sockets;
+    //int32 and float values set through ISteamNetworkingUtils::SetConfigValue at global scope
+    std::map<ESteamNetworkingConfigValue, int32> config;
+    std::map<ESteamNetworkingConfigValue, float> config_float;
     unsigned used;
+
+    //the background thread sleeps on this until the first nagle timer runs out, it gets woken when a new one starts
+    std::mutex background_mutex;
+    std::condition_variable background_cv;
+    bool background_wake = false;
 };
 
 class Steam_Networking_Sockets :
@@ -199,6 +254,7 @@ bool send_packet_new_connection(HSteamNetConnection m_hConn)
     msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
     msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
     msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
+    msg.mutable_networking_sockets()->set_batching(true);
 
     uint64_t steam_id = connect_socket->second.remote_identity.GetSteamID64();
     if (steam_id) {
@@ -214,6 +270,27 @@ bool send_packet_new_connection(HSteamNetConnection m_hConn)
     return false;
 }
 
+int32 get_config_value(struct Connect_Socket &socket, ESteamNetworkingConfigValue value, int32 default_value)
+{
+    auto config = socket.config.find(value);
+    if (config != socket.config.end()) return config->second;
+    config = s->config.find(value);
+    if (config != s->config.end()) return config->second;
+    return default_value;
+}
+
+void set_connection_options(HSteamNetConnection hConn, int nOptions, const SteamNetworkingConfigValue_t *pOptions)
+{
+    auto connect_socket = s->connect_sockets.find(hConn);
+    if (connect_socket == s->connect_sockets.end() || !pOptions) return;
+
+    for (int i = 0; i < nOptions; ++i) {
+        if (pOptions[i].m_eDataType == k_ESteamNetworkingConfig_Int32) {
+            connect_socket->second.config[pOptions[i].m_eValue] = pOptions[i].m_val.m_int32;
+        }
+    }
+}
+
 HSteamNetConnection new_connect_socket(SteamNetworkingIdentity remote_identity, int virtual_port, int real_port, enum connect_socket_status status=CONNECT_SOCKET_CONNECTING, HSteamListenSocket listen_socket_id=k_HSteamListenSocket_Invalid, HSteamNetConnection remote_id=k_HSteamNetConnection_Invalid)
 {
     Connect_Socket socket = {};
@@ -228,7 +305,9 @@ HSteamNetConnection new_connect_socket(SteamNetworkingIdentity remote_identity,
     socket.created_by = settings->get_local_steam_id();
     socket.connect_request_last_sent = std::chrono::steady_clock::now();
     socket.connect_requests_sent = 0;
-    socket.packet_send_counter = 1;
+    socket.lanes.resize(1);
+    socket.lanes[0].weight = 1;
+    socket.lanes[0].send_counter = 1;
 
     HSteamNetConnection socket_id = get_socket_id();
     if (socket_id == k_HSteamNetConnection_Invalid) ++socket_id;
@@ -397,6 +476,7 @@ HSteamNetConnection ConnectByIPAddress( const SteamNetworkingIPAddr &address, in
     SteamNetworkingIdentity ip_id;
     ip_id.SetIPAddr(address);
     HSteamNetConnection socket = new_connect_socket(ip_id, SNS_DISABLED_PORT, address.m_port);
+    set_connection_options(socket, nOptions, pOptions);
     send_packet_new_connection(socket);
     return socket;
 }
@@ -468,8 +548,10 @@ HSteamNetConnection ConnectP2P( const SteamNetworkingIdentity *identityRemote, i
 HSteamNetConnection ConnectP2P( const SteamNetworkingIdentity &identityRemote, int nVirtualPort, int nOptions, const SteamNetworkingConfigValue_t *pOptions )
 {
     PRINT_DEBUG("Steam_Networking_Sockets::ConnectP2P %i\n", nVirtualPort);
-    //TODO config options
-    return ConnectP2P(identityRemote, nVirtualPort);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    HSteamNetConnection socket = ConnectP2P(identityRemote, nVirtualPort);
+    set_connection_options(socket, nOptions, pOptions);
+    return socket;
 }
 
 /// Creates a connection and begins talking to a remote destination.  The remote host
@@ -574,6 +656,7 @@ bool CloseConnection( HSteamNetConnection hPeer, int nReason, const char *pszDeb
     if (connect_socket == s->connect_sockets.end()) return false;
 
     if (connect_socket->second.status != CONNECT_SOCKET_CLOSED && connect_socket->second.status != CONNECT_SOCKET_TIMEDOUT) {
+        flush_connection(connect_socket);
         //TODO send/nReason and pszDebug
         Common_Message msg;
         msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
@@ -634,6 +717,7 @@ bool CloseListenSocket( HSteamListenSocket hSocket )
     }
 
     s->listen_sockets.erase(conn);
+    s->ready_listen_sockets.erase(hSocket);
     return true;
 }
 
@@ -743,17 +827,8 @@ EResult SendMessageToConnection( HSteamNetConnection hConn, const void *pData, u
 ///   we were not ready to send it.
 /// - k_EResultLimitExceeded: there was already too much data queued to be sent.
 ///   (See k_ESteamNetworkingConfig_SendBufferSize)
-EResult SendMessageToConnection( HSteamNetConnection hConn, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumber )
+bool send_batch(std::map<HSteamNetConnection, struct Connect_Socket>::iterator connect_socket, Networking_Sockets &batch, bool reliable)
 {
-    PRINT_DEBUG("Steam_Networking_Sockets::SendMessageToConnection %u, len %u, flags %i\n", hConn, cbData, nSendFlags);
-    std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    auto connect_socket = s->connect_sockets.find(hConn);
-    if (connect_socket == s->connect_sockets.end()) return k_EResultInvalidParam;
-    if (connect_socket->second.status == CONNECT_SOCKET_CLOSED) return k_EResultNoConnection;
-    if (connect_socket->second.status == CONNECT_SOCKET_TIMEDOUT) return k_EResultNoConnection;
-    if (connect_socket->second.status != CONNECT_SOCKET_CONNECTED && connect_socket->second.status != CONNECT_SOCKET_CONNECTING) return k_EResultInvalidState;
-
     Common_Message msg;
     msg.set_source_id(connect_socket->second.created_by.ConvertToUint64());
     msg.set_dest_id(connect_socket->second.remote_identity.GetSteamID64());
@@ -763,19 +838,219 @@ EResult SendMessageToConnection( HSteamNetConnection hConn, const void *pData, u
     msg.mutable_networking_sockets()->set_real_port(connect_socket->second.real_port);
     msg.mutable_networking_sockets()->set_connection_id_from(connect_socket->first);
     msg.mutable_networking_sockets()->set_connection_id(connect_socket->second.remote_id);
-    msg.mutable_networking_sockets()->set_data(pData, cbData);
-    uint64 message_number = connect_socket->second.packet_send_counter;
-    msg.mutable_networking_sockets()->set_message_number(message_number);
-    connect_socket->second.packet_send_counter += 1;
+    if (batch.batch_size() == 1) {
+        //a lone message goes out in the plain format
+        msg.mutable_networking_sockets()->mutable_data()->swap(*batch.mutable_batch(0)->mutable_data());
+        msg.mutable_networking_sockets()->set_message_number(batch.batch(0).message_number());
+        msg.mutable_networking_sockets()->set_lane(batch.batch(0).lane());
+        batch.clear_batch();
+    } else {
+        msg.mutable_networking_sockets()->mutable_batch()->Swap(batch.mutable_batch());
+    }
+
+    if (network->sendTo(&msg, reliable)) return true;
+
+    //the messages go back into the batch so the caller can queue them again
+    if (msg.networking_sockets().batch_size()) {
+        batch.mutable_batch()->Swap(msg.mutable_networking_sockets()->mutable_batch());
+    } else {
+        Networking_Sockets_Batched_Data *entry = batch.add_batch();
+        entry->mutable_data()->swap(*msg.mutable_networking_sockets()->mutable_data());
+        entry->set_message_number(msg.networking_sockets().message_number());
+        entry->set_lane(msg.networking_sockets().lane());
+    }
+
+    return false;
+}
+
+//puts reliable messages the transport refused back at the front of their lanes, in the same order
+void requeue_batch(struct Connect_Socket &socket, Networking_Sockets &batch)
+{
+    auto now = std::chrono::steady_clock::now();
+    for (int i = batch.batch_size() - 1; i >= 0; --i) {
+        Networking_Sockets_Batched_Data *entry = batch.mutable_batch(i);
+        struct Connection_Lane &lane = socket.lanes[entry->lane()];
 
+        Lane_Message message;
+        message.data.swap(*entry->mutable_data());
+        message.message_number = entry->message_number();
+        message.reliable = true;
+        message.queued = now;
+        lane.pending_bytes[1] += message.data.size();
+        lane.queue.push_front(std::move(message));
+    }
+
+    batch.clear_batch();
+    //retried once the nagle timer runs out again
+    socket.send_batch_time = now;
+    wake_background_thread();
+}
+
+//highest priority lane with queued messages, ties go to the lane that got the least bandwidth for its weight
+int next_send_lane(struct Connect_Socket &socket)
+{
+    int next = -1;
+    for (int i = 0; i < socket.lanes.size(); ++i) {
+        struct Connection_Lane &lane = socket.lanes[i];
+        if (lane.queue.empty()) continue;
+        if (next < 0 || lane.priority > socket.lanes[next].priority || (lane.priority == socket.lanes[next].priority && lane.virtual_time < socket.lanes[next].virtual_time)) {
+            next = i;
+        }
+    }
+
+    return next;
+}
+
+//sends everything waiting for the nagle timer on that connection, in lane schedule order
+//returns false if the transport refused some of it, reliable messages then stay queued and unreliable ones are dropped
+bool flush_connection(std::map<HSteamNetConnection, struct Connect_Socket>::iterator connect_socket)
+{
+    struct Connect_Socket &socket = connect_socket->second;
+    Networking_Sockets batch[2];
+    unsigned batch_bytes[2] = {};
+    bool sent = true;
+    int lane_index;
+    while ((lane_index = next_send_lane(socket)) >= 0) {
+        struct Connection_Lane &lane = socket.lanes[lane_index];
+        Lane_Message &message = lane.queue.front();
+        bool reliable = message.reliable;
+        unsigned size = message.data.size();
+
+        Networking_Sockets_Batched_Data *entry = batch[reliable].add_batch();
+        entry->mutable_data()->swap(message.data);
+        entry->set_message_number(message.message_number);
+        entry->set_lane(lane_index);
+
+        socket.lanes_virtual_time = lane.virtual_time;
+        //+1 so empty messages still cost something
+        lane.virtual_time += (double)(size + 1) / lane.weight;
+        lane.pending_bytes[reliable] -= size;
+        lane.queue.pop_front();
+
+        batch_bytes[reliable] += size;
+        //peers that don't know about batches would drop them, they get every message on its own
+        if (!socket.peer_batching || batch_bytes[reliable] >= (reliable ? MAX_BATCH_BYTES_RELIABLE : MAX_BATCH_BYTES_UNRELIABLE)) {
+            if (!send_batch(connect_socket, batch[reliable], reliable)) {
+                sent = false;
+                if (reliable) {
+                    requeue_batch(socket, batch[reliable]);
+                    break;
+                }
+            }
+
+            batch[reliable].clear_batch();
+            batch_bytes[reliable] = 0;
+        }
+    }
+
+    for (int reliable = 0; reliable < 2; ++reliable) {
+        if (batch[reliable].batch_size() && !send_batch(connect_socket, batch[reliable], reliable)) {
+            sent = false;
+            if (reliable) requeue_batch(socket, batch[reliable]);
+        }
+    }
+
+    //what is left when the transport refused a reliable batch
+    socket.send_pending_bytes[0] = socket.send_pending_bytes[1] = 0;
+    for (auto &lane : socket.lanes) {
+        socket.send_pending_bytes[0] += lane.pending_bytes[0];
+        socket.send_pending_bytes[1] += lane.pending_bytes[1];
+    }
+
+    return sent;
+}
+
+//makes room for reliable messages when the send buffer is full
+void drop_unreliable_messages(struct Connect_Socket &socket)
+{
+    for (auto &lane : socket.lanes) {
+        if (!lane.pending_bytes[0]) continue;
+        for (auto message = lane.queue.begin(); message != lane.queue.end();) {
+            if (message->reliable) {
+                ++message;
+                continue;
+            }
+
+            lane.pending_bytes[0] -= message->data.size();
+            socket.send_pending_bytes[0] -= message->data.size();
+            message = lane.queue.erase(message);
+        }
+    }
+}
+
+//data gets moved into the outgoing message
+EResult send_message_to_connection(HSteamNetConnection hConn, std::string &data, int nSendFlags, uint16 lane_index, int64 *pOutMessageNumber)
+{
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+
+    auto connect_socket = s->connect_sockets.find(hConn);
+    if (connect_socket == s->connect_sockets.end()) return k_EResultInvalidParam;
+    if (connect_socket->second.status == CONNECT_SOCKET_CLOSED) return k_EResultNoConnection;
+    if (connect_socket->second.status == CONNECT_SOCKET_TIMEDOUT) return k_EResultNoConnection;
+    if (connect_socket->second.status != CONNECT_SOCKET_CONNECTED && connect_socket->second.status != CONNECT_SOCKET_CONNECTING) return k_EResultInvalidState;
+
+    struct Connect_Socket &socket = connect_socket->second;
+    if (lane_index >= socket.lanes.size()) return k_EResultInvalidParam;
+
+    struct Connection_Lane &lane = socket.lanes[lane_index];
     bool reliable = false;
     if (nSendFlags & k_nSteamNetworkingSend_Reliable) reliable = true;
-    if (network->sendTo(&msg, reliable)) {
-        if (pOutMessageNumber) *pOutMessageNumber = message_number;
-        return k_EResultOK;
+
+    //a message bigger than the whole buffer still goes through if nothing else is waiting
+    struct Connection_Stats stats;
+    network->getStats(socket.remote_identity.GetSteamID(), &stats);
+    uint64 send_buffer_size = std::max(get_config_value(socket, k_ESteamNetworkingConfig_SendBufferSize, SEND_BUFFER_SIZE_DEFAULT), 0);
+    uint64 queued = (uint64)socket.send_pending_bytes[0] + socket.send_pending_bytes[1] + stats.pending_reliable;
+    if (queued && queued + data.size() > send_buffer_size) {
+        if (reliable && socket.send_pending_bytes[0]) {
+            queued -= socket.send_pending_bytes[0];
+            drop_unreliable_messages(socket);
+        }
+
+        if (queued && queued + data.size() > send_buffer_size) {
+            PRINT_DEBUG("Steam_Networking_Sockets: send buffer full %u %llu\n", hConn, queued);
+            return k_EResultLimitExceeded;
+        }
     }
 
-    return k_EResultFail;
+    uint64 message_number = lane.send_counter;
+    lane.send_counter += 1;
+
+    auto now = std::chrono::steady_clock::now();
+    if (next_send_lane(socket) < 0) {
+        socket.send_batch_time = now;
+        wake_background_thread();
+    }
+
+    //an idle lane doesn't save up credits
+    if (lane.queue.empty() && lane.virtual_time < socket.lanes_virtual_time) {
+        lane.virtual_time = socket.lanes_virtual_time;
+    }
+
+    Lane_Message message;
+    message.data.swap(data);
+    message.message_number = message_number;
+    message.reliable = reliable;
+    message.queued = now;
+    lane.pending_bytes[reliable] += message.data.size();
+    socket.send_pending_bytes[reliable] += message.data.size();
+    lane.queue.push_back(std::move(message));
+
+    unsigned max_batch_bytes = reliable ? MAX_BATCH_BYTES_RELIABLE : MAX_BATCH_BYTES_UNRELIABLE;
+    if ((nSendFlags & (k_nSteamNetworkingSend_NoNagle | k_nSteamNetworkingSend_NoDelay)) || socket.send_pending_bytes[reliable] >= max_batch_bytes || get_config_value(socket, k_ESteamNetworkingConfig_NagleTime, NAGLE_TIME_DEFAULT) <= 0) {
+        //a reliable message the transport can't take yet stays queued and is retried, so it still counts as sent
+        flush_connection(connect_socket);
+    }
+
+    if (pOutMessageNumber) *pOutMessageNumber = message_number;
+    return k_EResultOK;
+}
+
+EResult SendMessageToConnection( HSteamNetConnection hConn, const void *pData, uint32 cbData, int nSendFlags, int64 *pOutMessageNumber )
+{
+    PRINT_DEBUG("Steam_Networking_Sockets::SendMessageToConnection %u, len %u, flags %i\n", hConn, cbData, nSendFlags);
+    std::string data((const char *)pData, cbData);
+    return send_message_to_connection(hConn, data, nSendFlags, 0, pOutMessageNumber);
 }
 
 EResult SendMessageToConnection( HSteamNetConnection hConn, const void *pData, uint32 cbData, int nSendFlags )
@@ -820,8 +1095,14 @@ void SendMessages( int nMessages, SteamNetworkingMessage_t *const *pMessages, in
 {
     PRINT_DEBUG("Steam_Networking_Sockets::SendMessages\n");
     for (int i = 0; i < nMessages; ++i) {
+        //messages from AllocateMessage hand their buffer over without a copy
+        std::string data;
+        if (!Steam_Message_Pool::take_payload(pMessages[i], data)) {
+            data.assign((const char *)pMessages[i]->m_pData, pMessages[i]->m_cbSize);
+        }
+
         int64 out_number = 0;
-        int result = SendMessageToConnection(pMessages[i]->m_conn, pMessages[i]->m_pData, pMessages[i]->m_cbSize, pMessages[i]->m_nFlags, &out_number);
+        int result = send_message_to_connection(pMessages[i]->m_conn, data, pMessages[i]->m_nFlags, pMessages[i]->m_idxLane, &out_number);
         if (pOutMessageNumberOrResult) {
             if (result == k_EResultOK) {
                 pOutMessageNumberOrResult[i] = out_number;
@@ -830,7 +1111,6 @@ void SendMessages( int nMessages, SteamNetworkingMessage_t *const *pMessages, in
             }
         }
 
-        pMessages[i]->m_pfnFreeData(pMessages[i]);
         pMessages[i]->Release();
     }
 }
@@ -845,42 +1125,103 @@ void SendMessages( int nMessages, SteamNetworkingMessage_t *const *pMessages, in
 EResult FlushMessagesOnConnection( HSteamNetConnection hConn )
 {
     PRINT_DEBUG("Steam_Networking_Sockets::FlushMessagesOnConnection\n");
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    auto connect_socket = s->connect_sockets.find(hConn);
+    if (connect_socket == s->connect_sockets.end()) return k_EResultInvalidParam;
+
+    if (!flush_connection(connect_socket)) return k_EResultFail;
     return k_EResultOK;
 }
 
-static void free_steam_message_data(SteamNetworkingMessage_t *pMsg)
+void push_connection_messages(std::map<HSteamNetConnection, struct Connect_Socket>::iterator connect_socket, Networking_Sockets const& data)
+{
+    if (!data.batch_size()) {
+        push_connection_data(connect_socket, data);
+        return;
+    }
+
+    for (auto &entry : data.batch()) {
+        Networking_Sockets message;
+        message.set_type(Networking_Sockets::DATA);
+        message.set_data(entry.data());
+        message.set_message_number(entry.message_number());
+        message.set_lane(entry.lane());
+        push_connection_data(connect_socket, message);
+    }
+}
+
+void push_connection_data(std::map<HSteamNetConnection, struct Connect_Socket>::iterator connect_socket, Networking_Sockets const& data)
 {
-    free(pMsg->m_pData);
-    pMsg->m_pData = NULL;
+    struct Connect_Socket &socket = connect_socket->second;
+    if (data.lane() >= MAX_CONNECTION_LANES) return;
+    if (data.lane() >= socket.data.size()) socket.data.resize(data.lane() + 1);
+    socket.data[data.lane()].push(data);
+    socket.data_order.push_back(data.lane());
+
+    if (socket.listen_socket_id != k_HSteamListenSocket_Invalid && !socket.ready_listen_socket) {
+        s->ready_listen_sockets[socket.listen_socket_id].push_back(connect_socket->first);
+        socket.ready_listen_socket = true;
+    }
+
+    if (socket.poll_group != k_HSteamNetPollGroup_Invalid && !socket.ready_poll_group) {
+        s->ready_poll_groups[socket.poll_group].push_back(connect_socket->first);
+        socket.ready_poll_group = true;
+    }
 }
 
-static void delete_steam_message(SteamNetworkingMessage_t *pMsg)
+//entries on a ready list are only hints, connections that were closed, moved or drained by ReceiveMessagesOnConnection get skipped
+int get_steam_messages_ready_list(std::deque<HSteamNetConnection> &ready, bool poll_group, uint32 id, SteamNetworkingMessage_t **ppOutMessages, int nMaxMessages)
 {
-    if (pMsg->m_pfnFreeData) pMsg->m_pfnFreeData(pMsg);
-    delete pMsg;
+    SteamNetworkingMessage_t *msg = NULL;
+    int messages = 0;
+
+    while (!ready.empty() && messages < nMaxMessages) {
+        auto connect_socket = s->connect_sockets.find(ready.front());
+        if (connect_socket == s->connect_sockets.end() || (poll_group ? connect_socket->second.poll_group : connect_socket->second.listen_socket_id) != id) {
+            ready.pop_front();
+            continue;
+        }
+
+        while (messages < nMaxMessages && (msg = get_steam_message_connection(connect_socket->first))) {
+            ppOutMessages[messages] = msg;
+            ++messages;
+        }
+
+        if (connect_socket->second.data_order.empty()) {
+            if (poll_group) {
+                connect_socket->second.ready_poll_group = false;
+            } else {
+                connect_socket->second.ready_listen_socket = false;
+            }
+
+            ready.pop_front();
+        }
+    }
+
+    return messages;
 }
 
 SteamNetworkingMessage_t *get_steam_message_connection(HSteamNetConnection hConn)
 {
     auto connect_socket = s->connect_sockets.find(hConn);
     if (connect_socket == s->connect_sockets.end()) return NULL;
-    if (connect_socket->second.data.empty()) return NULL;
-    SteamNetworkingMessage_t *pMsg = new SteamNetworkingMessage_t();
-    unsigned long size = connect_socket->second.data.top().data().size();
-    pMsg->m_pData = malloc(size);
-    pMsg->m_cbSize = size;
-    memcpy(pMsg->m_pData, connect_socket->second.data.top().data().data(), size);
+    if (connect_socket->second.data_order.empty()) return NULL;
+    uint32 lane = connect_socket->second.data_order.front();
+    auto &lane_data = connect_socket->second.data[lane];
+    //the payload only gets swapped out of the top element which is popped right after so the heap order isn't affected
+    Networking_Sockets &top = const_cast<Networking_Sockets &>(lane_data.top());
+    SteamNetworkingMessage_t *pMsg = Steam_Message_Pool::adopt(*top.mutable_data());
+    unsigned long size = pMsg->m_cbSize;
     pMsg->m_conn = hConn;
     pMsg->m_identityPeer = connect_socket->second.remote_identity;
     pMsg->m_nConnUserData = connect_socket->second.user_data;
     pMsg->m_usecTimeReceived = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - created).count();
     //TODO: check where messagenumber starts
-    pMsg->m_nMessageNumber = connect_socket->second.data.top().message_number();
-
-    pMsg->m_pfnFreeData = &free_steam_message_data;
-    pMsg->m_pfnRelease = &delete_steam_message;
+    pMsg->m_nMessageNumber = top.message_number();
     pMsg->m_nChannel = 0;
-    connect_socket->second.data.pop();
+    pMsg->m_idxLane = lane;
+    lane_data.pop();
+    connect_socket->second.data_order.pop_front();
     PRINT_DEBUG("get_steam_message_connection %u %u, %u\n", hConn, size, pMsg->m_nMessageNumber);
     return pMsg;
 }
@@ -931,22 +1272,10 @@ int ReceiveMessagesOnListenSocket( HSteamListenSocket hSocket, SteamNetworkingMe
     if (!ppOutMessages || !nMaxMessages) return 0;
 
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    SteamNetworkingMessage_t *msg = NULL;
-    int messages = 0;
-
-    auto socket_conn = std::begin(s->connect_sockets);
-    while (socket_conn != std::end(s->connect_sockets) && messages < nMaxMessages) {
-        if (socket_conn->second.listen_socket_id == hSocket) {
-            while (messages < nMaxMessages && (msg = get_steam_message_connection(socket_conn->first))) {
-                ppOutMessages[messages] = msg;
-                ++messages;
-            }
-        }
+    auto ready = s->ready_listen_sockets.find(hSocket);
+    if (ready == s->ready_listen_sockets.end()) return 0;
 
-        ++socket_conn;
-    }
-
-    return messages;
+    return get_steam_messages_ready_list(ready->second, false, hSocket, ppOutMessages, nMaxMessages);
 }
 
 /// Returns basic information about the high-level state of the connection.
@@ -989,25 +1318,47 @@ EResult GetConnectionRealTimeStatus( HSteamNetConnection hConn, SteamNetConnecti
     auto connect_socket = s->connect_sockets.find(hConn);
     if (connect_socket == s->connect_sockets.end()) return k_EResultNoConnection;
 
+    auto now = std::chrono::steady_clock::now();
     if (pStatus) {
+        //connections to ourselves have no stats and are as good as it gets
+        struct Connection_Stats stats;
+        network->getStats(connect_socket->second.remote_identity.GetSteamID(), &stats);
+
+        SteamNetworkingMicroseconds queue_time = 0;
+        for (auto &lane : connect_socket->second.lanes) {
+            if (lane.queue.empty()) continue;
+            queue_time = std::max(queue_time, (SteamNetworkingMicroseconds)std::chrono::duration_cast<std::chrono::microseconds>(now - lane.queue.front().queued).count());
+        }
+
         pStatus->m_eState = convert_status(connect_socket->second.status);
-        pStatus->m_nPing = 10; //TODO: calculate real numbers?
-        pStatus->m_flConnectionQualityLocal = 1.0;
-        pStatus->m_flConnectionQualityRemote = 1.0;
-        //TODO: rest
-        pStatus->m_flOutPacketsPerSec = 0.0;
-        pStatus->m_flOutBytesPerSec = 0.0;
-        pStatus->m_flInPacketsPerSec = 0.0;
-        pStatus->m_flInBytesPerSec = 0.0;
+        pStatus->m_nPing = stats.rtt / 1000;
+        pStatus->m_flConnectionQualityLocal = stats.quality_local;
+        pStatus->m_flConnectionQualityRemote = stats.quality_remote;
+        pStatus->m_flOutPacketsPerSec = stats.out_packets_per_sec;
+        pStatus->m_flOutBytesPerSec = stats.out_bytes_per_sec;
+        pStatus->m_flInPacketsPerSec = stats.in_packets_per_sec;
+        pStatus->m_flInBytesPerSec = stats.in_bytes_per_sec;
+        pStatus->m_cbPendingUnreliable = connect_socket->second.send_pending_bytes[0];
+        pStatus->m_cbPendingReliable = connect_socket->second.send_pending_bytes[1] + stats.pending_reliable;
         pStatus->m_cbSentUnackedReliable = 0.0;
-        pStatus->m_usecQueueTime = 0.0;
+        pStatus->m_usecQueueTime = queue_time;
 
         //Note some games (volcanoids) might not allocate a struct the whole size of SteamNetworkingQuickConnectionStatus
         //keep this in mind in future interface updates
         //NOTE: need to implement GetQuickConnectionStatus seperately if this changes.
     }
 
-    //TODO: lanes
+    if (nLanes < 0 || nLanes > connect_socket->second.lanes.size() || (nLanes && !pLanes)) return k_EResultInvalidParam;
+
+    for (int i = 0; i < nLanes; ++i) {
+        struct Connection_Lane &lane = connect_socket->second.lanes[i];
+        pLanes[i].m_cbPendingUnreliable = lane.pending_bytes[0];
+        pLanes[i].m_cbPendingReliable = lane.pending_bytes[1];
+        pLanes[i].m_cbSentUnackedReliable = 0;
+        //how long the oldest queued message on the lane has been waiting
+        pLanes[i].m_usecQueueTime = lane.queue.empty() ? 0 : std::chrono::duration_cast<std::chrono::microseconds>(now - lane.queue.front().queued).count();
+    }
+
     return k_EResultOK;
 }
 
@@ -1078,8 +1429,32 @@ bool GetQuickConnectionStatus( HSteamNetConnection hConn, SteamNetworkingQuickCo
 /// >0 Your buffer was either nullptr, or it was too small and the text got truncated.  Try again with a buffer of at least N bytes.
 int GetDetailedConnectionStatus( HSteamNetConnection hConn, char *pszBuf, int cbBuf )
 {
-    PRINT_DEBUG("Steam_Networking_Sockets::GetDetailedConnectionStatus\n");
-    return -1;
+    PRINT_DEBUG("Steam_Networking_Sockets::GetDetailedConnectionStatus %u %p %i\n", hConn, pszBuf, cbBuf);
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    SteamNetConnectionRealTimeStatus_t status;
+    if (GetConnectionRealTimeStatus(hConn, &status, 0, NULL) != k_EResultOK) return -1;
+
+    auto connect_socket = s->connect_sockets.find(hConn);
+    std::ostringstream text;
+    text << "Connection " << hConn << " to " << connect_socket->second.remote_identity.GetSteamID64() << "\n";
+    text << "State: " << status.m_eState << "\n";
+    text << "Ping: " << status.m_nPing << "ms\n";
+    text << "Quality: local " << status.m_flConnectionQualityLocal * 100.0 << "% remote " << status.m_flConnectionQualityRemote * 100.0 << "%\n";
+    text << "Out: " << status.m_flOutPacketsPerSec << " pkts/s " << status.m_flOutBytesPerSec << " bytes/s\n";
+    text << "In: " << status.m_flInPacketsPerSec << " pkts/s " << status.m_flInBytesPerSec << " bytes/s\n";
+    text << "Pending: " << status.m_cbPendingUnreliable << " unreliable " << status.m_cbPendingReliable << " reliable bytes, queued for " << status.m_usecQueueTime << "us\n";
+    text << "Lanes: " << connect_socket->second.lanes.size() << "\n";
+
+    std::string out = text.str();
+    if (pszBuf && cbBuf > 0) {
+        int len = std::min((int)out.size(), cbBuf - 1);
+        memcpy(pszBuf, out.c_str(), len);
+        pszBuf[len] = 0;
+    }
+
+    //the size needed if it got truncated
+    if (!pszBuf || cbBuf < (int)out.size() + 1) return out.size() + 1;
+    return 0;
 }
 
 /// Returns local IP and port that a listen socket created using CreateListenSocketIP is bound to.
@@ -1240,11 +1615,29 @@ bool CreateSocketPair( HSteamNetConnection *pOutConnection1, HSteamNetConnection
 /// SteamNetworkingMessage_t::m_idxLane
 EResult ConfigureConnectionLanes( HSteamNetConnection hConn, int nNumLanes, const int *pLanePriorities, const uint16 *pLaneWeights )
 {
-    PRINT_DEBUG("TODO: %s\n", __FUNCTION__);
+    PRINT_DEBUG("%s %u %i %p %p\n", __FUNCTION__, hConn, nNumLanes, pLanePriorities, pLaneWeights);
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     auto connect_socket = s->connect_sockets.find(hConn);
     if (connect_socket == s->connect_sockets.end()) return k_EResultNoConnection;
-    //TODO
+    struct Connect_Socket &socket = connect_socket->second;
+    if (socket.status == CONNECT_SOCKET_CLOSED || socket.status == CONNECT_SOCKET_TIMEDOUT) return k_EResultInvalidState;
+    if (nNumLanes < 1 || nNumLanes > MAX_CONNECTION_LANES || nNumLanes < socket.lanes.size()) return k_EResultInvalidParam;
+    if (pLaneWeights) {
+        for (int i = 0; i < nNumLanes; ++i) {
+            if (!pLaneWeights[i]) return k_EResultInvalidParam;
+        }
+    }
+
+    socket.lanes.resize(nNumLanes);
+    socket.lanes_virtual_time = 0.0;
+    for (int i = 0; i < nNumLanes; ++i) {
+        struct Connection_Lane &lane = socket.lanes[i];
+        lane.priority = pLanePriorities ? pLanePriorities[i] : 0;
+        lane.weight = pLaneWeights ? pLaneWeights[i] : 1;
+        lane.virtual_time = 0.0;
+        if (!lane.send_counter) lane.send_counter = 1;
+    }
+
     return k_EResultOK;
 }
 
@@ -1341,6 +1734,7 @@ bool DestroyPollGroup( HSteamNetPollGroup hPollGroup )
     }
 
     s->poll_groups.erase(group);
+    s->ready_poll_groups.erase(hPollGroup);
     return true;
 }
 
@@ -1374,18 +1768,24 @@ bool SetConnectionPollGroup( HSteamNetConnection hConn, HSteamNetPollGroup hPoll
 
     HSteamNetPollGroup old_poll_group = connect_socket->second.poll_group;
     if (old_poll_group != k_HSteamNetPollGroup_Invalid) {
-        auto group = s->poll_groups.find(hPollGroup);
+        auto group = s->poll_groups.find(old_poll_group);
         if (group != s->poll_groups.end()) {
             group->second.remove(hConn);
         }
     }
 
     connect_socket->second.poll_group = hPollGroup;
+    connect_socket->second.ready_poll_group = false;
     if (hPollGroup == k_HSteamNetPollGroup_Invalid) {
         return true;
     }
 
     group->second.push_back(hConn);
+    if (!connect_socket->second.data_order.empty()) {
+        s->ready_poll_groups[hPollGroup].push_back(hConn);
+        connect_socket->second.ready_poll_group = true;
+    }
+
     return true;
 }
 
@@ -1413,14 +1813,10 @@ int ReceiveMessagesOnPollGroup( HSteamNetPollGroup hPollGroup, SteamNetworkingMe
         return 0;
     }
 
-    SteamNetworkingMessage_t *msg = NULL;
     int messages = 0;
-
-    for (auto c : group->second) {
-        while (messages < nMaxMessages && (msg = get_steam_message_connection(c))) {
-            ppOutMessages[messages] = msg;
-            ++messages;
-        }
+    auto ready = s->ready_poll_groups.find(hPollGroup);
+    if (ready != s->ready_poll_groups.end()) {
+        messages = get_steam_messages_ready_list(ready->second, true, hPollGroup, ppOutMessages, nMaxMessages);
     }
 
     PRINT_DEBUG("Steam_Networking_Sockets::ReceiveMessagesOnPollGroup out %i\n", messages);
@@ -2025,6 +2421,62 @@ void RunCallbacks()
 
         ++socket_conn;
     }
+
+    flush_nagle_timers();
+}
+
+//the background thread calls this too, so queued messages go out on time even when the game doesn't call RunCallbacks often
+void flush_nagle_timers()
+{
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    auto current_time = std::chrono::steady_clock::now();
+    for (auto socket_conn = s->connect_sockets.begin(); socket_conn != s->connect_sockets.end(); ++socket_conn) {
+        if (next_send_lane(socket_conn->second) < 0) continue;
+
+        int32 nagle_time = get_config_value(socket_conn->second, k_ESteamNetworkingConfig_NagleTime, NAGLE_TIME_DEFAULT);
+        if (std::chrono::duration_cast<std::chrono::microseconds>(current_time - socket_conn->second.send_batch_time).count() >= nagle_time) {
+            flush_connection(socket_conn);
+        }
+    }
+}
+
+//when the first nagle timer runs out, returns false if nothing is waiting for one
+bool next_nagle_flush(std::chrono::steady_clock::time_point *when)
+{
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    bool waiting = false;
+    for (auto &socket_conn : s->connect_sockets) {
+        if (next_send_lane(socket_conn.second) < 0) continue;
+
+        int32 nagle_time = get_config_value(socket_conn.second, k_ESteamNetworkingConfig_NagleTime, NAGLE_TIME_DEFAULT);
+        auto flush_time = socket_conn.second.send_batch_time + std::chrono::microseconds(std::max(nagle_time, 0));
+        if (!waiting || flush_time < *when) *when = flush_time;
+        waiting = true;
+    }
+
+    return waiting;
+}
+
+//blocks until the first nagle timer runs out, a new one starts or timeout passes
+void wait_nagle_timer(std::chrono::steady_clock::duration timeout)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout, flush_time;
+    if (next_nagle_flush(&flush_time) && flush_time < deadline) deadline = flush_time;
+
+    //a timer that started since next_nagle_flush left background_wake set so it doesn't get missed
+    std::unique_lock<std::mutex> lck(s->background_mutex);
+    s->background_cv.wait_until(lck, deadline, [this]() { return s->background_wake; });
+    s->background_wake = false;
+}
+
+void wake_background_thread()
+{
+    {
+        std::lock_guard<std::mutex> lck(s->background_mutex);
+        s->background_wake = true;
+    }
+
+    s->background_cv.notify_all();
 }
 
 
@@ -2065,6 +2517,7 @@ void Callback(Common_Message *msg)
                     SteamNetworkingIdentity identity;
                     identity.SetSteamID64(msg->source_id());
                     HSteamNetConnection new_connection = new_connect_socket(identity, virtual_port, real_port, CONNECT_SOCKET_NOT_ACCEPTED, conn->socket_id, msg->networking_sockets().connection_id_from());
+                    s->connect_sockets[new_connection].peer_batching = msg->networking_sockets().batching();
                     launch_callback(new_connection, CONNECT_SOCKET_NO_CONNECTION);
                 }
             }
@@ -2078,6 +2531,7 @@ void Callback(Common_Message *msg)
 
                 if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && connect_socket->second.status == CONNECT_SOCKET_CONNECTING) {
                     connect_socket->second.remote_id = msg->networking_sockets().connection_id_from();
+                    connect_socket->second.peer_batching = msg->networking_sockets().batching();
                     connect_socket->second.status = CONNECT_SOCKET_CONNECTED;
                     launch_callback(connect_socket->first, CONNECT_SOCKET_CONNECTING);
                 }
@@ -2087,13 +2541,13 @@ void Callback(Common_Message *msg)
             if (connect_socket != s->connect_sockets.end()) {
                 if (connect_socket->second.remote_identity.GetSteamID64() == msg->source_id() && (connect_socket->second.status == CONNECT_SOCKET_CONNECTED)) {
                     PRINT_DEBUG("Steam_Networking_Sockets: got data len %u, num %u on connection %u\n", msg->networking_sockets().data().size(), msg->networking_sockets().message_number(), connect_socket->first);
-                    connect_socket->second.data.push(msg->networking_sockets());
+                    push_connection_messages(connect_socket, msg->networking_sockets());
                 }
             } else {
                 connect_socket = std::find_if(s->connect_sockets.begin(), s->connect_sockets.end(), [msg](const auto &in) {return in.second.remote_identity.GetSteamID64() == msg->source_id() && (in.second.status == CONNECT_SOCKET_NOT_ACCEPTED || in.second.status == CONNECT_SOCKET_CONNECTED) && in.second.remote_id == msg->networking_sockets().connection_id_from();});
                 if (connect_socket != s->connect_sockets.end()) {
                     PRINT_DEBUG("Steam_Networking_Sockets: got data len %u, num %u on not accepted connection %u\n", msg->networking_sockets().data().size(), msg->networking_sockets().message_number(), connect_socket->first);
-                    connect_socket->second.data.push(msg->networking_sockets());
+                    push_connection_messages(connect_socket, msg->networking_sockets());
                 }
             }
         } else if (msg->networking_sockets().type() == Networking_Sockets::CONNECTION_END) {
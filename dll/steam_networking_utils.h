@@ -16,6 +16,17 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "message_pool.h"
+
+//there are no data centers so a ping location is the steam id of its owner and the round trip times it measured to some of its peers
+#define PING_LOCATION_MAGIC 0x4C504247
+#define PING_LOCATION_MAX_PEERS 16
+
+struct Ping_Location {
+    uint64 owner;
+    //peer steam id, round trip time in ms
+    std::vector<std::pair<uint64, int>> peers;
+};
 
 class Steam_Networking_Utils :
 public ISteamNetworkingUtils001,
@@ -28,6 +39,7 @@ public ISteamNetworkingUtils
     class SteamCallResults *callback_results;
     class SteamCallBacks *callbacks;
     class RunEveryRunCB *run_every_runcb;
+    struct shared_between_client_server *sbcs;
     std::chrono::time_point<std::chrono::steady_clock> initialized_time = std::chrono::steady_clock::now();
     FSteamNetworkingSocketsDebugOutput debug_function;
     bool relay_initialized = false;
@@ -50,11 +62,12 @@ static void steam_run_every_runcb(void *object)
     steam_networkingutils->RunCallbacks();
 }
 
-Steam_Networking_Utils(class Settings *settings, class Networking *network, class SteamCallResults *callback_results, class SteamCallBacks *callbacks, class RunEveryRunCB *run_every_runcb)
+Steam_Networking_Utils(class Settings *settings, class Networking *network, class SteamCallResults *callback_results, class SteamCallBacks *callbacks, class RunEveryRunCB *run_every_runcb, struct shared_between_client_server *sbcs)
 {
     this->settings = settings;
     this->network = network;
     this->run_every_runcb = run_every_runcb;
+    this->sbcs = sbcs;
     //this->network->setCallback(CALLBACK_ID_USER_STATUS, settings->get_local_steam_id(), &Steam_Networking_Utils::steam_callback, this);
     this->run_every_runcb->add(&Steam_Networking_Utils::steam_run_every_runcb, this);
 
@@ -68,16 +81,79 @@ Steam_Networking_Utils(class Settings *settings, class Networking *network, clas
     this->run_every_runcb->remove(&Steam_Networking_Utils::steam_run_every_runcb, this);
 }
 
-static void free_steam_message_data(SteamNetworkingMessage_t *pMsg)
+static bool is_impairment_config(ESteamNetworkingConfigValue eValue)
+{
+    switch (eValue) {
+        case k_ESteamNetworkingConfig_FakePacketLoss_Send:
+        case k_ESteamNetworkingConfig_FakePacketLoss_Recv:
+        case k_ESteamNetworkingConfig_FakePacketLag_Send:
+        case k_ESteamNetworkingConfig_FakePacketLag_Recv:
+        case k_ESteamNetworkingConfig_FakePacketReorder_Send:
+        case k_ESteamNetworkingConfig_FakePacketReorder_Recv:
+        case k_ESteamNetworkingConfig_FakePacketReorder_Time:
+        case k_ESteamNetworkingConfig_FakePacketDup_Send:
+        case k_ESteamNetworkingConfig_FakePacketDup_Recv:
+        case k_ESteamNetworkingConfig_FakePacketDup_TimeMax:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void apply_impairment_config(struct Network_Impairment &impairment, std::map<ESteamNetworkingConfigValue, int32> const& config, std::map<ESteamNetworkingConfigValue, float> const& config_float)
+{
+    for (auto &value : config) {
+        if (value.first == k_ESteamNetworkingConfig_FakePacketLag_Send) impairment.lag_send = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketLag_Recv) impairment.lag_recv = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketReorder_Time) impairment.reorder_time = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketDup_TimeMax) impairment.dup_time_max = value.second;
+    }
+
+    for (auto &value : config_float) {
+        if (value.first == k_ESteamNetworkingConfig_FakePacketLoss_Send) impairment.loss_send = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketLoss_Recv) impairment.loss_recv = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketReorder_Send) impairment.reorder_send = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketReorder_Recv) impairment.reorder_recv = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketDup_Send) impairment.dup_send = value.second;
+        if (value.first == k_ESteamNetworkingConfig_FakePacketDup_Recv) impairment.dup_recv = value.second;
+    }
+}
+
+//the values in steam_settings are the defaults, global config goes on top of them and connection config on top of that
+struct Network_Impairment global_impairment()
 {
-    free(pMsg->m_pData);
-    pMsg->m_pData = NULL;
+    struct Network_Impairment impairment = settings->network_impairment;
+    apply_impairment_config(impairment, sbcs->config, sbcs->config_float);
+    return impairment;
 }
 
-static void delete_steam_message(SteamNetworkingMessage_t *pMsg)
+void update_impairment(std::map<HSteamNetConnection, struct Connect_Socket>::iterator connect_socket)
 {
-    if (pMsg->m_pfnFreeData) pMsg->m_pfnFreeData(pMsg);
-    delete pMsg;
+    if (connect_socket == sbcs->connect_sockets.end()) return;
+
+    struct Network_Impairment impairment = global_impairment();
+    apply_impairment_config(impairment, connect_socket->second.config, connect_socket->second.config_float);
+    network->setImpairment(impairment, connect_socket->second.remote_identity.GetSteamID());
+}
+
+void update_impairment()
+{
+    network->setImpairment(global_impairment());
+    for (auto connect_socket = sbcs->connect_sockets.begin(); connect_socket != sbcs->connect_sockets.end(); ++connect_socket) {
+        for (auto &value : connect_socket->second.config) {
+            if (is_impairment_config(value.first)) {
+                update_impairment(connect_socket);
+                break;
+            }
+        }
+
+        for (auto &value : connect_socket->second.config_float) {
+            if (is_impairment_config(value.first)) {
+                update_impairment(connect_socket);
+                break;
+            }
+        }
+    }
 }
 
 /// Allocate and initialize a message object.  Usually the reason
@@ -102,17 +178,7 @@ static void delete_steam_message(SteamNetworkingMessage_t *pMsg)
 SteamNetworkingMessage_t *AllocateMessage( int cbAllocateBuffer )
 {
     PRINT_DEBUG("Steam_Networking_Utils::AllocateMessage\n");
-    SteamNetworkingMessage_t *pMsg = new SteamNetworkingMessage_t();
-    pMsg->m_pfnFreeData = &free_steam_message_data;
-    pMsg->m_pfnRelease = &delete_steam_message;
-    if (cbAllocateBuffer < 0)
-        cbAllocateBuffer = 0;
-
-    if (cbAllocateBuffer)
-        pMsg->m_pData = malloc(cbAllocateBuffer);
-
-    pMsg->m_cbSize = cbAllocateBuffer;
-    return pMsg;
+    return Steam_Message_Pool::allocate(cbAllocateBuffer);
 }
 
 bool InitializeRelayAccess()
@@ -159,13 +225,98 @@ ESteamNetworkingAvailability GetRelayNetworkStatus( SteamRelayNetworkStatus_t *p
     return k_ESteamNetworkingAvailability_Current;
 }
 
+//max_peers is how many of the closest peers are kept, the encoded location only has room for PING_LOCATION_MAX_PEERS
+struct Ping_Location local_ping_location(double *age, size_t max_peers = PING_LOCATION_MAX_PEERS)
+{
+    struct Ping_Location location;
+    location.owner = settings->get_local_steam_id().ConvertToUint64();
+
+    std::map<uint64, uint64> rtts = network->getPeerRTTs(age);
+    for (auto &rtt : rtts) {
+        if (rtt.first == location.owner) continue;
+        location.peers.push_back(std::make_pair(rtt.first, (int)((rtt.second + 500) / 1000)));
+    }
+
+    //the closest peers are the most useful ones to compare with
+    std::sort(location.peers.begin(), location.peers.end(), [](std::pair<uint64, int> const& a, std::pair<uint64, int> const& b) { return a.second < b.second; });
+    if (location.peers.size() > max_peers) location.peers.resize(max_peers);
+    return location;
+}
+
+static void write_ping_location(struct Ping_Location const& location, SteamNetworkPingLocation_t &result)
+{
+    memset(result.m_data, 0, sizeof(result.m_data));
+    uint32 magic = PING_LOCATION_MAGIC, count = location.peers.size();
+    unsigned char *data = result.m_data;
+    memcpy(data, &magic, sizeof(magic)); data += sizeof(magic);
+    memcpy(data, &location.owner, sizeof(location.owner)); data += sizeof(location.owner);
+    memcpy(data, &count, sizeof(count)); data += sizeof(count);
+    for (auto &peer : location.peers) {
+        int32 rtt = peer.second;
+        memcpy(data, &peer.first, sizeof(peer.first)); data += sizeof(peer.first);
+        memcpy(data, &rtt, sizeof(rtt)); data += sizeof(rtt);
+    }
+}
+
+static bool read_ping_location(SteamNetworkPingLocation_t const& location, struct Ping_Location &result)
+{
+    uint32 magic, count;
+    const unsigned char *data = location.m_data;
+    memcpy(&magic, data, sizeof(magic)); data += sizeof(magic);
+    if (magic != PING_LOCATION_MAGIC) return false;
+    memcpy(&result.owner, data, sizeof(result.owner)); data += sizeof(result.owner);
+    memcpy(&count, data, sizeof(count)); data += sizeof(count);
+    if (count > PING_LOCATION_MAX_PEERS) return false;
+
+    result.peers.clear();
+    for (uint32 i = 0; i < count; ++i) {
+        uint64 id;
+        int32 rtt;
+        memcpy(&id, data, sizeof(id)); data += sizeof(id);
+        memcpy(&rtt, data, sizeof(rtt)); data += sizeof(rtt);
+        result.peers.push_back(std::make_pair(id, (int)rtt));
+    }
+
+    return true;
+}
+
+static int estimate_ping(struct Ping_Location const& location1, struct Ping_Location const& location2)
+{
+    if (location1.owner == location2.owner) return 0;
+
+    //a direct measurement from either side beats anything else
+    int direct = k_nSteamNetworkingPing_Unknown;
+    for (auto &peer : location1.peers) {
+        if (peer.first == location2.owner) direct = peer.second;
+    }
+
+    for (auto &peer : location2.peers) {
+        if (peer.first == location1.owner) direct = direct >= 0 ? (direct + peer.second) / 2 : peer.second;
+    }
+
+    if (direct >= 0) return direct;
+
+    //otherwise route through the peer they both know that gives the shortest trip
+    int routed = k_nSteamNetworkingPing_Unknown;
+    for (auto &peer1 : location1.peers) {
+        for (auto &peer2 : location2.peers) {
+            if (peer1.first != peer2.first) continue;
+            int ping = peer1.second + peer2.second;
+            if (routed < 0 || ping < routed) routed = ping;
+        }
+    }
+
+    return routed;
+}
+
 float GetLocalPingLocation( SteamNetworkPingLocation_t &result )
 {
     PRINT_DEBUG("Steam_Networking_Utils::GetLocalPingLocation\n");
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
     if (relay_initialized) {
-        result.m_data[2] = 123;
-        result.m_data[8] = 67;
-        return 2.0;
+        double age;
+        write_ping_location(local_ping_location(&age), result);
+        return age;
     }
 
     return -1;
@@ -174,28 +325,76 @@ float GetLocalPingLocation( SteamNetworkPingLocation_t &result )
 int EstimatePingTimeBetweenTwoLocations( const SteamNetworkPingLocation_t &location1, const SteamNetworkPingLocation_t &location2 )
 {
     PRINT_DEBUG("Steam_Networking_Utils::EstimatePingTimeBetweenTwoLocations\n");
-    //return k_nSteamNetworkingPing_Unknown;
-    return 10;
+    struct Ping_Location ping_location1, ping_location2;
+    if (!read_ping_location(location1, ping_location1) || !read_ping_location(location2, ping_location2)) return k_nSteamNetworkingPing_Failed;
+
+    return estimate_ping(ping_location1, ping_location2);
 }
 
 
 int EstimatePingTimeFromLocalHost( const SteamNetworkPingLocation_t &remoteLocation )
 {
     PRINT_DEBUG("Steam_Networking_Utils::EstimatePingTimeFromLocalHost\n");
-    return 10;
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    struct Ping_Location remote;
+    if (!read_ping_location(remoteLocation, remote)) return k_nSteamNetworkingPing_Failed;
+
+    //we might have measured the owner directly even if they aren't one of our closest peers
+    std::map<uint64, uint64> rtts = network->getPeerRTTs(NULL);
+    auto rtt = rtts.find(remote.owner);
+    if (rtt != rtts.end()) return (rtt->second + 500) / 1000;
+
+    //nothing is being encoded so every peer we know can be used to route through
+    return estimate_ping(local_ping_location(NULL, rtts.size()), remote);
 }
 
 
 void ConvertPingLocationToString( const SteamNetworkPingLocation_t &location, char *pszBuf, int cchBufSize )
 {
     PRINT_DEBUG("Steam_Networking_Utils::ConvertPingLocationToString\n");
-    strncpy(pszBuf, "fra=10+2", cchBufSize);
+    if (!pszBuf || cchBufSize <= 0) return;
+
+    //ex: 76561197960287930/76561197960265729=2,76561197960265730=15
+    struct Ping_Location ping_location;
+    std::string text;
+    if (read_ping_location(location, ping_location)) {
+        text = std::to_string(ping_location.owner) + "/";
+        for (auto &peer : ping_location.peers) {
+            if (text.back() != '/') text += ",";
+            text += std::to_string(peer.first) + "=" + std::to_string(peer.second);
+        }
+    }
+
+    strncpy(pszBuf, text.c_str(), cchBufSize);
+    pszBuf[cchBufSize - 1] = 0;
 }
 
 
 bool ParsePingLocationString( const char *pszString, SteamNetworkPingLocation_t &result )
 {
     PRINT_DEBUG("Steam_Networking_Utils::ParsePingLocationString\n");
+    if (!pszString) return false;
+
+    std::string text(pszString);
+    std::size_t owner_end = text.find("/");
+    if (owner_end == std::string::npos) return false;
+
+    struct Ping_Location ping_location;
+    try {
+        ping_location.owner = std::stoull(text.substr(0, owner_end));
+        std::stringstream peers(text.substr(owner_end + 1));
+        std::string peer;
+        while (std::getline(peers, peer, ',')) {
+            std::size_t deliminator = peer.find("=");
+            if (deliminator == std::string::npos) return false;
+            if (ping_location.peers.size() >= PING_LOCATION_MAX_PEERS) return false;
+            ping_location.peers.push_back(std::make_pair((uint64)std::stoull(peer.substr(0, deliminator)), std::stoi(peer.substr(deliminator + 1))));
+        }
+    } catch (...) {
+        return false;
+    }
+
+    write_ping_location(ping_location, result);
     return true;
 }
 
@@ -359,6 +558,42 @@ bool SetConfigValue( ESteamNetworkingConfigValue eValue, ESteamNetworkingConfigS
     ESteamNetworkingConfigDataType eDataType, const void *pArg )
 {
     PRINT_DEBUG("Steam_Networking_Utils::SetConfigValue %i %i %p %i %p\n", eValue, eScopeType, scopeObj, eDataType, pArg);
+    //only int32 and float values are used by the emulator, the rest are accepted and ignored
+    if (eDataType != k_ESteamNetworkingConfig_Int32 && eDataType != k_ESteamNetworkingConfig_Float) return true;
+
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    std::map<ESteamNetworkingConfigValue, int32> *config = NULL;
+    std::map<ESteamNetworkingConfigValue, float> *config_float = NULL;
+    if (eScopeType == k_ESteamNetworkingConfig_Global) {
+        config = &sbcs->config;
+        config_float = &sbcs->config_float;
+    } else if (eScopeType == k_ESteamNetworkingConfig_Connection) {
+        auto connect_socket = sbcs->connect_sockets.find(scopeObj);
+        if (connect_socket == sbcs->connect_sockets.end()) return false;
+        config = &connect_socket->second.config;
+        config_float = &connect_socket->second.config_float;
+    } else {
+        return true;
+    }
+
+    config->erase(eValue);
+    config_float->erase(eValue);
+    if (pArg) {
+        if (eDataType == k_ESteamNetworkingConfig_Int32) {
+            (*config)[eValue] = *(int32 *)pArg;
+        } else {
+            (*config_float)[eValue] = *(float *)pArg;
+        }
+    }
+
+    if (is_impairment_config(eValue)) {
+        if (eScopeType == k_ESteamNetworkingConfig_Global) {
+            update_impairment();
+        } else {
+            update_impairment(sbcs->connect_sockets.find(scopeObj));
+        }
+    }
+
     return true;
 }
 
@@ -374,7 +609,46 @@ ESteamNetworkingGetConfigValueResult GetConfigValue( ESteamNetworkingConfigValue
     ESteamNetworkingConfigDataType *pOutDataType, void *pResult, size_t *cbResult )
 {
     PRINT_DEBUG("Steam_Networking_Utils::GetConfigValue\n");
-    return k_ESteamNetworkingGetConfigValue_BadValue;
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    ESteamNetworkingGetConfigValueResult result = k_ESteamNetworkingGetConfigValue_OK;
+    std::map<ESteamNetworkingConfigValue, int32> *config = &sbcs->config;
+    std::map<ESteamNetworkingConfigValue, float> *config_float = &sbcs->config_float;
+    if (eScopeType == k_ESteamNetworkingConfig_Connection) {
+        auto connect_socket = sbcs->connect_sockets.find(scopeObj);
+        if (connect_socket != sbcs->connect_sockets.end() && (connect_socket->second.config.count(eValue) || connect_socket->second.config_float.count(eValue))) {
+            config = &connect_socket->second.config;
+            config_float = &connect_socket->second.config_float;
+        } else {
+            result = k_ESteamNetworkingGetConfigValue_OKInherited;
+        }
+    }
+
+    if (!cbResult) return k_ESteamNetworkingGetConfigValue_BadValue;
+    auto value = config->find(eValue);
+    if (value != config->end()) {
+        if (pOutDataType) *pOutDataType = k_ESteamNetworkingConfig_Int32;
+        if (!pResult || *cbResult < sizeof(int32)) {
+            *cbResult = sizeof(int32);
+            return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+        }
+
+        *(int32 *)pResult = value->second;
+        *cbResult = sizeof(int32);
+        return result;
+    }
+
+    auto value_float = config_float->find(eValue);
+    if (value_float == config_float->end()) return k_ESteamNetworkingGetConfigValue_BadValue;
+
+    if (pOutDataType) *pOutDataType = k_ESteamNetworkingConfig_Float;
+    if (!pResult || *cbResult < sizeof(float)) {
+        *cbResult = sizeof(float);
+        return k_ESteamNetworkingGetConfigValue_BufferTooSmall;
+    }
+
+    *(float *)pResult = value_float->second;
+    *cbResult = sizeof(float);
+    return result;
 }
 
 
@@ -16,13 +16,15 @@
    <http://www.gnu.org/licenses/>.  */
 
 #include "base.h"
+#include "storage_io.h"
 
 struct Async_Read {
 	SteamAPICall_t api_call;
 	uint32 offset;
 	uint32 to_read;
-	uint32 size;
 	std::string file_name;
+	bool done = false;
+	std::vector<char> data;
 };
 
 struct Stream_Write {
@@ -57,6 +59,8 @@ private:
     class Settings *settings;
     Local_Storage *local_storage;
     class SteamCallResults *callback_results;
+    class RunEveryRunCB *run_every_runcb;
+    Storage_IO *storage_io;
     bool steam_cloud_enabled;
     std::vector<struct Async_Read> async_reads;
     std::vector<struct Stream_Write> stream_writes;
@@ -64,13 +68,36 @@ private:
     std::map<UGCHandle_t, struct Downloaded_File> downloaded_files;
 
     public:
-Steam_Remote_Storage(class Settings *settings, Local_Storage *local_storage, class SteamCallResults *callback_results)
+static void steam_remote_storage_run_every_runcb(void *object)
+{
+    PRINT_DEBUG("steam_remote_storage_run_every_runcb\n");
+
+    Steam_Remote_Storage *steam_remote_storage = (Steam_Remote_Storage *)object;
+    steam_remote_storage->RunCallbacks();
+}
+
+Steam_Remote_Storage(class Settings *settings, Local_Storage *local_storage, class SteamCallResults *callback_results, class RunEveryRunCB *run_every_runcb)
 {
     this->settings = settings;
     this->local_storage = local_storage;
     this->callback_results = callback_results;
+    this->run_every_runcb = run_every_runcb;
     steam_cloud_enabled = true;
     local_storage->update_save_filenames(Local_Storage::remote_storage_folder);
+    storage_io = new Storage_IO(local_storage);
+    this->run_every_runcb->add(&Steam_Remote_Storage::steam_remote_storage_run_every_runcb, this);
+}
+
+~Steam_Remote_Storage()
+{
+    this->run_every_runcb->remove(&Steam_Remote_Storage::steam_remote_storage_run_every_runcb, this);
+    delete storage_io;
+}
+
+//make sure queued async writes hit the disk
+void flush_io()
+{
+    storage_io->wait_all();
 }
 
 // NOTE
@@ -89,6 +116,7 @@ bool	FileWrite( const char *pchFile, const void *pvData, int32 cubData )
     }
 
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    storage_io->wait(pchFile);
     int data_stored = local_storage->store_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubData);
     PRINT_DEBUG("Steam_Remote_Storage::Stored %i, %u\n", data_stored, data_stored == cubData);
     return data_stored == cubData;
@@ -99,6 +127,7 @@ int32	FileRead( const char *pchFile, void *pvData, int32 cubDataToRead )
     PRINT_DEBUG("Steam_Remote_Storage::FileRead %s %i\n", pchFile, cubDataToRead);
     if (!pchFile || !pvData || !cubDataToRead) return 0;
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    storage_io->wait(pchFile);
     int read_data = local_storage->get_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubDataToRead);
     if (read_data < 0) read_data = 0;
     PRINT_DEBUG("Read %i\n", read_data);
@@ -114,11 +143,16 @@ SteamAPICall_t FileWriteAsync( const char *pchFile, const void *pvData, uint32 c
     }
 
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-    bool success = local_storage->store_data(Local_Storage::remote_storage_folder, pchFile, (char* )pvData, cubData) == cubData;
-    RemoteStorageFileWriteAsyncComplete_t data;
-    data.m_eResult = success ? k_EResultOK : k_EResultFail;
+    struct Storage_IO_Job job;
+    job.type = Storage_IO_Job::WRITE;
+    job.api_call = callback_results->reserveCallResult();
+    job.folder = Local_Storage::remote_storage_folder;
+    job.file = pchFile;
+    job.data.assign((char *)pvData, (char *)pvData + cubData);
 
-    return callback_results->addCallResult(data.k_iCallback, &data, sizeof(data), 0.01);
+    SteamAPICall_t api_call = job.api_call;
+    storage_io->queue(std::move(job));
+    return api_call;
 }
 
 
@@ -128,27 +162,23 @@ SteamAPICall_t FileReadAsync( const char *pchFile, uint32 nOffset, uint32 cubToR
     PRINT_DEBUG("Steam_Remote_Storage::FileReadAsync\n");
     if (!pchFile) return k_uAPICallInvalid;
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
-
-    unsigned int size = local_storage->file_size(Local_Storage::remote_storage_folder, pchFile);
-
-    RemoteStorageFileReadAsyncComplete_t data;
-    if (size <= nOffset) {
-	    return k_uAPICallInvalid;
-    }
-
-    if ((size - nOffset) < cubToRead) cubToRead = size - nOffset;
-
+    //the worker clamps the read to the file size once the jobs queued before this one are done
     struct Async_Read a_read;
-    data.m_eResult = k_EResultOK;
-    a_read.offset = data.m_nOffset = nOffset;
-    a_read.api_call = data.m_hFileReadAsync = callback_results->reserveCallResult();
-	a_read.to_read = data.m_cubRead = cubToRead;
+    a_read.offset = nOffset;
+    a_read.api_call = callback_results->reserveCallResult();
+    a_read.to_read = cubToRead;
     a_read.file_name = std::string(pchFile);
-    a_read.size = size;
-
     async_reads.push_back(a_read);
-    callback_results->addCallResult(data.m_hFileReadAsync, data.k_iCallback, &data, sizeof(data), 0.0);
-    return data.m_hFileReadAsync;
+
+    struct Storage_IO_Job job;
+    job.type = Storage_IO_Job::READ;
+    job.api_call = a_read.api_call;
+    job.folder = Local_Storage::remote_storage_folder;
+    job.file = a_read.file_name;
+    job.offset = nOffset;
+    job.to_read = cubToRead;
+    storage_io->queue(std::move(job));
+    return a_read.api_call;
 }
 
 bool	FileReadAsyncComplete( SteamAPICall_t hReadCall, void *pvBuffer, uint32 cubToRead )
@@ -161,18 +191,10 @@ bool	FileReadAsyncComplete( SteamAPICall_t hReadCall, void *pvBuffer, uint32 cub
     if (async_reads.end() == a_read)
         return false;
 
-    if (cubToRead < a_read->to_read)
-        return false;
-
-    char *temp = new char[a_read->size];
-    int read_data = local_storage->get_data(Local_Storage::remote_storage_folder, a_read->file_name, (char* )temp, a_read->size);
-    if (read_data < a_read->to_read + a_read->offset) {
-        delete[] temp;
+    if (!a_read->done || cubToRead < a_read->to_read || a_read->data.size() < a_read->to_read)
         return false;
-    }
 
-    memcpy(pvBuffer, temp + a_read->offset, a_read->to_read);
-    delete[] temp;
+    memcpy(pvBuffer, a_read->data.data(), a_read->to_read);
     async_reads.erase(a_read);
     return true;
 }
@@ -187,6 +209,8 @@ bool	FileForget( const char *pchFile )
 bool	FileDelete( const char *pchFile )
 {
     PRINT_DEBUG("Steam_Remote_Storage::FileDelete\n");
+    std::lock_guard<std::recursive_mutex> lock(global_mutex);
+    storage_io->wait(pchFile);
     return local_storage->file_delete(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -197,6 +221,7 @@ SteamAPICall_t FileShare( const char *pchFile )
     if (!pchFile) return k_uAPICallInvalid;
     std::lock_guard<std::recursive_mutex> lock(global_mutex);
     RemoteStorageFileShareResult_t data = {};
+    storage_io->wait(pchFile);
     if (local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile)) {
         data.m_eResult = k_EResultOK;
         data.m_hFile = generate_steam_api_call_id();
@@ -250,6 +275,7 @@ bool FileWriteStreamClose( UGCFileWriteStreamHandle_t writeHandle )
     if (stream_writes.end() == request)
         return false;
 
+    storage_io->wait(request->file_name);
     local_storage->store_data(Local_Storage::remote_storage_folder, request->file_name, request->file_data.data(), request->file_data.size());
     stream_writes.erase(request);
     return true;
@@ -271,24 +297,28 @@ bool FileWriteStreamCancel( UGCFileWriteStreamHandle_t writeHandle )
 bool	FileExists( const char *pchFile )
 {
     PRINT_DEBUG("Steam_Remote_Storage::FileExists %s\n", pchFile);
+    storage_io->wait(pchFile);
     return local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile);
 }
 
 bool	FilePersisted( const char *pchFile )
 {
     PRINT_DEBUG("Steam_Remote_Storage::FilePersisted\n");
+    storage_io->wait(pchFile);
     return local_storage->file_exists(Local_Storage::remote_storage_folder, pchFile);
 }
 
 int32	GetFileSize( const char *pchFile )
 {
     PRINT_DEBUG("Steam_Remote_Storage::GetFileSize %s\n", pchFile);
+    storage_io->wait(pchFile);
     return local_storage->file_size(Local_Storage::remote_storage_folder, pchFile);
 }
 
 int64	GetFileTimestamp( const char *pchFile )
 {
     PRINT_DEBUG("Steam_Remote_Storage::GetFileTimestamp\n");
+    storage_io->wait(pchFile);
     return local_storage->file_timestamp(Local_Storage::remote_storage_folder, pchFile);
 }
 
@@ -303,6 +333,7 @@ ERemoteStoragePlatform GetSyncPlatforms( const char *pchFile )
 int32 GetFileCount()
 {
     PRINT_DEBUG("Steam_Remote_Storage::GetFileCount\n");
+    storage_io->wait_all();
     int32 num = local_storage->count_files(Local_Storage::remote_storage_folder);
     PRINT_DEBUG("Steam_Remote_Storage::File count: %i\n", num);
     return num;
@@ -312,6 +343,7 @@ const char *GetFileNameAndSize( int iFile, int32 *pnFileSizeInBytes )
 {
     PRINT_DEBUG("Steam_Remote_Storage::GetFileNameAndSize %i\n", iFile);
     static char output_filename[MAX_FILENAME_LENGTH];
+    storage_io->wait_all();
     if (local_storage->iterate_file(Local_Storage::remote_storage_folder, iFile, output_filename, pnFileSizeInBytes)) {
         PRINT_DEBUG("Steam_Remote_Storage::Name: |%s|, size: %i\n", output_filename, pnFileSizeInBytes ? *pnFileSizeInBytes : 0);
         return output_filename;
@@ -442,6 +474,7 @@ int32	UGCRead( UGCHandle_t hContent, void *pvData, int32 cubDataToRead, uint32 c
     }
 
     Downloaded_File f = downloaded_files[hContent];
+    storage_io->wait(f.file);
     int read_data = local_storage->get_data(Local_Storage::remote_storage_folder, f.file, (char* )pvData, cubDataToRead, cOffset);
 
     if (eAction == k_EUGCRead_Close || (eAction == k_EUGCRead_ContinueReadingUntilFinished && (read_data < cubDataToRead || (cOffset + cubDataToRead) >= f.total_size))) {
@@ -789,5 +822,32 @@ bool EndFileWriteBatch()
     return true;
 }
 
+void RunCallbacks()
+{
+    std::vector<struct Storage_IO_Job> jobs = storage_io->take_completed();
+    for (auto &job : jobs) {
+        if (job.type == Storage_IO_Job::WRITE) {
+            RemoteStorageFileWriteAsyncComplete_t data;
+            data.m_eResult = (job.result == job.data.size()) ? k_EResultOK : k_EResultFail;
+            callback_results->addCallResult(job.api_call, data.k_iCallback, &data, sizeof(data), 0.0);
+        } else if (job.type == Storage_IO_Job::READ) {
+            RemoteStorageFileReadAsyncComplete_t data;
+            data.m_hFileReadAsync = job.api_call;
+            data.m_nOffset = job.offset;
+            data.m_cubRead = job.data.size();
+            data.m_eResult = (job.result >= 0) ? k_EResultOK : k_EResultFail;
+
+            auto a_read = std::find_if(async_reads.begin(), async_reads.end(), [&job](Async_Read const& item) { return item.api_call == job.api_call; });
+            if (a_read != async_reads.end()) {
+                a_read->to_read = job.data.size();
+                a_read->data = std::move(job.data);
+                a_read->done = true;
+            }
+
+            callback_results->addCallResult(job.api_call, data.k_iCallback, &data, sizeof(data), 0.0);
+        }
+    }
+}
+
 
 };
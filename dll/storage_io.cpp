@@ -0,0 +1,131 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#include "storage_io.h"
+
+#define STORAGE_IO_WORKERS 2
+
+Storage_IO::Storage_IO(Local_Storage *local_storage)
+{
+    this->local_storage = local_storage;
+    queues.resize(STORAGE_IO_WORKERS);
+    for (unsigned i = 0; i < STORAGE_IO_WORKERS; ++i) {
+        workers.push_back(std::thread(&Storage_IO::worker_thread, this, i));
+    }
+}
+
+Storage_IO::~Storage_IO()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+
+    //workers finish everything that was queued before exiting
+    queued_cv.notify_all();
+    for (auto &w : workers) {
+        w.join();
+    }
+}
+
+void Storage_IO::worker_thread(unsigned index)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        queued_cv.wait(lock, [this, index]() { return stop || !queues[index].empty(); });
+        if (queues[index].empty()) return;
+
+        struct Storage_IO_Job job = std::move(queues[index].front());
+        queues[index].pop();
+        lock.unlock();
+
+        if (job.type == Storage_IO_Job::WRITE) {
+            job.result = local_storage->store_data(job.folder, job.file, job.data.data(), job.data.size());
+        } else if (job.type == Storage_IO_Job::READ) {
+            //the size is resolved here so the game thread never waits on earlier jobs for the file
+            unsigned int size = local_storage->file_size(job.folder, job.file);
+            if (size <= job.offset) {
+                job.to_read = 0;
+                job.result = -1;
+            } else {
+                if ((size - job.offset) < job.to_read) job.to_read = size - job.offset;
+                job.data.resize(job.to_read);
+                job.result = local_storage->get_data(job.folder, job.file, job.data.data(), job.to_read, job.offset);
+            }
+
+            job.data.resize(job.result > 0 ? job.result : 0);
+        }
+
+        PRINT_DEBUG("Storage_IO::job done %u %s %i\n", job.type, job.file.c_str(), job.result);
+        lock.lock();
+        auto p = pending.find(job_key(job.file));
+        if (p != pending.end() && --(p->second) == 0) {
+            pending.erase(p);
+        }
+
+        --pending_total;
+        completed.push_back(std::move(job));
+        done_cv.notify_all();
+    }
+}
+
+std::string Storage_IO::job_key(std::string const &file)
+{
+    return Local_Storage::sanitized_file_name(file);
+}
+
+void Storage_IO::queue(struct Storage_IO_Job job)
+{
+    std::string key = job_key(job.file);
+    unsigned index = std::hash<std::string>()(key) % queues.size();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++pending[key];
+        ++pending_total;
+        queues[index].push(std::move(job));
+    }
+
+    queued_cv.notify_all();
+}
+
+bool Storage_IO::is_pending(std::string const &file)
+{
+    std::string key = job_key(file);
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending.count(key) > 0;
+}
+
+void Storage_IO::wait(std::string const &file)
+{
+    std::string key = job_key(file);
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this, &key]() { return pending.count(key) == 0; });
+}
+
+void Storage_IO::wait_all()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [this]() { return pending_total == 0; });
+}
+
+std::vector<struct Storage_IO_Job> Storage_IO::take_completed()
+{
+    std::vector<struct Storage_IO_Job> out;
+    std::lock_guard<std::mutex> lock(mutex);
+    out.swap(completed);
+    return out;
+}
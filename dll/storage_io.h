@@ -0,0 +1,67 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+#ifndef STORAGE_IO_INCLUDE
+#define STORAGE_IO_INCLUDE
+
+#include "base.h"
+
+struct Storage_IO_Job {
+    enum Types {
+        WRITE,
+        READ
+    };
+
+    Types type;
+    SteamAPICall_t api_call;
+    std::string folder;
+    std::string file;
+    std::vector<char> data;
+    uint32 offset = 0;
+    uint32 to_read = 0;
+    int result = -1;
+};
+
+//Runs Local_Storage reads and writes on worker threads so the game thread only pays for a copy.
+//Jobs are sharded on the sanitized file name so all jobs for one file on disk run on the same worker in the order they were queued.
+class Storage_IO {
+    Local_Storage *local_storage;
+    std::vector<std::thread> workers;
+    std::vector<std::queue<struct Storage_IO_Job>> queues;
+    std::vector<struct Storage_IO_Job> completed;
+    std::map<std::string, unsigned> pending;
+    unsigned pending_total = 0;
+    bool stop = false;
+
+    std::mutex mutex;
+    std::condition_variable queued_cv, done_cv;
+
+    void worker_thread(unsigned index);
+    static std::string job_key(std::string const &file);
+public:
+    Storage_IO(Local_Storage *local_storage);
+    ~Storage_IO();
+
+    void queue(struct Storage_IO_Job job);
+    bool is_pending(std::string const &file);
+    //block until every queued job touching file is done
+    void wait(std::string const &file);
+    void wait_all();
+    std::vector<struct Storage_IO_Job> take_completed();
+};
+
+#endif
@@ -0,0 +1,331 @@
+/* Copyright (C) 2019 Mr Goldberg
+   This file is part of the Goldberg Emulator
+
+   The Goldberg Emulator is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   The Goldberg Emulator is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with the Goldberg Emulator; if not, see
+   <http://www.gnu.org/licenses/>.  */
+
+//Simulates LAN discovery (Networking::handle_announce and send_announce_broadcasts) between many peers on one
+//broadcast domain, with the same decisions from dll/gossip.h, and compares it with every peer answering every
+//broadcast with its whole peer list like before.
+//usage: gossip_simulation [peers] [seconds] [seed]
+//the last peer joins late, it is the one the join numbers are for. exits with 1 if the gossip run breaks
+//a guarantee: everyone has to find everyone and no broadcast interval can reach USER_TIMEOUT
+
+#include "dll/gossip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <vector>
+
+//rough serialized sizes of a Common_Message with an Announce and of one Announce.Other_Peers entry
+#define ANNOUNCE_BYTES 90
+#define PEER_ENTRY_BYTES 27
+#define LATENCY 0.001
+#define STARTUP_SPREAD 5.0
+#define APPID 480
+
+struct Peer {
+    bool started = false;
+    double next_broadcast = 0;
+    uint64_t peer_seq = 0;
+    uint64_t digest = 0;
+    uint32_t count = 1;
+    //per other peer, the equivalent of the fields of struct Connection
+    std::vector<char> exists, udp_pinged;
+    std::vector<uint64_t> learned_seq, gossip_sent_seq;
+    std::vector<double> pinged;
+};
+
+struct Message {
+    bool request, direct;
+    int from, to;
+    uint64_t digest;
+    uint32_t count;
+    std::shared_ptr<std::vector<int>> peers;
+};
+
+struct Event {
+    double time;
+    uint64_t order;
+    Message msg;
+    bool operator<(Event const &other) const { return time != other.time ? time > other.time : order > other.order; }
+};
+
+struct Results {
+    uint64_t messages = 0, bytes = 0, pong_bytes = 0;
+    uint64_t joiner_messages = 0, joiner_bytes = 0;
+    double converged = -1, joiner_converged = -1;
+    double max_interval = 0;
+};
+
+class Simulation {
+    bool gossip;
+    int n;
+    double duration, join_time;
+    std::vector<Peer> peers;
+    std::priority_queue<Event> events;
+    uint64_t order = 0;
+    std::mt19937 random;
+    Results results;
+
+    static uint64_t id(int peer) { return 76561197960265728ULL + peer; }
+
+    static size_t size(Message const &msg) { return ANNOUNCE_BYTES + (msg.peers ? msg.peers->size() * PEER_ENTRY_BYTES : 0); }
+
+    void deliver(double now, Message msg)
+    {
+        if (msg.to == n - 1 && now >= join_time) {
+            ++results.joiner_messages;
+            results.joiner_bytes += size(msg);
+        }
+
+        Event event;
+        event.time = now + LATENCY;
+        event.order = order++;
+        event.msg = msg;
+        events.push(event);
+    }
+
+    void send(double now, Message msg)
+    {
+        ++results.messages;
+        results.bytes += size(msg);
+        if (!msg.request) results.pong_bytes += size(msg);
+        deliver(now, msg);
+    }
+
+    Message announce(int from, int to, bool request)
+    {
+        Message msg;
+        msg.request = request;
+        msg.direct = false;
+        msg.from = from;
+        msg.to = to;
+        msg.digest = peers[from].digest;
+        msg.count = peers[from].count;
+        return msg;
+    }
+
+    Message direct(int from, int to)
+    {
+        Message msg = announce(from, to, true);
+        msg.direct = true;
+        return msg;
+    }
+
+    //Networking::create_announce for a PONG
+    Message pong(int from, int to, bool with_peers)
+    {
+        Peer &p = peers[from];
+        Message msg = announce(from, to, false);
+        msg.peers = std::make_shared<std::vector<int>>();
+        if (!with_peers) return msg;
+        for (int c = 0; c < n; ++c) {
+            if (!p.udp_pinged[c]) continue;
+            if (gossip && c != to && p.learned_seq[c] <= p.gossip_sent_seq[to]) continue;
+            msg.peers->push_back(c);
+        }
+
+        if (gossip) p.gossip_sent_seq[to] = p.peer_seq;
+        return msg;
+    }
+
+    //Networking::answer_announce
+    bool answer(int self, int from, Message const &msg)
+    {
+        Peer &p = peers[self];
+        if (!gossip || msg.direct || !p.udp_pinged[from]) return true;
+        if (msg.digest == p.digest) return false;
+
+        bool delta = false;
+        for (int c = 0; c < n; ++c) {
+            if (c != from && p.udp_pinged[c] && p.learned_seq[c] > p.gossip_sent_seq[from]) {
+                delta = true;
+                break;
+            }
+        }
+
+        if (!delta) return false;
+        return gossip_selected(std::max(msg.count, p.count - 1), random);
+    }
+
+    //Networking::share_peers
+    bool share(int self, int from)
+    {
+        if (!gossip || peers[self].udp_pinged[from]) return true;
+        return gossip_selected(peers[self].count - 1, random);
+    }
+
+    void receive(double now, Message const &msg)
+    {
+        int self = msg.to, from = msg.from;
+        Peer &p = peers[self];
+        if (!p.started) return;
+        p.exists[from] = true;
+
+        if (msg.peers) {
+            for (int listed : *msg.peers) {
+                if (listed == self || p.exists[listed]) continue;
+                if (gossip && p.pinged[listed] >= 0 && now - p.pinged[listed] < BROADCAST_INTERVAL) continue;
+                p.pinged[listed] = now;
+                send(now, direct(self, listed));
+            }
+        }
+
+        if (msg.request) {
+            if (answer(self, from, msg)) {
+                bool with_peers = share(self, from);
+                send(now, pong(self, from, with_peers));
+            }
+
+            if (!p.udp_pinged[from]) send(now, direct(self, from));
+        } else if (!p.udp_pinged[from]) {
+            p.udp_pinged[from] = true;
+            p.learned_seq[from] = ++p.peer_seq;
+            p.digest += gossip_mix(id(from), APPID);
+            ++p.count;
+        }
+    }
+
+    void broadcast(double now, int self)
+    {
+        Peer &p = peers[self];
+        //one packet on the wire that every peer gets a copy of
+        ++results.messages;
+        results.bytes += ANNOUNCE_BYTES;
+        for (int other = 0; other < n; ++other) {
+            if (other != self) deliver(now, announce(self, other, true));
+        }
+
+        double interval = gossip ? gossip_broadcast_interval(p.count - 1, random) : BROADCAST_INTERVAL;
+        results.max_interval = std::max(results.max_interval, interval);
+        p.next_broadcast = now + interval;
+    }
+
+    bool everyone_knows(int peer)
+    {
+        for (int other = 0; other < n; ++other) {
+            if (other == peer) continue;
+            if (!peers[peer].udp_pinged[other] || !peers[other].udp_pinged[peer]) return false;
+        }
+
+        return true;
+    }
+
+public:
+    Simulation(bool gossip, int n, double duration, unsigned seed)
+    {
+        this->gossip = gossip;
+        this->n = n;
+        this->duration = duration;
+        this->join_time = duration * 2 / 3;
+        random.seed(seed);
+
+        peers.resize(n);
+        std::uniform_real_distribution<double> start(0.0, STARTUP_SPREAD);
+        for (int i = 0; i < n; ++i) {
+            Peer &p = peers[i];
+            p.exists.assign(n, false);
+            p.udp_pinged.assign(n, false);
+            p.learned_seq.assign(n, 0);
+            p.gossip_sent_seq.assign(n, 0);
+            p.pinged.assign(n, -1);
+            p.digest = gossip_mix(id(i), APPID);
+            p.next_broadcast = i == n - 1 ? join_time : start(random);
+        }
+    }
+
+    Results run()
+    {
+        //broadcasts and deliveries are handled in time order
+        typedef std::pair<double, int> Scheduled;
+        std::priority_queue<Scheduled, std::vector<Scheduled>, std::greater<Scheduled>> broadcasts;
+        for (int i = 0; i < n; ++i) broadcasts.push(Scheduled(peers[i].next_broadcast, i));
+
+        while (true) {
+            double broadcast_time = broadcasts.empty() ? duration : broadcasts.top().first;
+            double event_time = events.empty() ? duration : events.top().time;
+            double now = std::min(broadcast_time, event_time);
+            if (now >= duration) break;
+
+            if (broadcast_time <= event_time) {
+                int i = broadcasts.top().second;
+                broadcasts.pop();
+                peers[i].started = true;
+                broadcast(now, i);
+                broadcasts.push(Scheduled(peers[i].next_broadcast, i));
+            } else {
+                Event event = events.top();
+                events.pop();
+                receive(event.time, event.msg);
+            }
+
+            //count is one more than the peers found so everyone but the joiner has found the others at n - 1
+            if (results.converged < 0 && now < join_time) {
+                bool all = true;
+                for (int i = 0; i < n - 1 && all; ++i) {
+                    if (peers[i].count < (uint32_t)n - 1) all = false;
+                }
+
+                if (all) results.converged = now;
+            }
+
+            if (results.joiner_converged < 0 && now > join_time && peers[n - 1].count == (uint32_t)n && everyone_knows(n - 1)) results.joiner_converged = now - join_time;
+        }
+
+        return results;
+    }
+};
+
+//packets and bytes are what goes on the wire, the join numbers are what the late peer receives including broadcasts
+static void print(const char *name, Results const &r, double duration)
+{
+    printf("%-8s %10llu %12.1f %12.1f %12llu %12llu %10.3f %10.3f %10.2f\n", name, (unsigned long long)r.messages, r.bytes / 1024.0 / duration,
+           r.pong_bytes / 1024.0 / duration, (unsigned long long)r.joiner_messages, (unsigned long long)r.joiner_bytes, r.converged, r.joiner_converged, r.max_interval);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 500;
+    double duration = argc > 2 ? atof(argv[2]) : 60.0;
+    unsigned seed = argc > 3 ? atoi(argv[3]) : 1;
+    if (n < 3 || duration <= STARTUP_SPREAD * 3) {
+        fprintf(stderr, "usage: %s [peers >= 3] [seconds > %.0f] [seed]\n", argv[0], STARTUP_SPREAD * 3);
+        return 2;
+    }
+
+    printf("%d peers on one LAN for %.0f s, the last one joins at %.0f s\n", n, duration, duration * 2 / 3);
+    printf("%-8s %10s %12s %12s %12s %12s %10s %10s %10s\n", "mode", "packets", "KiB/s", "pong KiB/s", "join pkts", "join bytes", "converged", "join conv", "max intvl");
+
+    Results legacy = Simulation(false, n, duration, seed).run();
+    print("legacy", legacy, duration);
+    Results gossip = Simulation(true, n, duration, seed).run();
+    print("gossip", gossip, duration);
+
+    bool ok = true;
+    if (gossip.converged < 0 || gossip.joiner_converged < 0) {
+        printf("FAIL: not every peer found every other peer\n");
+        ok = false;
+    }
+
+    if (gossip.max_interval >= USER_TIMEOUT) {
+        printf("FAIL: a broadcast interval of %.2f s is not below USER_TIMEOUT %.2f s\n", gossip.max_interval, USER_TIMEOUT);
+        ok = false;
+    }
+
+    return ok ? 0 : 1;
+}